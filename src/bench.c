@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "utils.h"
+
+#define SERVER_IP "::1"
+#define PORTNO 6969
+#define MAX_BENCH_CLIENTS 7 /* As many as the server takes. */
+#define WHISPER_EVERY 10 /* One line in this many is a whisper. */
+#define LIST_EVERY 50 /* And one in this many, a !list. */
+#define PUBLIC_MARK "msg " /* Starts every public message we send. */
+#define STALL_TIMEOUT 10000 /* Milliseconds without progress before giving up. */
+
+/*
+ * One of the users of the chat we play.
+ */
+typedef struct {
+	int fd;
+	int id;
+	int binary; /* Every other one gets frames. */
+	long step; /* Lines of the script written so far. */
+	long received; /* Public messages from the others. */
+	char out[BUFF_SIZE]; /* Line being written. */
+	size_t out_len;
+	size_t out_off;
+	Line_buffer_t lb;
+} Bench_client_t;
+
+static int join(Bench_client_t *);
+static void *run_client(void *);
+static void next_line(Bench_client_t *);
+static int read_messages(Bench_client_t *);
+static long public_messages(void);
+static double now(void);
+static void print_usage(const char *);
+
+static long g_port = PORTNO;
+static long g_clients = MAX_BENCH_CLIENTS - 1;
+static long g_lines = 20000; /* Script of each client. */
+
+/*
+ * Plays a busy chat against a server on this host and tells how many
+ * public messages it delivered per second. Every client joins first,
+ * then all of them write their script as fast as the server takes it:
+ * mostly public messages, with some whispers and !list in between. It
+ * is over once everyone has got the public messages of everyone else.
+ */
+int
+main(int argc, char *argv[])
+{
+	Bench_client_t clients[MAX_BENCH_CLIENTS];
+	pthread_t threads[MAX_BENCH_CLIENTS];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:p:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (parse_long(optarg, 2, MAX_BENCH_CLIENTS, &g_clients) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			if (parse_long(optarg, 1, 100000000, &g_lines) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			if (parse_long(optarg, 1, UINT16_MAX, &g_port) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int i = 0; i < g_clients; ++i) {
+		clients[i].id = i;
+		clients[i].binary = i % 2;
+
+		if (join(&clients[i]) == -1) {
+			perror("Error joining the chat: ");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double start = now();
+
+	for (int i = 0; i < g_clients; ++i)
+		if (pthread_create(&threads[i], NULL, run_client, &clients[i]) != 0) {
+			fprintf(stderr, "Error creating client thread.\n");
+			exit(EXIT_FAILURE);
+		}
+
+	int failed = 0;
+
+	for (int i = 0; i < g_clients; ++i) {
+		void *res;
+
+		pthread_join(threads[i], &res);
+		failed |= res != NULL;
+	}
+
+	double elapsed = now() - start;
+	long delivered = (g_clients - 1) * g_clients * public_messages();
+
+	for (int i = 0; i < g_clients; ++i)
+		close(clients[i].fd);
+
+	if (failed) {
+		fprintf(stderr, "The server stopped delivering messages.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%ld messages delivered in %.3f s: %.0f per second.\n", delivered, elapsed,
+	       delivered / elapsed);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * @brief Connects client C and gets it through the handshake.
+ *
+ * @param[in out] c
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+static int
+join(Bench_client_t *c)
+{
+	struct sockaddr_in6 sa6 = { .sin6_family = AF_INET6, .sin6_port = htons(g_port) };
+	char buff[BUFF_SIZE];
+	int len;
+
+	if (inet_pton(AF_INET6, SERVER_IP, &sa6.sin6_addr) <= 0)
+		return -1;
+
+	if ((c->fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(c->fd, (struct sockaddr *) &sa6, sizeof(sa6)) == -1)
+		return -1;
+
+	len = snprintf(buff, sizeof(buff), "bench%d%s\n", c->id, c->binary ? " " BINARY_OPT : "");
+
+	if (send(c->fd, buff, len, 0) != len)
+		return -1;
+
+	/* One for the connection, one for the name. */
+	for (int i = 0; i < 2; ++i) {
+		if (recv_line(c->fd, buff, sizeof(buff)) <= 0)
+			return -1;
+
+		if (strcmp(buff, OK_STATUS) != 0) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	c->step = 0;
+	c->received = 0;
+	c->out_len = 0;
+	c->out_off = 0;
+	c->lb.start = 0;
+	c->lb.end = 0;
+
+	return fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1 ? -1 : 0;
+}
+
+/*
+ * @brief Writes the script of a client while reading whatever comes,
+ * until both are done.
+ *
+ * @param[in] arg The client.
+ *
+ * @return NULL ok; anything else if the server stalled or went away.
+ */
+static void *
+run_client(void *arg)
+{
+	Bench_client_t *c = (Bench_client_t *) arg;
+	long expected = (g_clients - 1) * public_messages();
+
+	while (c->step < g_lines || c->out_off < c->out_len || c->received < expected) {
+		struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+
+		if (c->out_off == c->out_len && c->step < g_lines)
+			next_line(c);
+
+		if (c->out_off < c->out_len)
+			pfd.events |= POLLOUT;
+
+		int res = poll(&pfd, 1, STALL_TIMEOUT);
+
+		if (res == 0 || (res == -1 && errno != EINTR))
+			return c;
+
+		if ((pfd.revents & POLLIN) && read_messages(c) == -1)
+			return c;
+
+		if (pfd.revents & POLLOUT) {
+			ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, 0);
+
+			if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return c;
+
+			if (n > 0)
+				c->out_off += n;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Prepares the next line of the script of C.
+ *
+ * @param[in out] c
+ */
+static void
+next_line(Bench_client_t *c)
+{
+	long step = c->step++;
+	int len;
+
+	if (step % LIST_EVERY == LIST_EVERY - 1)
+		len = snprintf(c->out, sizeof(c->out), LIST_CMD "\n");
+	else if (step % WHISPER_EVERY == WHISPER_EVERY - 1)
+		len = snprintf(c->out, sizeof(c->out), WHISP_CMD " bench%ld psst %ld\n",
+			       (c->id + 1) % g_clients, step);
+	else
+		len = snprintf(c->out, sizeof(c->out), PUBLIC_MARK "%ld from bench%d, lorem ipsum dolor sit amet\n",
+			       step, c->id);
+
+	c->out_len = len;
+	c->out_off = 0;
+}
+
+/*
+ * @brief Reads everything there is for C, counting the public messages.
+ *
+ * @param[in out] c
+ *
+ * @return 0 ok; -1 if the connection is gone.
+ */
+static int
+read_messages(Bench_client_t *c)
+{
+	while (1) {
+		ssize_t res = line_buffer_fill(&c->lb, c->fd);
+
+		if (res == 0)
+			return -1;
+
+		if (res == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+		char *data;
+		char type;
+		size_t len;
+
+		if (c->binary) {
+			while ((data = line_buffer_frame(&c->lb, &type, &len)))
+				c->received += type == FRAME_MESSAGE;
+		} else {
+			while ((data = line_buffer_next(&c->lb)))
+				c->received += strstr(data, ": " PUBLIC_MARK) != NULL;
+		}
+	}
+}
+
+/*
+ * @return Public messages in the script of each client.
+ */
+static long
+public_messages(void)
+{
+	long n = g_lines;
+
+	for (long step = 0; step < g_lines; ++step)
+		if (step % LIST_EVERY == LIST_EVERY - 1 || step % WHISPER_EVERY == WHISPER_EVERY - 1)
+			--n;
+
+	return n;
+}
+
+/*
+ * @return Seconds from the monotonic clock.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief Prints the command line options.
+ *
+ * @param[in] prog Name of the program.
+ */
+static void
+print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-c clients] [-n lines]\n", prog);
+	fprintf(stderr, "  -p port     Port of the server, on this host (default %d).\n", PORTNO);
+	fprintf(stderr, "  -c clients  From 2 to %d (default %d).\n", MAX_BENCH_CLIENTS, MAX_BENCH_CLIENTS - 1);
+	fprintf(stderr, "  -n lines    Each client writes (default 20000).\n");
+}
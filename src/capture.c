@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "capture.h"
+#include "utils.h"
+
+static uint64_t capture_now(void);
+
+/*
+ * @brief Starts a capture in PATH, overwriting whatever was there.
+ *
+ * @param[in] path
+ *
+ * @return The capture; NULL on error, with errno set.
+ */
+Capture_t *
+capture_open(const char *path)
+{
+	Capture_t *c = malloc(sizeof(Capture_t));
+
+	if (!c)
+		return NULL;
+
+	if (!(c->file = fopen(path, "w")) || fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE, 1, c->file) != 1) {
+		int e = errno;
+
+		if (c->file)
+			fclose(c->file);
+
+		free(c);
+		errno = e;
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->mutex, NULL);
+	c->start = capture_now();
+
+	return c;
+}
+
+/*
+ * @brief Appends an event to the capture, timestamped now. Records are
+ * buffered: they reach the file in batches, and all of them once the
+ * capture is closed.
+ *
+ * @param[in out] c
+ * @param[in] conn Connection it happened on.
+ * @param[in] type A Capture_type.
+ * @param[in] data May be NULL if LEN is 0.
+ * @param[in] len Cut to CAPTURE_MAX_DATA.
+ */
+void
+capture_record(Capture_t *c, const uint32_t conn, const char type, const char *data, size_t len)
+{
+	char header[CAPTURE_HEADER_SIZE];
+
+	if (len > CAPTURE_MAX_DATA)
+		len = CAPTURE_MAX_DATA;
+
+	header[12] = type;
+	put_be(header + 8, conn, 4);
+	put_be(header + 13, len, 2);
+
+	pthread_mutex_lock(&c->mutex);
+
+	if (!c->file) {
+		pthread_mutex_unlock(&c->mutex);
+		return;
+	}
+
+	/* Timestamped with the lock held, so they are in order in the file. */
+	put_be(header, capture_now() - c->start, 8);
+
+	if (fwrite(header, sizeof(header), 1, c->file) != 1 || (len && fwrite(data, len, 1, c->file) != 1))
+		perror("Error writing the capture: ");
+
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+ * @brief Writes what is left of the capture and closes its file. C
+ * itself stays around: threads still running may call capture_record(),
+ * which drops their events from then on.
+ *
+ * @param[in out] c
+ *
+ * @return 0 ok; -1 if some of it couldn't be written, with errno set.
+ */
+int
+capture_close(Capture_t *c)
+{
+	pthread_mutex_lock(&c->mutex);
+
+	int res = c->file && fclose(c->file) != 0 ? -1 : 0;
+
+	c->file = NULL;
+	pthread_mutex_unlock(&c->mutex);
+
+	return res;
+}
+
+/*
+ * @brief Opens the capture in PATH to read its records.
+ *
+ * @param[in] path
+ *
+ * @return The file, past the magic; NULL on error, with errno set. EINVAL
+ * means it is not a capture.
+ */
+FILE *
+capture_open_read(const char *path)
+{
+	char magic[CAPTURE_MAGIC_SIZE];
+	FILE *file = fopen(path, "r");
+
+	if (!file)
+		return NULL;
+
+	if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+		fclose(file);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return file;
+}
+
+/*
+ * @brief Reads the next record of a capture.
+ *
+ * @param[in] file
+ * @param[in out] r
+ *
+ * @return 1 ok; 0 at the end; -1 if the file is cut short or can't be
+ * read.
+ */
+int
+capture_read(FILE *file, Capture_record_t *r)
+{
+	char header[CAPTURE_HEADER_SIZE];
+	size_t n = fread(header, 1, sizeof(header), file);
+
+	if (n == 0 && !ferror(file))
+		return 0;
+
+	if (n != sizeof(header))
+		return -1;
+
+	r->time = get_be(header, 8);
+	r->conn = get_be(header + 8, 4);
+	r->type = header[12];
+	r->len = get_be(header + 13, 2);
+
+	if (r->len && fread(r->data, r->len, 1, file) != 1)
+		return -1;
+
+	r->data[r->len] = '\0';
+
+	return 1;
+}
+
+/*
+ * @return Nanoseconds from the monotonic clock.
+ */
+static uint64_t
+capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A capture file starts with CAPTURE_MAGIC and goes on with one record
+ * per event: the nanoseconds since the capture started as a u64, the
+ * connection as a u32, the type as a byte, the length of the data as a
+ * u16 and the data. Numbers are in network byte order.
+ */
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_HEADER_SIZE (8 + 4 + 1 + 2)
+#define CAPTURE_MAX_DATA UINT16_MAX
+
+typedef enum {
+	CAPTURE_OPEN = 'O', /* A connection got accepted. */
+	CAPTURE_LINE = 'L', /* It sent a line, without the newline. */
+	CAPTURE_CLOSE = 'C' /* It went away. */
+} Capture_type;
+
+typedef struct {
+	uint64_t time;
+	uint32_t conn;
+	char type;
+	size_t len;
+	char data[CAPTURE_MAX_DATA + 1]; /* NUL-terminated. */
+} Capture_record_t;
+
+typedef struct {
+	FILE *file; /* NULL once closed. */
+	pthread_mutex_t mutex;
+	uint64_t start; /* Nanoseconds, CLOCK_MONOTONIC. */
+} Capture_t;
+
+Capture_t *capture_open(const char *);
+void capture_record(Capture_t *, const uint32_t, const char, const char *, size_t);
+int capture_close(Capture_t *);
+FILE *capture_open_read(const char *);
+int capture_read(FILE *, Capture_record_t *);
@@ -2,38 +2,50 @@
 
 #include <signal.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <poll.h>
 #include "common.h"
 #include "user.h"
+#include "shmring.h"
 
 #define SERVER_IP "::1"
 #define PORTNO 6969
 #define QUIT_CMD "!quit"
+#define PROMPT "> "
+#define RENDER_FPS 60 /* Default redraws per second. */
+#define RECONNECT_ATTEMPTS 8
+#define SHM_RETRY_MS 1 /* Between looks at a full ring, for room. */
+#define RECONNECT_DELAY 250 /* Milliseconds before the first attempt; doubles after each one. */
 
 typedef enum {
 	CONN_SOCKET_ERR,
 	CONN_PTON_ERR,
 	CONN_CONNECT_ERR,
+	CONN_SEND_ERR,
 	CONN_RECV_ERR,
 	CONN_SV_FULL_ERR,
+	CONN_SV_BUSY_ERR,
 	CONN_OK
 } Connection_status_codes;
 
 typedef struct {
 	Connection_status_codes conn_err;
 	int system_errno;
+	int retry_after; /* Seconds the server asked us to wait, if busy. */
 } Connection_status_codes_wrapper;
 
 typedef enum {
-	REGUSR_SEND_ERR,
 	REGUSR_RECV_ERR,
 	REGUSR_NAME_EXISTS_ERR,
 	REGUSR_OK
@@ -42,28 +54,138 @@ typedef enum {
 typedef struct {
 	Register_user_status_codes reg_err;
 	int system_errno;
+	int deflate; /* The server agreed to compress what it sends. */
 } Register_user_status_codes_wrapper;
 
 typedef struct {
 	User_t *user;
 	int sfd; /* Server to which the client is connected. */
+	Shm_link_t *shm; /* Set if we talk to the server through shared memory. */
+	Inflater_t *z; /* Set if the server compresses what it sends. */
 } Client_data_t;
 
+/*
+ * Messages received since the terminal was last redrawn.
+ */
+typedef struct {
+	char *data;
+	size_t start; /* First byte still to be drawn. */
+	size_t len;
+	size_t cap;
+	size_t lines; /* Lines between START and LEN. */
+	size_t skipped; /* Lines dropped because we fell behind. */
+	struct timespec last; /* When we last redrew. */
+} Render_t;
+
+/*
+ * Someone in the chatroom, as told by FRAME_JOIN.
+ */
+typedef struct {
+	uint32_t id; /* 0 if the slot is free. */
+	uint8_t colour;
+	char name[NAME_SIZE];
+} Member_t;
+
+/*
+ * Members by id, with open addressing. CAP is a power of two.
+ */
+typedef struct {
+	Member_t *slots;
+	size_t count;
+	size_t cap;
+} Members_t;
+
 static Connection_status_codes_wrapper connect_to_server(struct sockaddr_in6 *,
-							 size_t, int *);
-static Register_user_status_codes_wrapper register_user(User_t *, const int);
-static void *listen_from_server(void *);
-static void *prompt_user(void *);
-static void sig_quit_program(int);
+							 size_t, int *,
+							 const User_t *);
+static Register_user_status_codes_wrapper register_user(const int);
+static void run_event_loop(Client_data_t *, const int);
+static int read_server(Client_data_t *, Line_buffer_t *, Render_t *);
+static int read_shm(Client_data_t *, Render_t *);
+static void server_frame(Client_data_t *, Render_t *, const char, const char *, const size_t);
+static void server_line(Client_data_t *, Render_t *, const char *);
+static void send_server(Client_data_t *, const char *, const size_t);
+static Member_t *member_find(const uint32_t);
+static Member_t *member_find_free(const uint32_t);
+static int member_add(const uint32_t, const uint8_t, const char *, const size_t);
+static void member_remove(const uint32_t);
+static int reconnect(Client_data_t *, const int);
+static int start_inflate(Client_data_t *, const int);
+static void render_append(Render_t *, const char *, const size_t);
+static int render_timeout(const Render_t *);
+static void render_flush(Render_t *);
+static int read_user(Client_data_t *, Line_buffer_t *);
 static void print_welcome(void);
+static void print_usage(const char *);
 static int setup_signals(void);
 static void cleanup(int);
 
-volatile sig_atomic_t g_quit = 0;
+static const char *g_socket_path = NULL; /* Unix domain socket of the server. */
+static long g_port = PORTNO;
+static int g_use_shm = 0; /* Ask the server for a shared memory link. */
+static int g_use_deflate = 0; /* Ask the server to compress what it sends. */
+static long g_fps = RENDER_FPS; /* Redraws per second at most; 0 means no limit. */
+static long g_max_lines = 0; /* Lines kept per redraw; 0 keeps them all. */
+static char g_token[SESSION_TOKEN_SIZE] = ""; /* Session to resume if we lose the connection. */
+static unsigned long g_last_seq = 0; /* Last public message we got. */
+static Members_t g_members = { NULL, 0, 0 }; /* Who is behind the ids in messages. */
+static uint64_t g_history_left = 0; /* Bytes of log still to come, after FRAME_HISTORY. */
 
 int
-main(void)
+main(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "mp:r:s:u:zh")) != -1) {
+		switch (opt) {
+		case 'u':
+			if (strlen(optarg) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+				fprintf(stderr, "The socket path is too long.\n");
+				exit(EXIT_FAILURE);
+			}
+			g_socket_path = optarg;
+			break;
+		case 'm':
+			g_use_shm = 1;
+			break;
+		case 'z':
+			g_use_deflate = 1;
+			break;
+		case 'p':
+			if (parse_long(optarg, 1, UINT16_MAX, &g_port) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			if (parse_long(optarg, 0, 1000, &g_fps) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if (parse_long(optarg, 0, 1000000, &g_max_lines) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (g_use_shm && !g_socket_path) {
+		fprintf(stderr, "Shared memory needs the server's unix socket (-u).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Everything typed is read straight from the file descriptor once
+	 * we're in the chatroom, so stdio must not read ahead of us.
+	 */
+	setvbuf(stdin, NULL, _IONBF, 0);
+
 	if (system("clear") == -1) {
 		perror("Couldn't execute clear: ");
 	}
@@ -73,6 +195,7 @@ main(void)
 	User_t user;
 
 	int username_ok = 0;
+	int deflate = 0;
 	do {
 		puts("Please type your name: ");
 		char name[NAME_SIZE] = "";
@@ -95,7 +218,8 @@ main(void)
 			break;
 		}
 
-		Connection_status_codes_wrapper cecw = connect_to_server(&sa6, sizeof(sa6), &sfd);
+		strcpy(user.name, name);
+		Connection_status_codes_wrapper cecw = connect_to_server(&sa6, sizeof(sa6), &sfd, &user);
 
 		switch (cecw.conn_err) {
 		case CONN_SOCKET_ERR:
@@ -107,23 +231,25 @@ main(void)
 		case CONN_CONNECT_ERR:
 			fprintf(stderr, "Error connecting to server%s\n", strerror(cecw.system_errno));
 			continue;
+		case CONN_SEND_ERR:
+			fprintf(stderr, "Error sending name to server%s\n", strerror(cecw.system_errno));
+			continue;
 		case CONN_RECV_ERR:
 			fprintf(stderr, "Error receiving data from server%s\n", strerror(cecw.system_errno));
 			continue;
 		case CONN_SV_FULL_ERR:
 			fprintf(stderr, "The server is full. Please try again.\n");
 			continue;
+		case CONN_SV_BUSY_ERR:
+			fprintf(stderr, "The server is busy. Please try again in %d seconds.\n", cecw.retry_after);
+			continue;
 		case CONN_OK:
 			break;
 		}
 
-		strcpy(user.name, name);
-                Register_user_status_codes_wrapper ruscw = register_user(&user, sfd);
+		Register_user_status_codes_wrapper ruscw = register_user(sfd);
 
 		switch (ruscw.reg_err) {
-		case REGUSR_SEND_ERR:
-			fprintf(stderr, "Error sending name to server%s\n", strerror(ruscw.system_errno));
-			continue;
 		case REGUSR_RECV_ERR:
 			fprintf(stderr, "Error receiving data to server%s\n", strerror(ruscw.system_errno));
 			continue;
@@ -132,193 +258,882 @@ main(void)
 			continue;
 		case REGUSR_OK:
 			username_ok = 1;
+			deflate = ruscw.deflate;
 			break;
 		}
 
 	} while (!username_ok);
 
-	if (setup_signals() == -1) {
+	int sigfd = setup_signals();
+
+	if (sigfd == -1) {
 		perror("Error setting up signals: ");
 		exit(EXIT_FAILURE);
 	}
 
+	Shm_link_t link;
+	int link_fds[SHM_LINK_FDS];
+
+	if (g_use_shm && (shm_recv_fds(sfd, link_fds, SHM_LINK_FDS) == -1
+			  || shm_link_attach(&link, link_fds) == -1)) {
+		perror("Error setting up shared memory with the server: ");
+		exit(EXIT_FAILURE);
+	}
+
 	print_welcome();
 
-	pthread_t tid_server;
 	Client_data_t cdata;
 	cdata.user = &user;
 	cdata.sfd = sfd;
+	cdata.shm = g_use_shm ? &link : NULL;
+	cdata.z = NULL;
 
-	if (pthread_create(&tid_server, NULL, listen_from_server, (void*) &cdata) != 0) {
-		fprintf(stderr, "Error creating thread to listen to the server.\n");
+	if (start_inflate(&cdata, deflate) == -1) {
+		perror("Error setting up decompression: ");
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_t tid_user;
-
-	if (pthread_create(&tid_user, NULL, prompt_user, (void*) &cdata) != 0) {
-		fprintf(stderr, "Error creating thread to prompt the user.\n");
+	/* From now on we read everything the server has until it runs dry. */
+	if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("Error making the server socket non-blocking: ");
 		exit(EXIT_FAILURE);
 	}
 
-	struct timespec t;
-	t.tv_sec = 0;
-	t.tv_nsec = 500000000L;
-
-	while (!g_quit) {
-		struct timespec t2;
-		if (nanosleep(&t , &t2) < 0)
-			perror("nanosleep system call failed: ");
-	}
+	run_event_loop(&cdata, sigfd);
 
 	puts("Goodbye.");
+	close(sigfd);
 	cleanup(sfd);
 
 	return EXIT_SUCCESS;
 }
 
 /*
- * @brief Listens to server's messages.
- * Every message received will get printed to client's console.
- * If we lose connection with the server G_QUIT gets set to 1 and the program
- * terminates.
+ * @brief Waits on the keyboard, the server and the signals at once, and
+ * deals with whichever is ready. Returns as soon as the user quits, a
+ * signal arrives or the server goes away.
+ *
+ * Messages from the server are not printed as they arrive but piled up,
+ * and drawn all at once no more than G_FPS times per second. If the server
+ * goes away, we try to get back into our session before giving up.
  *
- * @return NULL
+ * @param[in] cdata
+ * @param[in] sigfd signalfd(2) receiving SIGINT and SIGTERM.
  */
-static void *
-listen_from_server(void *arg)
+static void
+run_event_loop(Client_data_t *cdata, const int sigfd)
 {
-	Client_data_t *cdata = (Client_data_t *) arg;
+	Line_buffer_t server_lb = { .start = 0, .end = 0 };
+	Line_buffer_t user_lb = { .start = 0, .end = 0 };
+	Render_t render;
+	struct pollfd pfds[4] = {
+		{ .fd = sigfd, .events = POLLIN },
+		{ .fd = cdata->sfd, .events = POLLIN },
+		{ .fd = cdata->shm ? cdata->shm->efd_in : -1, .events = POLLIN },
+		{ .fd = STDIN_FILENO, .events = POLLIN }
+	};
+
+	memset(&render, 0, sizeof(render));
+
+	printf(PROMPT);
+	fflush(stdout);
 
-	char msg[BUFF_SIZE];
-	int res_recv = 0;
+	while (1) {
+		int timeout = render_timeout(&render);
+		int waiting = 0;
+
+		/* Don't go to sleep if more messages are waiting. */
+		if (cdata->shm && (waiting = shm_link_prepare_wait(cdata->shm)) == 0)
+			timeout = 0;
+
+		int res = poll(pfds, 4, timeout);
+
+		if (waiting)
+			shm_link_finish_wait(cdata->shm);
+
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Error waiting for events: ");
+			break;
+		}
+
+		if (pfds[0].revents) {
+			struct signalfd_siginfo si;
+
+			render_flush(&render);
+
+			if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+				printf("Catched signal %u.\n", si.ssi_signo);
+
+			break;
+		}
+
+		if ((pfds[1].revents && read_server(cdata, &server_lb, &render) == -1)
+		    || (cdata->shm && read_shm(cdata, &render) == -1)) {
+			if (reconnect(cdata, sigfd) == -1)
+				break;
+
+			server_lb.start = server_lb.end = 0;
+			g_history_left = 0;
+
+			/* The server sends everyone again. */
+			g_members.count = 0;
+
+			if (g_members.slots)
+				memset(g_members.slots, 0, g_members.cap * sizeof(Member_t));
+
+			pfds[1].fd = cdata->sfd;
+			pfds[2].fd = cdata->shm ? cdata->shm->efd_in : -1;
+			continue;
+		}
 
+		if (render_timeout(&render) == 0)
+			render_flush(&render);
+
+		if (pfds[3].revents && read_user(cdata, &user_lb) == -1)
+			break;
+	}
+
+	render_flush(&render);
+	free(render.data);
+}
+
+/*
+ * @brief Reads everything the server has sent so far and queues the
+ * complete messages for the next redraw. With a shared memory link the
+ * server never writes to the socket, so anything happening on it means
+ * the server is gone.
+ *
+ * @param[in] cdata
+ * @param[in out] lb Messages received but not complete yet.
+ * @param[in out] render
+ *
+ * @return 0 ok; -1 if we lost the connection with the server.
+ */
+static int
+read_server(Client_data_t *cdata, Line_buffer_t *lb, Render_t *render)
+{
 	while (1) {
-		memset(msg, 0, sizeof(msg));
+		ssize_t res = cdata->z ? line_buffer_inflate(lb, cdata->z, cdata->sfd)
+				       : line_buffer_fill(lb, cdata->sfd);
 
-		if ((res_recv = recv(cdata->sfd, msg, BUFF_SIZE, 0)) > 0) {
-			printf("%s", msg);
-			printf("> ");
-			fflush(stdout);
-		} else if (res_recv == 0) {
+		if (res == 0 || cdata->shm) {
+			render_flush(render);
 			printf("Lost connection with the server.\n");
-			g_quit = 1;
-			break;
-		} else {
+			return -1;
+		}
+
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
 			perror("Error receiving message from server: ");
-			g_quit = 1;
+			return -1;
+		}
+
+		char *payload;
+		char type;
+		size_t len;
+
+		while (1) {
+			/* The log we asked for comes as it is, between frames. */
+			if (g_history_left > 0) {
+				if (!(payload = line_buffer_take(lb, g_history_left, &len)))
+					break;
+
+				render_append(render, payload, len);
+				g_history_left -= len;
+				continue;
+			}
+
+			if (!(payload = line_buffer_frame(lb, &type, &len)))
+				break;
+
+			server_frame(cdata, render, type, payload, len);
+		}
+	}
+}
+
+/*
+ * @brief Same as read_server(), but for the messages that came through
+ * the shared memory link. Those are complete messages already.
+ *
+ * @param[in] cdata
+ * @param[in out] render
+ *
+ * @return 0 ok; -1 if the link is broken.
+ */
+static int
+read_shm(Client_data_t *cdata, Render_t *render)
+{
+	char msg[LINE_BUFF_SIZE];
+	ssize_t len;
+
+	while ((len = shm_link_recv(cdata->shm, msg, sizeof(msg))) > 0) {
+		/* One frame per message. */
+		if ((size_t) len < FRAME_HEADER_SIZE || get_be(msg + 1, 2) != (size_t) len - FRAME_HEADER_SIZE)
+			continue;
+
+		server_frame(cdata, render, msg[0], msg + FRAME_HEADER_SIZE, len - FRAME_HEADER_SIZE);
+	}
+
+	if (len == -1) {
+		perror("Error receiving message from server: ");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Deals with a frame from the server. Public messages are shown
+ * with the name and colour of their sender, which we know from the
+ * FRAME_JOIN sent before; the ones we already got are dropped. Unknown
+ * frames are ignored.
+ *
+ * @param[in] cdata
+ * @param[in out] render
+ * @param[in] type
+ * @param[in] payload
+ * @param[in] len Length of PAYLOAD.
+ */
+static void
+server_frame(Client_data_t *cdata, Render_t *render, const char type, const char *payload, size_t len)
+{
+	static const char *colours[] = COLOURS;
+	char line[LINE_BUFF_SIZE];
+	unsigned long seq;
+	Member_t *m;
+
+	switch (type) {
+	case FRAME_TEXT:
+		/* Lines, each with its newline. */
+		while (len > 0) {
+			const char *nl = memchr(payload, '\n', len);
+			size_t n = nl ? (size_t) (nl - payload) : len;
+
+			snprintf(line, sizeof(line), "%.*s", (int) n, payload);
+			server_line(cdata, render, line);
+
+			n += nl ? 1 : 0;
+			payload += n;
+			len -= n;
+		}
+
+		break;
+	case FRAME_SEQ_MESSAGE:
+		if (len < 8)
+			break;
+
+		seq = get_be(payload, 8);
+
+		if (seq <= g_last_seq)
+			break;
+
+		g_last_seq = seq;
+		payload += 8;
+		len -= 8;
+		/* FALLTHROUGH */
+	case FRAME_MESSAGE:
+		if (len < 4)
+			break;
+
+		m = member_find(get_be(payload, 4));
+		snprintf(line, sizeof(line), "%s%s" RESET ": %.*s\n", m ? colours[m->colour] : "",
+			 m ? m->name : "?", (int) (len - 4), payload + 4);
+		render_append(render, line, strlen(line));
+		break;
+	case FRAME_JOIN:
+		if (len < 5 || len - 5 >= NAME_SIZE)
+			break;
+
+		if (member_add(get_be(payload, 4), payload[4] % TOTAL_COLOURS, payload + 5, len - 5) == -1)
+			perror("Error adding member: ");
+
+		break;
+	case FRAME_LEAVE:
+		if (len == 4)
+			member_remove(get_be(payload, 4));
+
+		break;
+	case FRAME_HISTORY:
+		if (len == 8)
+			g_history_left = get_be(payload, 8);
+
+		break;
+	case FRAME_MENTION:
+		if (len != 12)
 			break;
+
+		m = member_find(get_be(payload + 8, 4));
+		snprintf(line, sizeof(line), "\a" BOLD "*** %s mentioned you ***" RESET "\n", m ? m->name : "?");
+		render_append(render, line, strlen(line));
+		break;
+	}
+}
+
+/*
+ * @brief Deals with a line from the server, without its newline. Session
+ * lines are kept for ourselves, and pings answered; public messages carry
+ * their sequence number, which is stripped, and the ones we already got
+ * are dropped.
+ *
+ * @param[in] cdata
+ * @param[in out] render
+ * @param[in] line
+ */
+static void
+server_line(Client_data_t *cdata, Render_t *render, const char *line)
+{
+	char token[SESSION_TOKEN_SIZE];
+	char buff[LINE_BUFF_SIZE];
+	unsigned long seq;
+	char *end;
+
+	if (strncmp(line, SESSION_CMD " ", strlen(SESSION_CMD " ")) == 0) {
+		if (sscanf(line, SESSION_CMD " %32s %lu", token, &seq) == 2
+		    && strcmp(token, g_token) != 0) {
+			/* A new session: we start at whatever the server is at. */
+			strcpy(g_token, token);
+			g_last_seq = seq;
 		}
+
+		return;
+	}
+
+	if (strcmp(line, PING_CMD) == 0) {
+		send_server(cdata, PONG_CMD "\n", strlen(PONG_CMD "\n"));
+		return;
+	}
+
+	if (strncmp(line, MENTION_CMD " ", strlen(MENTION_CMD " ")) == 0) {
+		char sender[NAME_SIZE];
+		int n = 0;
+
+		if (sscanf(line, MENTION_CMD " %lu %15s %n", &seq, sender, &n) == 2 && n > 0 && line[n])
+			snprintf(buff, sizeof(buff), BOLD "*** %s mentioned you while you were away: %s" RESET "\n",
+				 sender, line + n);
+		else if (sscanf(line, MENTION_CMD " %lu %15s", &seq, sender) == 2)
+			snprintf(buff, sizeof(buff), "\a" BOLD "*** %s mentioned you ***" RESET "\n", sender);
+		else
+			return;
+
+		render_append(render, buff, strlen(buff));
+		return;
 	}
 
-	return NULL;
+	if (line[0] == '#') {
+		seq = strtoul(line + 1, &end, 10);
+
+		if (*end == ' ') {
+			if (seq <= g_last_seq)
+				return;
+
+			g_last_seq = seq;
+			line = end + 1;
+		}
+	}
+
+	render_append(render, line, strlen(line));
+	render_append(render, "\n", 1);
 }
 
 /*
- * @brief Gets the user message, checks for overflow and trims it.
+ * @brief Looks the member with ID up.
  *
- * @param[in out] msg Sanitized message.
- * @param[in] size Size of the message.
+ * @param[in] id
  *
- * @return 0 ok; -1 error.
+ * @return The member; NULL if there is no such one.
  */
-int
-get_message(char *msg, size_t size)
+static Member_t *
+member_find(const uint32_t id)
 {
-	memset(msg, 0, size);
+	if (id == 0 || g_members.cap == 0)
+		return NULL;
 
-	printf("> ");
-	fflush(stdout);
+	for (size_t i = id & (g_members.cap - 1);; i = (i + 1) & (g_members.cap - 1)) {
+		Member_t *m = &g_members.slots[i];
 
-	if (fgets(msg, MSG_SIZE - 1, stdin) == NULL)
-		return -1;
+		if (m->id == id)
+			return m;
+
+		if (m->id == 0)
+			return NULL;
+	}
+}
+
+/*
+ * @brief Finds the slot where ID goes, which has to be free.
+ *
+ * @param[in] id
+ *
+ * @return The slot.
+ */
+static Member_t *
+member_find_free(const uint32_t id)
+{
+	size_t i = id & (g_members.cap - 1);
+
+	while (g_members.slots[i].id)
+		i = (i + 1) & (g_members.cap - 1);
+
+	return &g_members.slots[i];
+}
+
+/*
+ * @brief Adds the member ID, or updates it if it is there already. The
+ * table doubles once it is half full.
+ *
+ * @param[in] id
+ * @param[in] colour
+ * @param[in] name Not NUL-terminated.
+ * @param[in] len Length of NAME, below NAME_SIZE.
+ *
+ * @return 0 ok; -1 no memory.
+ */
+static int
+member_add(const uint32_t id, const uint8_t colour, const char *name, const size_t len)
+{
+	Member_t *m;
+
+	if (id == 0)
+		return 0;
+
+	if (!(m = member_find(id))) {
+		if (2 * (g_members.count + 1) > g_members.cap) {
+			Members_t old = g_members;
+			size_t cap = old.cap ? 2 * old.cap : 16;
 
-	if (msg[strlen(msg) - 1] != '\n') /* Message too long; avoid overflow. */
-		flush_endl();
+			if (!(g_members.slots = calloc(cap, sizeof(Member_t)))) {
+				g_members = old;
+				return -1;
+			}
 
-	trim(msg);
-	msg[strcspn(msg, "\n")] = '\0';
+			g_members.cap = cap;
+			g_members.count = 0;
+
+			for (size_t i = 0; i < old.cap; ++i)
+				if (old.slots[i].id)
+					*member_find_free(old.slots[i].id) = old.slots[i];
+
+			g_members.count = old.count;
+			free(old.slots);
+		}
+
+		m = member_find_free(id);
+		++g_members.count;
+	}
+
+	m->id = id;
+	m->colour = colour;
+	memcpy(m->name, name, len);
+	m->name[len] = '\0';
 
 	return 0;
 }
 
 /*
- * @brief Prompt the user to write a message.
- * The message will get formatted to something like this: "username: message"
+ * @brief Removes the member ID. The members after it in its run are
+ * moved back, so lookups never stop early.
  *
- * @return NULL
+ * @param[in] id
  */
-static void *
-prompt_user(void *arg)
+static void
+member_remove(const uint32_t id)
 {
-	Client_data_t *cdata = (Client_data_t *) arg;
+	Member_t *m = member_find(id);
+	size_t mask = g_members.cap - 1;
 
-	char msg[MSG_SIZE];
+	if (!m)
+		return;
 
-	while (1) {
-		if (get_message(msg, sizeof(msg)) == -1) {
-			perror("Error getting user message: ");
-			continue;
+	size_t hole = m - g_members.slots;
+
+	for (size_t i = (hole + 1) & mask; g_members.slots[i].id; i = (i + 1) & mask) {
+		size_t home = g_members.slots[i].id & mask;
+
+		/* It can fill the hole if its home is not between the hole and it. */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			g_members.slots[hole] = g_members.slots[i];
+			hole = i;
 		}
+	}
 
-		if (strcmp(msg, QUIT_CMD) == 0) {
-			g_quit = 1;
-			break;
+	g_members.slots[hole].id = 0;
+	--g_members.count;
+}
+
+/*
+ * @brief Connects to the server again after losing it, waiting longer
+ * after every attempt. We first try to resume our session, so the server
+ * sends what we missed; if it doesn't know about it anymore, we join
+ * again with our name.
+ *
+ * @param[in out] cdata
+ * @param[in] sigfd Waiting stops as soon as a signal arrives.
+ *
+ * @return 0 ok; -1 if we gave up.
+ */
+static int
+reconnect(Client_data_t *cdata, const int sigfd)
+{
+	struct pollfd pfd = { .fd = sigfd, .events = POLLIN };
+	struct sockaddr_in6 sa6;
+	int delay = RECONNECT_DELAY;
+	int link_fds[SHM_LINK_FDS];
+
+	close(cdata->sfd);
+	cdata->sfd = -1;
+
+	if (cdata->shm)
+		shm_link_destroy(cdata->shm);
+
+	for (int i = 0; i < RECONNECT_ATTEMPTS; ++i, delay *= 2) {
+		printf("Reconnecting in %d ms...\n", delay);
+		fflush(stdout);
+
+		if (poll(&pfd, 1, delay) != 0)
+			return -1;
+
+		Connection_status_codes_wrapper cecw = connect_to_server(&sa6, sizeof(sa6), &cdata->sfd, cdata->user);
+
+		if (cecw.conn_err == CONN_OK) {
+			Register_user_status_codes_wrapper ruscw = register_user(cdata->sfd);
+
+			if (ruscw.reg_err == REGUSR_OK) {
+				if (start_inflate(cdata, ruscw.deflate) == 0
+				    && (!cdata->shm || (shm_recv_fds(cdata->sfd, link_fds, SHM_LINK_FDS) == 0
+						     && shm_link_attach(cdata->shm, link_fds) == 0))
+				    && fcntl(cdata->sfd, F_SETFL, fcntl(cdata->sfd, F_GETFL) | O_NONBLOCK) == 0) {
+					printf("Back in the chatroom.\n" PROMPT);
+					fflush(stdout);
+					return 0;
+				}
+			} else if (ruscw.reg_err == REGUSR_NAME_EXISTS_ERR) {
+				/* The session is gone: join as anybody else would. */
+				g_token[0] = '\0';
+			}
+		} else if (cecw.conn_err == CONN_SV_BUSY_ERR && cecw.retry_after * 1000 > 2 * delay) {
+			/* Not before the server told us to; DELAY doubles on the way round. */
+			delay = cecw.retry_after * 500;
+		}
+
+		if (cdata->sfd > 0)
+			close(cdata->sfd);
+
+		cdata->sfd = -1;
+	}
+
+	return -1;
+}
+
+/*
+ * @brief Gets ready for a new connection with the server: if it
+ * compresses what it sends, the stream starts from scratch.
+ *
+ * @param[in out] cdata
+ * @param[in] deflate Whether the server compresses.
+ *
+ * @return 0 ok; -1 no memory.
+ */
+static int
+start_inflate(Client_data_t *cdata, const int deflate)
+{
+	if (!deflate) {
+		if (cdata->z) {
+			inflateEnd(&cdata->z->strm);
+			free(cdata->z);
+			cdata->z = NULL;
 		}
 
-		if (send(cdata->sfd, msg, strlen(msg), 0) == -1)
-			perror("Error sending list message to the server: ");
+		return 0;
+	}
+
+	if (cdata->z)
+		return inflateReset(&cdata->z->strm) == Z_OK ? 0 : -1;
+
+	if (!(cdata->z = calloc(1, sizeof(Inflater_t))))
+		return -1;
+
+	if (inflateInit2(&cdata->z->strm, -MAX_WBITS) != Z_OK) {
+		free(cdata->z);
+		cdata->z = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Queues DATA, made of whole lines, for the next redraw. If more
+ * than G_MAX_LINES are waiting, the oldest ones are dropped.
+ *
+ * @param[in out] render
+ * @param[in] data
+ * @param[in] len
+ */
+static void
+render_append(Render_t *render, const char *data, const size_t len)
+{
+	if (render->len + len > render->cap) {
+		/* Reuse the space of what was dropped before growing. */
+		if (render->start > 0) {
+			memmove(render->data, render->data + render->start, render->len - render->start);
+			render->len -= render->start;
+			render->start = 0;
+		}
+
+		size_t cap = render->cap ? render->cap : LINE_BUFF_SIZE;
+
+		while (cap < render->len + len)
+			cap *= 2;
+
+		if (cap != render->cap) {
+			char *p = realloc(render->data, cap);
+
+			if (!p)
+				return;
+
+			render->data = p;
+			render->cap = cap;
+		}
+	}
+
+	memcpy(render->data + render->len, data, len);
+	render->len += len;
+
+	for (size_t i = 0; i < len; ++i)
+		if (data[i] == '\n')
+			++render->lines;
+
+	while (g_max_lines && render->lines > (size_t) g_max_lines) {
+		char *nl = memchr(render->data + render->start, '\n', render->len - render->start);
+
+		render->start = nl - render->data + 1;
+		--render->lines;
+		++render->skipped;
+	}
+}
+
+/*
+ * @brief Tells how long we can wait before the next redraw.
+ *
+ * @param[in] render
+ *
+ * @return Milliseconds, as poll(2) wants them: -1 if there is nothing to
+ * draw, 0 if we are due.
+ */
+static int
+render_timeout(const Render_t *render)
+{
+	if (render->start == render->len && !render->skipped)
+		return -1;
+
+	if (g_fps == 0)
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long elapsed = (now.tv_sec - render->last.tv_sec) * 1000
+		       + (now.tv_nsec - render->last.tv_nsec) / 1000000;
+	long frame = 1000 / g_fps;
+
+	return elapsed >= frame ? 0 : frame - elapsed;
+}
+
+/*
+ * @brief Draws everything queued, and the prompt after it, with a single
+ * write(2).
+ *
+ * @param[in out] render
+ */
+static void
+render_flush(Render_t *render)
+{
+	if (render->start == render->len && !render->skipped)
+		return;
+
+	char notice[64];
+	int n = 0;
+
+	if (render->skipped)
+		n = snprintf(notice, sizeof(notice), "[... %zu messages skipped ...]\n", render->skipped);
+
+	/* The notice and the prompt go around what we have. */
+	render_append(render, PROMPT, strlen(PROMPT));
+
+	fflush(stdout);
+	(void) write_full(STDOUT_FILENO, notice, n);
+	(void) write_full(STDOUT_FILENO, render->data + render->start, render->len - render->start);
+
+	render->start = 0;
+	render->len = 0;
+	render->lines = 0;
+	render->skipped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &render->last);
+}
+
+/*
+ * @brief Sends every complete line the user typed, trimmed and cut to
+ * MSG_SIZE.
+ *
+ * @param[in] cdata
+ * @param[in out] lb What the user typed but didn't finish yet.
+ *
+ * @return 0 ok; -1 if the user wants to quit.
+ */
+static int
+read_user(Client_data_t *cdata, Line_buffer_t *lb)
+{
+	ssize_t res = line_buffer_fill(lb, STDIN_FILENO);
+
+	if (res == 0)
+		return -1;
+
+	if (res == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+
+		perror("Error getting user message: ");
+		return -1;
+	}
+
+	char *line;
+	char msg[MSG_SIZE];
+
+	while ((line = line_buffer_next(lb))) {
+		/* Leave room for the newline. */
+		snprintf(msg, MSG_SIZE - 1, "%s", trim(line));
+
+		if (strcmp(msg, QUIT_CMD) == 0)
+			return -1;
+
+		/* Messages are newline-terminated on the wire. */
+		size_t len = strlen(msg);
+		msg[len++] = '\n';
+
+		send_server(cdata, msg, len);
+
+		printf(PROMPT);
 	}
 
-	return NULL;
+	fflush(stdout);
+
+	return 0;
 }
 
 /*
- * @brief Sets G_QUIT to 1 and thus the program terminates if someone
- * presses Ctrl+C.
+ * @brief Sends MSG to the server, over whatever we are connected through.
+ * The socket is non-blocking, so when it, or the ring, is full we wait
+ * for room instead of losing the line. The server doesn't tell us when it
+ * makes room in the ring: we look again every SHM_RETRY_MS, and give up
+ * if the socket shows the server is gone.
  *
- * @param[in] signo We don't do anything with it at the moment.
+ * @param[in] cdata
+ * @param[in] msg Newline-terminated.
+ * @param[in] len
  */
 static void
-sig_quit_program(int signo)
+send_server(Client_data_t *cdata, const char *msg, const size_t len)
 {
-	g_quit = 1;
-	printf("Catched signal %d\n.", signo);
+	size_t sent = 0;
+
+	while (sent < len) {
+		ssize_t res;
+
+		if (cdata->shm)
+			res = shm_link_send(cdata->shm, msg, len) == 0 ? (ssize_t) len : -1;
+		else
+			res = send(cdata->sfd, msg + sent, len - sent, MSG_NOSIGNAL);
+
+		if (res >= 0) {
+			sent += res;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			break;
+
+		/* With a shared memory link the server never writes to the socket. */
+		struct pollfd pfd = { .fd = cdata->sfd, .events = cdata->shm ? POLLIN : POLLOUT };
+		res = poll(&pfd, 1, cdata->shm ? SHM_RETRY_MS : -1);
+
+		if (res == -1 && errno != EINTR)
+			break;
+
+		if (res > 0 && cdata->shm) {
+			errno = EPIPE;
+			break;
+		}
+	}
+
+	if (sent < len)
+		perror("Error sending message to the server: ");
 }
 
 /*
  * @brief Prepare the connection and connect to the server identified by SFD.
+ * If we were given a unix domain socket, we connect through it instead of
+ * going over TCP.
+ *
+ * The name of the user is sent right after connecting, without waiting for
+ * the server's greeting. If we have a session already, we ask to resume it
+ * instead. That way servers using TCP_DEFER_ACCEPT get woken
+ * up as soon as we connect, and we save a round trip.
  *
  * @param[in out] sa6 Server's socket data to be filled.
  * @param[in] sa6_size sizeof(sa6)
  * @param[in out] sfd Server's file descriptor.
+ * @param[in] user User that wants to join the chatroom.
  *
  * @return The corresponding enumerator indicating success or error.
  */
 static Connection_status_codes_wrapper
-connect_to_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *sfd)
+connect_to_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *sfd,
+		  const User_t *user)
 {
 	Connection_status_codes_wrapper cecw;
+	struct sockaddr_un sun;
+	struct sockaddr *sa = (struct sockaddr*) sa6;
+	socklen_t sa_len = sa6_size;
 	*sfd = 0;
 
-	if ((*sfd = socket(AF_INET6, SOCK_STREAM, 0)) == -1) {
+	if ((*sfd = socket(g_socket_path ? AF_UNIX : AF_INET6, SOCK_STREAM, 0)) == -1) {
 		cecw.conn_err = CONN_SOCKET_ERR;
 		cecw.system_errno = errno;
 		return cecw;
 	}
 
-	memset(sa6, 0, sa6_size);
-	sa6->sin6_family = AF_INET6;
-	sa6->sin6_port = htons(PORTNO);
-	sa6->sin6_addr = in6addr_any;
-
-	if ((inet_pton(AF_INET6, SERVER_IP, &(sa6->sin6_addr))) <= 0) {
-		cecw.conn_err = CONN_PTON_ERR;
-		cecw.system_errno = errno;
-		return cecw;
+	if (g_socket_path) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, g_socket_path);
+		sa = (struct sockaddr*) &sun;
+		sa_len = sizeof(sun);
+	} else {
+		memset(sa6, 0, sa6_size);
+		sa6->sin6_family = AF_INET6;
+		sa6->sin6_port = htons(g_port);
+		sa6->sin6_addr = in6addr_any;
+
+		if ((inet_pton(AF_INET6, SERVER_IP, &(sa6->sin6_addr))) <= 0) {
+			cecw.conn_err = CONN_PTON_ERR;
+			cecw.system_errno = errno;
+			return cecw;
+		}
 	}
 
-	if ((connect(*sfd, (struct sockaddr*) sa6, sa6_size)) == -1) {
+	if ((connect(*sfd, sa, sa_len)) == -1) {
 		cecw.conn_err = CONN_CONNECT_ERR;
 		cecw.system_errno = errno;
 		return cecw;
@@ -326,13 +1141,32 @@ connect_to_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *sfd)
 
 	char buff[BUFF_SIZE] = "";
 
+	if (g_token[0])
+		snprintf(buff, sizeof(buff), RESUME_CMD " %s %lu " BINARY_OPT "%s%s\n", g_token, g_last_seq,
+			 g_use_shm ? " " SHM_OPT : "", g_use_deflate ? " " DEFLATE_OPT : "");
+	else
+		snprintf(buff, sizeof(buff), "%s " RESUME_OPT " " BINARY_OPT "%s%s\n", user->name,
+			 g_use_shm ? " " SHM_OPT : "", g_use_deflate ? " " DEFLATE_OPT : "");
+
+	if ((send(*sfd, buff, strlen(buff), 0)) == -1) {
+		cecw.conn_err = CONN_SEND_ERR;
+		cecw.system_errno = errno;
+		return cecw;
+	}
+
 	/* Know if server rejected our connection. */
-	if ((recv(*sfd, &buff, sizeof(buff), 0)) == -1) {
+	if ((recv_line(*sfd, buff, sizeof(buff))) <= 0) {
 		cecw.conn_err = CONN_RECV_ERR;
 		cecw.system_errno = errno;
 		return cecw;
 	}
 
+	if (sscanf(buff, ERR_STATUS " " RETRY_STATUS " %d", &cecw.retry_after) == 1) {
+		cecw.conn_err = CONN_SV_BUSY_ERR;
+		cecw.system_errno = 0;
+		return cecw;
+	}
+
 	if (strstr(buff, ERR_STATUS) != NULL) {
 		cecw.conn_err = CONN_SV_FULL_ERR;
 		cecw.system_errno = 0;
@@ -346,29 +1180,22 @@ connect_to_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *sfd)
 }
 
 /*
- * @brief Send the name to the server so it can validate that no other
- * client exists with the same name.
+ * @brief Wait for the server to tell us whether our name, sent when
+ * connecting, is free.
  *
- * @param[in] user
  * @param[in] sfd Server's file descriptor.
  *
  * @return The corresponding enumerator indicating success or error.
  */
 static Register_user_status_codes_wrapper
-register_user(User_t *user, const int sfd)
+register_user(const int sfd)
 {
 	Register_user_status_codes_wrapper ruscw;
 
-	if ((send(sfd, user->name, strlen(user->name), 0)) == -1) {
-		ruscw.reg_err = REGUSR_SEND_ERR;
-		ruscw.system_errno = errno;
-		return ruscw;
-	}
-
 	char buff[BUFF_SIZE] = "";
 	memset(buff, 0, sizeof(buff));
 
-	if ((recv(sfd, &buff, sizeof(buff), 0)) == -1) {
+	if ((recv_line(sfd, buff, sizeof(buff))) <= 0) {
 		ruscw.reg_err = REGUSR_RECV_ERR;
 		ruscw.system_errno = errno;
 		return ruscw;
@@ -382,6 +1209,7 @@ register_user(User_t *user, const int sfd)
 
 	ruscw.reg_err = REGUSR_OK;
 	ruscw.system_errno = 0;
+	ruscw.deflate = strstr(buff, DEFLATE_OPT) != NULL;
 
 	return ruscw;
 }
@@ -403,19 +1231,43 @@ print_welcome(void)
 }
 
 /*
- * @brief We're only handling the SIGINT signal at the moment.
+ * @brief Prints the command line options.
+ *
+ * @param[in] prog Name of the program.
+ */
+static void
+print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port | -u path [-m]] [-r fps] [-s lines] [-z]\n", prog);
+	fprintf(stderr, "  -p port   Connect to the server on PORT (default %d).\n", PORTNO);
+	fprintf(stderr, "  -u path   Connect through the server's unix domain socket at PATH.\n");
+	fprintf(stderr, "  -m        Exchange messages with the server through shared memory.\n");
+	fprintf(stderr, "  -r fps    Redraw the terminal at most FPS times per second\n"
+	                "            (default %d; 0 redraws on every message).\n", RENDER_FPS);
+	fprintf(stderr, "  -s lines  If more than LINES messages pile up between redraws,\n"
+	                "            only show the last LINES of them (default: show all).\n");
+	fprintf(stderr, "  -z        Ask the server to compress what it sends. Worth it\n"
+	                "            on slow links.\n");
+}
+
+/*
+ * @brief Blocks SIGINT and SIGTERM, and has them delivered through a
+ * signalfd(2) instead, so the event loop notices them right away.
  *
- * @return 0 ok; -1 error.
+ * @return The signalfd; -1 error.
  */
 static int
 setup_signals(void)
 {
-	struct sigaction sact;
-	sact.sa_handler = sig_quit_program;
-	sigemptyset(&sact.sa_mask);
-	sact.sa_flags = 0;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		return -1;
 
-	return sigaction(SIGINT, &sact, NULL);
+	return signalfd(-1, &mask, SFD_CLOEXEC);
 }
 
 static void
@@ -6,5 +6,102 @@
 #define MIN_NAME_LEN 3
 #define OK_STATUS "OK"
 #define ERR_STATUS "ERR"
+/*
+ * A server short of memory turns connections away with
+ * "ERR_STATUS RETRY_STATUS <seconds>": try again after that long.
+ */
+#define RETRY_STATUS "retry"
+
 #define LIST_CMD "!list"
 #define WHISP_CMD "!whisp"
+#define PRESENCE_CMD "!presence"
+#define PRESENCE_OFF "off"
+
+/*
+ * The server pings connections it hasn't heard from in a while. Anything
+ * sent back keeps them alive; PONG_CMD does without bothering anyone.
+ */
+#define PING_CMD "!ping"
+#define PONG_CMD "!pong"
+
+/*
+ * "HISTORY_CMD <from> <to>" asks for the public log between two UTC
+ * times, written YYYY-MM-DD[THH:MM[:SS]]. TO includes the whole day,
+ * minute or second it names. Text clients get "HISTORY_CMD <bytes>" and
+ * then that many bytes of log lines; binary clients get FRAME_HISTORY
+ * and the bytes, unframed. Nothing else comes in between. Stretches
+ * reaching into compressed segments of the archive cost the server a
+ * copy of each segment in memory, uncompressed, while it is sent: the
+ * server answers with its busy message instead if it can't spare it.
+ */
+#define HISTORY_CMD "!history"
+
+/*
+ * "@name" at the start of a word of a public message mentions that user,
+ * who gets "MENTION_CMD <seq> <sender>" right after the message, or
+ * FRAME_MENTION if binary. Users that aren't connected anywhere get
+ * "MENTION_CMD <seq> <sender> <message>" for each mention they missed,
+ * all at once, as soon as they join again, whatever client they use. The
+ * server only keeps them for names it saw leave, among the last few
+ * hundred: other words starting with '@' mention nobody.
+ */
+#define MENTION_CMD "!mention"
+
+/*
+ * Options a client may append to its name when joining, separated by
+ * spaces: "name opt1 opt2".
+ */
+#define SHM_OPT "shm"
+#define RESUME_OPT "resume" /* Wants a session and sequence numbers. */
+#define BINARY_OPT "bin" /* Wants frames instead of lines. */
+/*
+ * Wants everything after the handshake compressed, as a raw deflate
+ * stream. The server says "OK_STATUS DEFLATE_OPT" if it agrees.
+ */
+#define DEFLATE_OPT "deflate"
+
+/*
+ * Clients that asked for RESUME_OPT get "SESSION_CMD <token> <seq>" once
+ * they are in, and every public message as "#<seq> <message>". After
+ * losing the connection they can join again with
+ * "RESUME_CMD <token> <last seq seen> [opts]" instead of their name, and
+ * get what they missed.
+ */
+#define SESSION_CMD "!session"
+#define RESUME_CMD "!resume"
+#define SESSION_TOKEN_SIZE 33
+
+/*
+ * Clients that asked for BINARY_OPT get frames instead of lines once the
+ * handshake is over: a type byte, the length of the payload as two bytes
+ * and the payload. Numbers are in network byte order. Public messages
+ * only carry the id of their sender; clients learn the name and colour
+ * behind each id from FRAME_JOIN, and colour the messages themselves.
+ * Everything else comes as FRAME_TEXT, with the lines a text client would
+ * get.
+ */
+#define FRAME_HEADER_SIZE 3
+#define FRAME_TEXT 'T' /* Lines. */
+#define FRAME_MESSAGE 'M' /* u32 sender, message. */
+#define FRAME_SEQ_MESSAGE 'N' /* u64 sequence number, u32 sender, message. */
+#define FRAME_JOIN '+' /* u32 id, u8 colour, name. */
+#define FRAME_LEAVE '-' /* u32 id. */
+#define FRAME_HISTORY 'H' /* u64 bytes of log that follow, unframed. */
+#define FRAME_MENTION '@' /* u64 sequence number, u32 sender. */
+
+#define COLOUR_SIZE 20
+#define TOTAL_COLOURS 7
+#define RED "\x1B[31m"
+#define GREEN "\x1B[32m"
+#define YELLOW "\x1B[33m"
+#define BLUE "\x1B[34m"
+#define MAGENTA "\x1B[35m"
+#define CYAN "\x1B[36m"
+#define WHITE "\x1B[37m"
+#define RESET "\x1B[0m"
+#define BOLD "\x1B[1m"
+#define ITALIC "\x1B[3m" /* Whispers show their sender like this. */
+#define ITALIC_OFF "\x1B[23m"
+
+/* Colours by their number in FRAME_JOIN. */
+#define COLOURS { RED, GREEN, YELLOW, BLUE, MAGENTA, CYAN, WHITE }
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "deflater.h"
+
+/*
+ * @brief Starts a new stream, with a single reference. Streams are raw
+ * deflate, without header nor checksum: after a full flush, the bytes
+ * that follow can be decoded by anyone who got the bytes before, whatever
+ * stream they came from.
+ *
+ * @return The stream; NULL on error.
+ */
+Deflater_t *
+deflater_new(void)
+{
+	Deflater_t *d = calloc(1, sizeof(Deflater_t));
+
+	if (!d)
+		return NULL;
+
+	if (deflateInit2(&d->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(d);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	d->refs = 1;
+
+	return d;
+}
+
+/*
+ * @brief Takes another reference to D.
+ *
+ * @param[in out] d
+ *
+ * @return D.
+ */
+Deflater_t *
+deflater_ref(Deflater_t *d)
+{
+	++d->refs;
+
+	return d;
+}
+
+/*
+ * @brief Drops a reference to D, and frees it with the last one. D may be
+ * NULL.
+ *
+ * @param[in out] d
+ */
+void
+deflater_unref(Deflater_t *d)
+{
+	if (!d || --d->refs > 0)
+		return;
+
+	deflateEnd(&d->strm);
+	free(d);
+}
+
+/*
+ * @brief Makes sure *D is not shared, before compressing something only
+ * one of its clients gets. If it is, that client gets a copy of its own,
+ * dictionary included.
+ *
+ * @param[in out] d
+ *
+ * @return 0 ok; -1 no memory. *D is left as it was then.
+ */
+int
+deflater_unshare(Deflater_t **d)
+{
+	if ((*d)->refs == 1)
+		return 0;
+
+	Deflater_t *copy = calloc(1, sizeof(Deflater_t));
+
+	if (!copy)
+		return -1;
+
+	if (deflateCopy(&copy->strm, &(*d)->strm) != Z_OK) {
+		free(copy);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	copy->refs = 1;
+	deflater_unref(*d);
+	*d = copy;
+
+	return 0;
+}
+
+/*
+ * @brief Compresses IN, flushing it so the receiver can decode all of it
+ * right away. A partial flush only costs a few bits, where a sync flush
+ * would add four bytes to every message.
+ *
+ * @param[in out] d
+ * @param[in] in
+ * @param[in] len Length of IN.
+ * @param[in out] out
+ * @param[in] size sizeof(out). DEFLATER_BOUND(LEN) is always enough.
+ * @param[in] flush Z_PARTIAL_FLUSH, or Z_FULL_FLUSH to also forget what
+ * was compressed before.
+ *
+ * @return Bytes written to OUT; -1 if the stream is broken or OUT was too
+ * small, which leaves the stream unusable.
+ */
+ssize_t
+deflater_run(Deflater_t *d, const char *in, const size_t len, char *out, const size_t size, const int flush)
+{
+	d->strm.next_in = (Bytef *) in;
+	d->strm.avail_in = len;
+	d->strm.next_out = (Bytef *) out;
+	d->strm.avail_out = size;
+
+	int res = deflate(&d->strm, flush);
+
+	/* Out of room before the flush was complete: some bytes are stuck in the stream. */
+	if ((res != Z_OK && res != Z_BUF_ERROR) || d->strm.avail_in > 0 || d->strm.avail_out == 0) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return size - d->strm.avail_out;
+}
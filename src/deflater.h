@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/* Room needed to compress LEN bytes in a single go. */
+#define DEFLATER_BOUND(len) ((len) + (len) / 8 + 64)
+
+/*
+ * Raw deflate stream going to one or more clients. Clients that have been
+ * sent exactly the same bytes so far can share it, so a message for all
+ * of them is compressed once. Whoever uses it serializes the access.
+ */
+typedef struct {
+	z_stream strm;
+	int refs; /* Clients sharing it. */
+} Deflater_t;
+
+Deflater_t *deflater_new(void);
+Deflater_t *deflater_ref(Deflater_t *);
+void deflater_unref(Deflater_t *);
+int deflater_unshare(Deflater_t **);
+ssize_t deflater_run(Deflater_t *, const char *, const size_t, char *, const size_t, const int);
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "federation.h"
+
+static int copy_name(char *, const char *);
+
+/*
+ * @brief Splits a line received from another node into FRAME.
+ *
+ * @param[in out] line Frame without the newline. Gets modified.
+ * @param[in out] frame
+ *
+ * @return 0 ok; -1 if the line is not a valid frame.
+ */
+int
+fed_parse(char *line, Fed_frame_t *frame)
+{
+	char *saveptr = NULL;
+	char *type = strtok_r(line, " ", &saveptr);
+	char *origin = strtok_r(NULL, " ", &saveptr);
+	char *seq = strtok_r(NULL, " ", &saveptr);
+	char *name = strtok_r(NULL, " ", &saveptr);
+	char *end;
+
+	if (!type || strlen(type) != 1 || !origin || !seq || !name || copy_name(frame->name, name) == -1)
+		return -1;
+
+	frame->type = type[0];
+	frame->origin = strtoul(origin, &end, 10);
+
+	if (*end != '\0' || frame->origin == 0)
+		return -1;
+
+	frame->seq = strtoul(seq, &end, 10);
+
+	if (*end != '\0')
+		return -1;
+
+	frame->target[0] = '\0';
+	frame->text[0] = '\0';
+
+	switch (frame->type) {
+	case FED_JOIN:
+	case FED_LEAVE:
+	case FED_PING:
+	case FED_PONG:
+		return 0;
+	case FED_WHISPER:
+		if (copy_name(frame->target, strtok_r(NULL, " ", &saveptr)) == -1)
+			return -1;
+		/* FALLTHROUGH */
+	case FED_MESSAGE:
+	case FED_NOTICE:
+		/* The text is the rest of the line, spaces included. */
+		if (!saveptr || strlen(saveptr) >= sizeof(frame->text))
+			return -1;
+
+		strcpy(frame->text, saveptr);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * @brief Writes FRAME as a line, ready to go over a link.
+ *
+ * @param[in out] buff
+ * @param[in] size sizeof(buff)
+ * @param[in] frame
+ *
+ * @return Length of the line; -1 if it doesn't fit.
+ */
+int
+fed_format(char *buff, const size_t size, const Fed_frame_t *frame)
+{
+	int len;
+
+	switch (frame->type) {
+	case FED_JOIN:
+	case FED_LEAVE:
+	case FED_PING:
+	case FED_PONG:
+		len = snprintf(buff, size, "%c %u %lu %s\n", frame->type, frame->origin, frame->seq, frame->name);
+		break;
+	case FED_WHISPER:
+		len = snprintf(buff, size, "%c %u %lu %s %s %s\n", frame->type, frame->origin, frame->seq,
+			       frame->name, frame->target, frame->text);
+		break;
+	default:
+		len = snprintf(buff, size, "%c %u %lu %s %s\n", frame->type, frame->origin, frame->seq,
+			       frame->name, frame->text);
+		break;
+	}
+
+	return len < 0 || (size_t) len >= size ? -1 : len;
+}
+
+/*
+ * @brief Tells whether the frame SEQ of ORIGIN was seen already, and
+ * remembers it otherwise. Frames more than FED_WINDOW behind the newest
+ * one of their origin count as seen: they can only be old copies.
+ *
+ * @param[in out] seen
+ * @param[in] origin
+ * @param[in] seq
+ *
+ * @return 0 new frame; 1 seen already; -1 if there are too many origins
+ * to keep track of a new one.
+ */
+int
+fed_seen(Fed_seen_t *seen, const unsigned int origin, const unsigned long seq)
+{
+	Fed_origin_t *o = NULL;
+
+	for (size_t i = 0; i < seen->count; ++i)
+		if (seen->origins[i].origin == origin) {
+			o = &seen->origins[i];
+			break;
+		}
+
+	if (!o) {
+		if (seen->count == FED_MAX_ORIGINS)
+			return -1;
+
+		o = &seen->origins[seen->count++];
+		o->origin = origin;
+		o->top = seq;
+		o->window = 1;
+		return 0;
+	}
+
+	if (seq > o->top) {
+		unsigned long shift = seq - o->top;
+
+		o->window = shift >= FED_WINDOW ? 0 : o->window << shift;
+		o->window |= 1;
+		o->top = seq;
+		return 0;
+	}
+
+	unsigned long behind = o->top - seq;
+
+	if (behind >= FED_WINDOW || (o->window & ((uint64_t) 1 << behind)))
+		return 1;
+
+	o->window |= (uint64_t) 1 << behind;
+
+	return 0;
+}
+
+/*
+ * @brief Number to start counting our frames from. It comes from the
+ * clock, so a node that restarts doesn't reuse numbers its peers still
+ * remember, as long as it sends less than a million frames a second.
+ *
+ * @return The first sequence number.
+ */
+unsigned long
+fed_first_seq(void)
+{
+	return (unsigned long) time(NULL) << 20;
+}
+
+/*
+ * @brief Copies the name SRC into DST, a NAME_SIZE buffer.
+ *
+ * @param[in out] dst
+ * @param[in] src May be NULL.
+ *
+ * @return 0 ok; -1 if there is no name or it is too long.
+ */
+static int
+copy_name(char *dst, const char *src)
+{
+	if (!src || strlen(src) >= NAME_SIZE)
+		return -1;
+
+	strcpy(dst, src);
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+#define NODE_CMD "!node" /* First line each end sends on a link: "!node <id>". */
+#define FED_MAX_ORIGINS 64 /* Nodes we keep track of. */
+#define FED_WINDOW 64 /* How far behind the newest frame of a node we still accept. */
+
+/*
+ * What travels over a link between two nodes, one frame per line:
+ *
+ *   M <origin> <seq> <sender> <text>           public message
+ *   S <origin> <seq> <sender> <text>           server notice about SENDER
+ *   + <origin> <seq> <name>                    NAME joined ORIGIN
+ *   - <origin> <seq> <name>                    NAME left ORIGIN
+ *   W <origin> <seq> <sender> <target> <text>  whisper for TARGET
+ *   P <origin> 0 -                             ping
+ *   Q <origin> 0 -                             pong
+ *
+ * ORIGIN is the node the frame was born on and SEQ its number there, so
+ * every node can tell a frame it already got through another link. Pings
+ * and pongs only go between the two ends of a link, and are not numbered.
+ */
+typedef enum {
+	FED_MESSAGE = 'M',
+	FED_NOTICE = 'S',
+	FED_JOIN = '+',
+	FED_LEAVE = '-',
+	FED_WHISPER = 'W',
+	FED_PING = 'P',
+	FED_PONG = 'Q'
+} Fed_frame_type;
+
+typedef struct {
+	char type;
+	unsigned int origin;
+	unsigned long seq;
+	char name[NAME_SIZE];
+	char target[NAME_SIZE];
+	char text[BUFF_SIZE];
+} Fed_frame_t;
+
+typedef struct {
+	unsigned int origin;
+	unsigned long top; /* Newest frame seen. */
+	uint64_t window; /* Bit N set: frame TOP - N seen. */
+} Fed_origin_t;
+
+/*
+ * Frames seen so far, per origin.
+ */
+typedef struct {
+	Fed_origin_t origins[FED_MAX_ORIGINS];
+	size_t count;
+} Fed_seen_t;
+
+int fed_parse(char *, Fed_frame_t *);
+int fed_format(char *, const size_t, const Fed_frame_t *);
+int fed_seen(Fed_seen_t *, const unsigned int, const unsigned long);
+unsigned long fed_first_seq(void);
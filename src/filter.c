@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "filter.h"
+#include "utils.h"
+
+static int add_term(Filter_t *, const char *, const uint8_t);
+static int add_state(Filter_t *, size_t *);
+static int link_states(Filter_t *);
+static size_t skip_scalar(const Filter_t *, const unsigned char *, size_t, const size_t);
+#if defined(__x86_64__) || defined(__i386__)
+static size_t skip_ssse3(const Filter_t *, const unsigned char *, size_t, const size_t);
+static size_t skip_avx2(const Filter_t *, const unsigned char *, size_t, const size_t);
+#endif
+static void filter_load_failed(Filter_t *, FILE *);
+
+/*
+ * @brief Reads the terms in PATH and builds their automaton. Each line is
+ * an action, "mask", "drop" or "flag", and the term it applies to, which
+ * may contain spaces. Empty lines and lines starting with '#' are skipped.
+ * Terms match regardless of ASCII case.
+ *
+ * @param[in] path
+ *
+ * @return The filter; NULL on error, with errno set. EINVAL means the
+ * file has a line we don't understand.
+ */
+Filter_t *
+filter_load(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	Filter_t *f = calloc(1, sizeof(Filter_t));
+	char line[BUFSIZ];
+	size_t root;
+
+	if (!file || !f || add_state(f, &root) == -1) {
+		filter_load_failed(f, file);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		char *p = trim(line);
+		char *term = p + strcspn(p, " \t");
+		uint8_t action;
+
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		if (*term)
+			*term++ = '\0';
+
+		term = ltrim(term);
+
+		if (strcmp(p, "mask") == 0)
+			action = FILTER_MASK;
+		else if (strcmp(p, "drop") == 0)
+			action = FILTER_DROP;
+		else if (strcmp(p, "flag") == 0)
+			action = FILTER_FLAG;
+		else
+			action = FILTER_PASS;
+
+		if (action == FILTER_PASS || *term == '\0' || strlen(term) > UINT16_MAX) {
+			errno = EINVAL;
+			filter_load_failed(f, file);
+			return NULL;
+		}
+
+		if (add_term(f, term, action) == -1) {
+			filter_load_failed(f, file);
+			return NULL;
+		}
+	}
+
+	if (ferror(file) || link_states(f) == -1) {
+		filter_load_failed(f, file);
+		return NULL;
+	}
+
+	fclose(file);
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		f->skip = skip_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		f->skip = skip_ssse3;
+	else
+		f->skip = skip_scalar;
+#else
+	f->skip = skip_scalar;
+#endif
+
+	return f;
+}
+
+/*
+ * @brief Drops what filter_load() got so far, keeping errno.
+ *
+ * @param[in] f May be NULL.
+ * @param[in] file May be NULL.
+ */
+static void
+filter_load_failed(Filter_t *f, FILE *file)
+{
+	int e = errno;
+
+	if (file)
+		fclose(file);
+
+	filter_free(f);
+	errno = e;
+}
+
+/*
+ * @brief Frees F. F may be NULL.
+ *
+ * @param[in] f
+ */
+void
+filter_free(Filter_t *f)
+{
+	if (!f)
+		return;
+
+	free(f->next);
+	free(f->actions);
+	free(f->mask_len);
+	free(f);
+}
+
+/*
+ * @brief Looks for the terms of F in MSG, masking the ones to be masked.
+ * The bytes that can't start a term are skipped in blocks, so a message
+ * without any of them is only read once, at vector speed.
+ *
+ * @param[in] f
+ * @param[in out] msg
+ * @param[in] len
+ *
+ * @return The actions of every term found, or'ed: FILTER_PASS if none.
+ */
+int
+filter_apply(const Filter_t *f, char *msg, const size_t len)
+{
+	const unsigned char *s = (const unsigned char *) msg;
+	int32_t state = 0;
+	int res = FILTER_PASS;
+
+	for (size_t i = 0; i < len; ++i) {
+		/* Back at the root: nothing can match before the next first byte. */
+		if (state == 0 && (i = f->skip(f, s, i, len)) == len)
+			break;
+
+		state = f->next[state][tolower(s[i])];
+
+		if (!f->actions[state])
+			continue;
+
+		res |= f->actions[state];
+
+		if (f->mask_len[state])
+			memset(msg + i + 1 - f->mask_len[state], '*', f->mask_len[state]);
+	}
+
+	return res;
+}
+
+/*
+ * @brief Adds the path of TERM to the trie.
+ *
+ * @param[in out] f
+ * @param[in] term
+ * @param[in] action
+ *
+ * @return 0 ok; -1 if there are too many states.
+ */
+static int
+add_term(Filter_t *f, const char *term, const uint8_t action)
+{
+	size_t state = 0;
+	size_t len = strlen(term);
+
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = tolower((unsigned char) term[i]);
+
+		if (f->next[state][c] == -1) {
+			size_t new;
+
+			if (add_state(f, &new) == -1)
+				return -1;
+
+			f->next[state][c] = new;
+		}
+
+		state = f->next[state][c];
+	}
+
+	/* Either case of the first byte may start the term. */
+	unsigned char c = term[0];
+	unsigned char cases[2] = { tolower(c), toupper(c) };
+
+	for (int i = 0; i < 2; ++i) {
+		/* One bucket per high nibble, as long as there are 8 of them. */
+		uint8_t bucket = 1 << ((cases[i] >> 4) & 7);
+
+		f->lo[cases[i] & 0xf] |= bucket;
+		f->hi[cases[i] >> 4] |= bucket;
+	}
+
+	f->actions[state] |= action;
+
+	if (action == FILTER_MASK && len > f->mask_len[state])
+		f->mask_len[state] = len;
+
+	++f->terms;
+
+	return 0;
+}
+
+/*
+ * @brief Appends a state without any transitions to the trie.
+ *
+ * @param[in out] f
+ * @param[in out] state Number of the new state.
+ *
+ * @return 0 ok; -1 if there are too many states already, or no memory.
+ */
+static int
+add_state(Filter_t *f, size_t *state)
+{
+	/* Grown in powers of two. */
+	if ((f->states & (f->states - 1)) == 0) {
+		size_t cap = f->states ? 2 * f->states : 64;
+
+		if (f->states == FILTER_MAX_STATES) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		void *next = realloc(f->next, cap * sizeof(*f->next));
+
+		if (next)
+			f->next = next;
+
+		void *actions = realloc(f->actions, cap * sizeof(*f->actions));
+
+		if (actions)
+			f->actions = actions;
+
+		void *mask_len = realloc(f->mask_len, cap * sizeof(*f->mask_len));
+
+		if (mask_len)
+			f->mask_len = mask_len;
+
+		if (!next || !actions || !mask_len)
+			return -1;
+	}
+
+	memset(f->next[f->states], -1, sizeof(f->next[f->states]));
+	f->actions[f->states] = FILTER_PASS;
+	f->mask_len[f->states] = 0;
+	*state = f->states++;
+
+	return 0;
+}
+
+/*
+ * @brief Turns the trie into the automaton: every missing transition
+ * takes the one of the longest suffix that is in the trie, and every
+ * state gets the actions of the terms ending at its suffixes. States are
+ * visited breadth first, so the suffixes are always ready.
+ *
+ * @param[in out] f
+ *
+ * @return 0 ok; -1 no memory.
+ */
+static int
+link_states(Filter_t *f)
+{
+	int32_t *fail = malloc(f->states * sizeof(int32_t));
+	int32_t *queue = malloc(f->states * sizeof(int32_t));
+	size_t head = 0;
+	size_t tail = 0;
+
+	if (!fail || !queue) {
+		free(fail);
+		free(queue);
+		return -1;
+	}
+
+	for (int c = 0; c < 256; ++c) {
+		int32_t t = f->next[0][c];
+
+		if (t == -1) {
+			f->next[0][c] = 0;
+		} else {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+
+	while (head < tail) {
+		int32_t s = queue[head++];
+
+		for (int c = 0; c < 256; ++c) {
+			int32_t t = f->next[s][c];
+
+			if (t == -1) {
+				f->next[s][c] = f->next[fail[s]][c];
+				continue;
+			}
+
+			fail[t] = f->next[fail[s]][c];
+			f->actions[t] |= f->actions[fail[t]];
+
+			if (f->mask_len[fail[t]] > f->mask_len[t])
+				f->mask_len[t] = f->mask_len[fail[t]];
+
+			queue[tail++] = t;
+		}
+	}
+
+	free(fail);
+	free(queue);
+
+	return 0;
+}
+
+/*
+ * @brief Finds, from I on, the first byte of S that may start a term.
+ *
+ * @param[in] f
+ * @param[in] s
+ * @param[in] i
+ * @param[in] len Length of S.
+ *
+ * @return Its position; LEN if there is none.
+ */
+static size_t
+skip_scalar(const Filter_t *f, const unsigned char *s, size_t i, const size_t len)
+{
+	while (i < len && !(f->lo[s[i] & 0xf] & f->hi[s[i] >> 4]))
+		++i;
+
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * @brief Same as skip_scalar(), 16 bytes at a time: each byte looks its
+ * nibbles up in the tables with a single shuffle each.
+ */
+__attribute__((target("ssse3")))
+static size_t
+skip_ssse3(const Filter_t *f, const unsigned char *s, size_t i, const size_t len)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *) f->lo);
+	const __m128i hi = _mm_loadu_si128((const __m128i *) f->hi);
+	const __m128i nibble = _mm_set1_epi8(0xf);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+		__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+		__m128i none = _mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128());
+		unsigned int hits = ~_mm_movemask_epi8(none) & 0xffff;
+
+		if (hits)
+			return i + __builtin_ctz(hits);
+	}
+
+	return skip_scalar(f, s, i, len);
+}
+
+/*
+ * @brief Same as skip_ssse3(), 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+static size_t
+skip_avx2(const Filter_t *f, const unsigned char *s, size_t i, const size_t len)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f->lo));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) f->hi));
+	const __m256i nibble = _mm256_set1_epi8(0xf);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+		__m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		__m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+		uint32_t hits = ~(uint32_t) _mm256_movemask_epi8(none);
+
+		if (hits)
+			return i + __builtin_ctz(hits);
+	}
+
+	return skip_ssse3(f, s, i, len);
+}
+#endif
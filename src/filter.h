@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_MAX_STATES 16384 /* 1 KiB each. */
+
+/*
+ * What to do with a message containing a term. A message matching
+ * several terms gets all their actions.
+ */
+typedef enum {
+	FILTER_PASS = 0,
+	FILTER_FLAG = 1 << 0, /* Let it through, but tell the operator. */
+	FILTER_MASK = 1 << 1, /* Replace the term with asterisks. */
+	FILTER_DROP = 1 << 2 /* Don't let it through at all. */
+} Filter_action;
+
+typedef struct Filter Filter_t;
+
+/*
+ * Skips bytes that can't start a term.
+ */
+typedef size_t (*Filter_skip_fn)(const Filter_t *, const unsigned char *, size_t, const size_t);
+
+/*
+ * Aho-Corasick automaton of the terms, already turned into a full
+ * transition table: every byte moves to the next state without looking
+ * back. State 0 is the root.
+ */
+struct Filter {
+	int32_t (*next)[256];
+	uint8_t *actions; /* Of every term ending at a state, suffixes included. */
+	uint16_t *mask_len; /* Longest term to mask ending at a state. */
+	size_t states;
+	size_t terms;
+	/*
+	 * First bytes of the terms, as nibble tables: byte B may start a term
+	 * if LO[B & 0xf] & HI[B >> 4] is not 0.
+	 */
+	uint8_t lo[16];
+	uint8_t hi[16];
+	Filter_skip_fn skip;
+};
+
+Filter_t *filter_load(const char *);
+void filter_free(Filter_t *);
+int filter_apply(const Filter_t *, char *, const size_t);
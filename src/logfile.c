@@ -0,0 +1,632 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "logfile.h"
+#include "utils.h"
+
+#define COPY_SIZE 65536 /* Bytes compressed or uncompressed at a time. */
+
+static void logfile_open_failed(Logfile_t *);
+static void *run_rotations(void *);
+static int rotate(Logfile_t *);
+static int compress_segment(Logfile_t *, const unsigned long);
+static Log_segment_t *find_segment(Logfile_t *, const unsigned long);
+static int load_index(Logfile_t *);
+static int save_index(Logfile_t *);
+static int segment_path(const Logfile_t *, const unsigned long, const char *, char *);
+
+/*
+ * @brief Opens the log in PATH to append to it, and the archive in DIR
+ * that its rotated segments go to. Rotations only happen if MAX_SIZE or
+ * MAX_AGE are set, but the archive is read either way, so the history
+ * of a server that used to rotate can still be looked up.
+ *
+ * @param[in out] l
+ * @param[in] path
+ * @param[in] dir
+ * @param[in] max_size Bytes; 0 never rotates on size.
+ * @param[in] max_age Seconds; 0 never rotates on age.
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+logfile_open(Logfile_t *l, const char *path, const char *dir, const off_t max_size, const time_t max_age)
+{
+	struct stat st;
+
+	l->path = path;
+	l->dir = dir;
+	l->max_size = max_size;
+	l->max_age = max_age;
+	l->segments = NULL;
+	l->nsegments = 0;
+	l->cap = 0;
+	l->next_id = 1;
+	l->stop = 0;
+	l->due = 0;
+	l->rotating = 0;
+
+	if (!(l->file = fopen(path, "a")))
+		return -1;
+
+	if (fstat(fileno(l->file), &st) == -1 || (load_index(l) == -1 && errno != ENOENT)) {
+		int e = errno;
+		fclose(l->file);
+		free(l->segments);
+		errno = e;
+		return -1;
+	}
+
+	/* Lines already there were logged before now; when, we don't know. */
+	l->size = st.st_size;
+	l->first = st.st_size ? 1 : 0;
+	l->last = st.st_size ? time(NULL) : 0;
+	l->opened = time(NULL);
+
+	pthread_rwlock_init(&l->lock, NULL);
+	pthread_mutex_init(&l->mutex, NULL);
+	pthread_cond_init(&l->cond, NULL);
+
+	if (!max_size && !max_age)
+		return 0;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		logfile_open_failed(l);
+		return -1;
+	}
+
+	if (pthread_create(&l->thread, NULL, run_rotations, l) != 0) {
+		logfile_open_failed(l);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	l->rotating = 1;
+
+	return 0;
+}
+
+/*
+ * @brief Undoes what logfile_open() did before failing, keeping errno.
+ *
+ * @param[in out] l
+ */
+static void
+logfile_open_failed(Logfile_t *l)
+{
+	int e = errno;
+
+	pthread_cond_destroy(&l->cond);
+	pthread_mutex_destroy(&l->mutex);
+	pthread_rwlock_destroy(&l->lock);
+	fclose(l->file);
+	free(l->segments);
+	errno = e;
+}
+
+/*
+ * @brief Appends LINE to the log, and asks for a rotation if the log is
+ * due for one. Many threads can write at once.
+ *
+ * @param[in out] l
+ * @param[in] t When the line was logged.
+ * @param[in] line With its newline.
+ * @param[in] len
+ */
+void
+logfile_write(Logfile_t *l, const time_t t, const char *line, const size_t len)
+{
+	time_t none = 0;
+
+	pthread_rwlock_rdlock(&l->lock);
+
+	(void) fwrite(line, len, 1, l->file);
+	fflush(l->file);
+
+	atomic_compare_exchange_strong(&l->first, &none, t);
+	l->last = t;
+	off_t size = l->size += len;
+
+	pthread_rwlock_unlock(&l->lock);
+
+	if (!l->rotating || l->due)
+		return;
+
+	if ((l->max_size && size >= l->max_size) || (l->max_age && t >= l->opened + l->max_age)) {
+		pthread_mutex_lock(&l->mutex);
+		l->due = 1;
+		pthread_cond_signal(&l->cond);
+		pthread_mutex_unlock(&l->mutex);
+	}
+}
+
+/*
+ * @brief Lists the segments of the archive with lines logged from FROM
+ * to right before TO, and opens the log being written. Both happen at
+ * once: no rotation gets in between, so no line is in both or in neither.
+ *
+ * @param[in out] l
+ * @param[in] from
+ * @param[in] to
+ * @param[in out] segments Oldest first, to free(); NULL if there are none.
+ * @param[in out] n How many there are.
+ *
+ * @return A file descriptor of the log; -1 on error, with errno set.
+ */
+int
+logfile_segments(Logfile_t *l, const time_t from, const time_t to, Log_segment_t **segments, size_t *n)
+{
+	int fd;
+
+	*segments = NULL;
+	*n = 0;
+
+	pthread_mutex_lock(&l->mutex);
+
+	for (size_t i = 0; i < l->nsegments; ++i) {
+		Log_segment_t *s = &l->segments[i];
+
+		if (s->first >= to || s->last < from)
+			continue;
+
+		if (!*segments && !(*segments = malloc((l->nsegments - i) * sizeof(Log_segment_t)))) {
+			pthread_mutex_unlock(&l->mutex);
+			return -1;
+		}
+
+		(*segments)[(*n)++] = *s;
+	}
+
+	if ((fd = open(l->path, O_RDONLY | O_CLOEXEC)) == -1) {
+		int e = errno;
+		free(*segments);
+		*segments = NULL;
+		*n = 0;
+		errno = e;
+	}
+
+	pthread_mutex_unlock(&l->mutex);
+
+	return fd;
+}
+
+/*
+ * @brief Opens the segment ID of the archive to read it. Compressed
+ * segments get uncompressed into memory, so the bytes can go to a socket
+ * with sendfile(2) all the same.
+ *
+ * @param[in] l
+ * @param[in] id
+ *
+ * @return A file descriptor; -1 on error, with errno set.
+ */
+int
+logfile_open_segment(Logfile_t *l, const unsigned long id)
+{
+	char path[PATH_MAX];
+	char buff[COPY_SIZE];
+	int fd;
+	int n;
+
+	if (segment_path(l, id, "", path) == -1)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1 || errno != ENOENT)
+		return fd;
+
+	if (segment_path(l, id, ".gz", path) == -1)
+		return -1;
+
+	gzFile in = gzopen(path, "rb");
+
+	if (!in)
+		return -1;
+
+	if ((fd = memfd_create("log segment", MFD_CLOEXEC)) == -1) {
+		gzclose(in);
+		return -1;
+	}
+
+	while ((n = gzread(in, buff, sizeof(buff))) > 0)
+		if (write_full(fd, buff, n) == -1)
+			break;
+
+	if (n != 0) {
+		close(fd);
+		gzclose(in);
+		errno = EIO;
+		return -1;
+	}
+
+	gzclose(in);
+
+	return fd;
+}
+
+/*
+ * @brief Stops rotating, after the compression going on if any, and
+ * closes the log.
+ *
+ * @param[in out] l
+ */
+void
+logfile_close(Logfile_t *l)
+{
+	if (l->rotating) {
+		pthread_mutex_lock(&l->mutex);
+		l->stop = 1;
+		pthread_cond_signal(&l->cond);
+		pthread_mutex_unlock(&l->mutex);
+
+		pthread_join(l->thread, NULL);
+	}
+
+	fclose(l->file);
+	free(l->segments);
+}
+
+/*
+ * @brief Rotates the log when it is due, and compresses the segments
+ * rotated out in between.
+ *
+ * @param[in] arg The log.
+ */
+static void *
+run_rotations(void *arg)
+{
+	Logfile_t *l = (Logfile_t *) arg;
+	int failed = 0; /* Don't try to compress again until the next rotation. */
+
+	pthread_mutex_lock(&l->mutex);
+
+	while (!l->stop) {
+		if (l->max_age && time(NULL) >= l->opened + l->max_age) {
+			/* Nothing to rotate out: start counting again. */
+			if (l->size == 0)
+				l->opened = time(NULL);
+			else
+				l->due = 1;
+		}
+
+		if (l->due) {
+			pthread_mutex_unlock(&l->mutex);
+
+			int res = rotate(l);
+
+			failed = 0;
+			pthread_mutex_lock(&l->mutex);
+
+			/* Not to try again at once: wait for another line, or for the age. */
+			if (res == -1) {
+				l->opened = time(NULL);
+				l->due = 0;
+			}
+
+			continue;
+		}
+
+		Log_segment_t *s = NULL;
+
+		for (size_t i = 0; !failed && !s && i < l->nsegments; ++i)
+			if (!l->segments[i].compressed)
+				s = &l->segments[i];
+
+		if (s) {
+			unsigned long id = s->id;
+
+			pthread_mutex_unlock(&l->mutex);
+			failed = compress_segment(l, id) == -1;
+			pthread_mutex_lock(&l->mutex);
+			continue;
+		}
+
+		if (l->max_age) {
+			struct timespec ts = { .tv_sec = l->opened + l->max_age, .tv_nsec = 0 };
+
+			pthread_cond_timedwait(&l->cond, &l->mutex, &ts);
+		} else {
+			pthread_cond_wait(&l->cond, &l->mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&l->mutex);
+
+	return NULL;
+}
+
+/*
+ * @brief Moves the log to the archive and starts a new one. The new file
+ * takes the place of the old one in a single rename(2), so the log is
+ * never missing for whoever opens it by name. Lines written meanwhile
+ * still go to the old file, which is the segment by then: writers only
+ * wait for the FILE pointer to be swapped. MUTEX is held all along, so
+ * logfile_segments() sees the log either before or after.
+ *
+ * @param[in out] l
+ *
+ * @return 0 ok; -1 if the log couldn't be rotated.
+ */
+static int
+rotate(Logfile_t *l)
+{
+	char segment[PATH_MAX];
+	char tmp[PATH_MAX];
+	unsigned long id = l->next_id;
+	struct stat st;
+	FILE *file;
+
+	if (segment_path(l, id, "", segment) == -1 || snprintf(tmp, sizeof(tmp), "%s.new", l->path) >= (int) sizeof(tmp)
+	    || !(file = fopen(tmp, "w"))) {
+		perror("Error rotating the log: ");
+		return -1;
+	}
+
+	pthread_mutex_lock(&l->mutex);
+
+	if (l->nsegments == l->cap) {
+		size_t cap = l->cap ? 2 * l->cap : 64;
+		Log_segment_t *p = realloc(l->segments, cap * sizeof(Log_segment_t));
+
+		if (!p) {
+			pthread_mutex_unlock(&l->mutex);
+			perror("Error rotating the log: ");
+			fclose(file);
+			unlink(tmp);
+			return -1;
+		}
+
+		l->segments = p;
+		l->cap = cap;
+	}
+
+	if (link(l->path, segment) == -1 || rename(tmp, l->path) == -1) {
+		pthread_mutex_unlock(&l->mutex);
+		perror("Error rotating the log: ");
+		fclose(file);
+		unlink(tmp);
+		unlink(segment);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&l->lock);
+
+	FILE *old = l->file;
+	Log_segment_t *s = &l->segments[l->nsegments++];
+
+	s->id = id;
+	s->first = l->first;
+	s->last = l->last;
+	s->compressed = 0;
+
+	l->file = file;
+	l->size = 0;
+	l->first = 0;
+	l->last = 0;
+	l->opened = time(NULL);
+	l->due = 0;
+
+	pthread_rwlock_unlock(&l->lock);
+
+	/* Every line is in already: writers flush before they let go. */
+	s->size = fstat(fileno(old), &st) == 0 ? st.st_size : 0;
+	++l->next_id;
+
+	if (save_index(l) == -1)
+		perror("Error writing the index of the archive: ");
+
+	pthread_mutex_unlock(&l->mutex);
+	fclose(old);
+
+	return 0;
+}
+
+/*
+ * @brief Compresses the segment ID of the archive with gzip, and drops
+ * the uncompressed one once the compressed one is whole. Gives up
+ * half way if the log is being closed.
+ *
+ * @param[in out] l
+ * @param[in] id
+ *
+ * @return 0 ok; -1 error.
+ */
+static int
+compress_segment(Logfile_t *l, const unsigned long id)
+{
+	char src[PATH_MAX];
+	char tmp[PATH_MAX];
+	char dst[PATH_MAX];
+	char buff[COPY_SIZE];
+	ssize_t n = 0;
+	int fd;
+
+	if (segment_path(l, id, "", src) == -1 || segment_path(l, id, ".gz.tmp", tmp) == -1
+	    || segment_path(l, id, ".gz", dst) == -1)
+		return -1;
+
+	/* Compressed already, and then we stopped before saying so. */
+	if ((fd = open(src, O_RDONLY | O_CLOEXEC)) == -1 && !(errno == ENOENT && access(dst, F_OK) == 0)) {
+		perror("Error compressing a segment of the log: ");
+		return -1;
+	}
+
+	if (fd != -1) {
+		gzFile out = gzopen(tmp, "wb");
+
+		if (!out) {
+			perror("Error compressing a segment of the log: ");
+			close(fd);
+			return -1;
+		}
+
+		while (!l->stop && (n = read(fd, buff, sizeof(buff))) > 0)
+			if (gzwrite(out, buff, n) != n) {
+				n = -1;
+				break;
+			}
+
+		close(fd);
+
+		if (gzclose(out) != Z_OK || n != 0 || rename(tmp, dst) == -1) {
+			if (!l->stop)
+				fprintf(stderr, "Error compressing the segment %lu of the log.\n", id);
+
+			unlink(tmp);
+			return -1;
+		}
+
+		unlink(src);
+	}
+
+	pthread_mutex_lock(&l->mutex);
+
+	Log_segment_t *s = find_segment(l, id);
+
+	if (s)
+		s->compressed = 1;
+
+	if (save_index(l) == -1)
+		perror("Error writing the index of the archive: ");
+
+	pthread_mutex_unlock(&l->mutex);
+
+	return 0;
+}
+
+/*
+ * @note MUTEX has to be held.
+ */
+static Log_segment_t *
+find_segment(Logfile_t *l, const unsigned long id)
+{
+	for (size_t i = 0; i < l->nsegments; ++i)
+		if (l->segments[i].id == id)
+			return &l->segments[i];
+
+	return NULL;
+}
+
+/*
+ * @brief Reads the index of the archive: a line per segment, oldest
+ * first, with its id, the times of its first and last lines, its size
+ * and whether it is compressed.
+ *
+ * @param[in out] l
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+static int
+load_index(Logfile_t *l)
+{
+	char path[PATH_MAX];
+	Log_segment_t s;
+	long long first;
+	long long last;
+	long long size;
+	FILE *file;
+
+	if (snprintf(path, sizeof(path), "%s/" LOGFILE_INDEX, l->dir) >= (int) sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (!(file = fopen(path, "r")))
+		return -1;
+
+	while (fscanf(file, "%lu %lld %lld %lld %d", &s.id, &first, &last, &size, &s.compressed) == 5) {
+		if (l->nsegments == l->cap) {
+			size_t cap = l->cap ? 2 * l->cap : 64;
+			Log_segment_t *p = realloc(l->segments, cap * sizeof(Log_segment_t));
+
+			if (!p) {
+				fclose(file);
+				return -1;
+			}
+
+			l->segments = p;
+			l->cap = cap;
+		}
+
+		s.first = first;
+		s.last = last;
+		s.size = size;
+		l->segments[l->nsegments++] = s;
+
+		if (s.id >= l->next_id)
+			l->next_id = s.id + 1;
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+/*
+ * @brief Writes the index of the archive, replacing the old one in one
+ * go.
+ *
+ * @param[in] l
+ *
+ * @return 0 ok; -1 error, with errno set.
+ *
+ * @note MUTEX has to be held.
+ */
+static int
+save_index(Logfile_t *l)
+{
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	FILE *file;
+
+	if (snprintf(path, sizeof(path), "%s/" LOGFILE_INDEX, l->dir) >= (int) sizeof(path)
+	    || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (!(file = fopen(tmp, "w")))
+		return -1;
+
+	for (size_t i = 0; i < l->nsegments; ++i) {
+		Log_segment_t *s = &l->segments[i];
+
+		fprintf(file, "%lu %lld %lld %lld %d\n", s->id, (long long) s->first, (long long) s->last,
+			(long long) s->size, s->compressed);
+	}
+
+	if (fclose(file) != 0 || rename(tmp, path) == -1) {
+		int e = errno;
+		unlink(tmp);
+		errno = e;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Writes the path of the segment ID of the archive, followed by
+ * SUFFIX, into PATH, a PATH_MAX buffer.
+ *
+ * @return 0 ok; -1 if it is too long.
+ */
+static int
+segment_path(const Logfile_t *l, const unsigned long id, const char *suffix, char *path)
+{
+	if (snprintf(path, PATH_MAX, "%s/%lu.log%s", l->dir, id, suffix) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define LOGFILE_INDEX "index" /* In the archive, one line per segment. */
+
+/*
+ * Stretch of the log that got rotated out, in the archive as
+ * "<id>.log", and as "<id>.log.gz" once compressed.
+ */
+typedef struct {
+	unsigned long id;
+	time_t first; /* When its first line was logged; 1 if we don't know. */
+	time_t last; /* And its last one, or later. */
+	off_t size; /* Bytes of log, uncompressed. */
+	int compressed;
+} Log_segment_t;
+
+/*
+ * Log being written, which gets rotated once it is too big or too old.
+ * Writers never wait for a rotation: a background thread opens the new
+ * file and moves the old one to the archive, and writers are only kept
+ * out while the FILE pointer is swapped. The same thread compresses the
+ * segments it rotated out afterwards.
+ */
+typedef struct {
+	const char *path;
+	const char *dir; /* Of the archive. */
+	off_t max_size; /* Bytes; 0 never rotates on size. */
+	time_t max_age; /* Seconds; 0 never rotates on age. */
+	FILE *file; /* Under LOCK: written with it read-locked, swapped write-locked. */
+	pthread_rwlock_t lock;
+	_Atomic off_t size;
+	_Atomic time_t first; /* Of the file being written; 0 while empty. */
+	_Atomic time_t last;
+	_Atomic time_t opened;
+	_Atomic int due; /* A rotation was asked for. */
+	pthread_mutex_t mutex; /* The archive, and waking the thread up. */
+	pthread_cond_t cond;
+	_Atomic int stop;
+	Log_segment_t *segments; /* Oldest first. */
+	size_t nsegments;
+	size_t cap;
+	unsigned long next_id;
+	int rotating; /* The thread runs. */
+	pthread_t thread;
+} Logfile_t;
+
+int logfile_open(Logfile_t *, const char *, const char *, const off_t, const time_t);
+void logfile_write(Logfile_t *, const time_t, const char *, const size_t);
+int logfile_segments(Logfile_t *, const time_t, const time_t, Log_segment_t **, size_t *);
+int logfile_open_segment(Logfile_t *, const unsigned long);
+void logfile_close(Logfile_t *);
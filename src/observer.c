@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "observer.h"
+
+static void observers_start_failed(Observers_t *);
+static void *run_observers(void *);
+static void take_incoming(Observers_t *);
+static void send_batch(Observers_t *);
+static int observer_write(Observers_t *, Observer_t *, const char *, size_t);
+static int observer_flush(Observers_t *, Observer_t *);
+static void observer_drop(Observers_t *, Observer_t *);
+
+/*
+ * @brief Sets O up, with nobody watching yet, and starts its thread.
+ *
+ * @param[in out] o
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+observers_start(Observers_t *o)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+	memset(o, 0, sizeof(*o));
+	o->efd = -1;
+	o->epfd = -1;
+	pthread_mutex_init(&o->mutex, NULL);
+
+	if (!(o->pending = malloc(OBSERVER_PENDING)) || !(o->batch = malloc(OBSERVER_PENDING))
+	    || (o->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	    || (o->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+	    || epoll_ctl(o->epfd, EPOLL_CTL_ADD, o->efd, &ev) == -1) {
+		observers_start_failed(o);
+		return -1;
+	}
+
+	o->mem = 2 * OBSERVER_PENDING;
+
+	if ((errno = pthread_create(&o->thread, NULL, run_observers, o)) != 0) {
+		observers_start_failed(o);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Undoes what observers_start() got done before failing, keeping
+ * errno.
+ *
+ * @param[in out] o
+ */
+static void
+observers_start_failed(Observers_t *o)
+{
+	int e = errno;
+
+	if (o->epfd != -1)
+		close(o->epfd);
+
+	if (o->efd != -1)
+		close(o->efd);
+
+	free(o->batch);
+	free(o->pending);
+	pthread_mutex_destroy(&o->mutex);
+	errno = e;
+}
+
+/*
+ * @brief Hands FD over to O, which writes it whatever is published from
+ * now on, and closes it when it goes away.
+ *
+ * @param[in out] o
+ * @param[in] fd Non-blocking connection.
+ *
+ * @return 0 ok; -1 no memory, and FD is still the caller's.
+ */
+int
+observers_add(Observers_t *o, const int fd)
+{
+	pthread_mutex_lock(&o->mutex);
+
+	if (o->nincoming == o->incoming_cap) {
+		size_t cap = o->incoming_cap ? 2 * o->incoming_cap : 64;
+		int *incoming = realloc(o->incoming, cap * sizeof(int));
+
+		if (!incoming) {
+			pthread_mutex_unlock(&o->mutex);
+			return -1;
+		}
+
+		o->incoming = incoming;
+		o->incoming_cap = cap;
+	}
+
+	o->incoming[o->nincoming++] = fd;
+	++o->watching;
+
+	pthread_mutex_unlock(&o->mutex);
+
+	if (eventfd_write(o->efd, 1) == -1)
+		perror("Error waking up the observers' thread: ");
+
+	return 0;
+}
+
+/*
+ * @brief Sends DATA to every observer, with the next batch. Only a copy
+ * is made here, and none at all while nobody watches. If the thread is so
+ * far behind that the batch is full, DATA is lost, and observers are told.
+ *
+ * @param[in out] o
+ * @param[in] data
+ * @param[in] len
+ */
+void
+observers_publish(Observers_t *o, const char *data, const size_t len)
+{
+	int wake;
+
+	if (!o->watching)
+		return;
+
+	pthread_mutex_lock(&o->mutex);
+
+	if (o->pending_len + len > OBSERVER_PENDING) {
+		++o->lost;
+	} else {
+		memcpy(o->pending + o->pending_len, data, len);
+		o->pending_len += len;
+	}
+
+	wake = !o->woken;
+	o->woken = 1;
+
+	pthread_mutex_unlock(&o->mutex);
+
+	if (wake && eventfd_write(o->efd, 1) == -1)
+		perror("Error waking up the observers' thread: ");
+}
+
+/*
+ * @brief Stops the thread of O and hangs up on every observer.
+ *
+ * @param[in out] o
+ */
+void
+observers_stop(Observers_t *o)
+{
+	o->stop = 1;
+
+	if (eventfd_write(o->efd, 1) == -1)
+		perror("Error waking up the observers' thread: ");
+
+	pthread_join(o->thread, NULL);
+
+	while (o->count > 0)
+		observer_drop(o, o->list[o->count - 1]);
+
+	for (size_t i = 0; i < o->nincoming; ++i)
+		close(o->incoming[i]);
+
+	close(o->epfd);
+	close(o->efd);
+	free(o->list);
+	free(o->incoming);
+	free(o->batch);
+	free(o->pending);
+	pthread_mutex_destroy(&o->mutex);
+}
+
+/*
+ * @brief Thread writing to the observers. It wakes up on new observers
+ * and new batches, on observers that went away, and on sockets that can
+ * take what they are behind on.
+ *
+ * @param[in] arg Observers_t.
+ *
+ * @return NULL
+ */
+static void *
+run_observers(void *arg)
+{
+	Observers_t *o = (Observers_t *) arg;
+	struct epoll_event events[OBSERVER_EVENTS];
+	char junk[512];
+
+	while (!o->stop) {
+		int n = epoll_wait(o->epfd, events, OBSERVER_EVENTS, -1);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Error waiting on observers: ");
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			Observer_t *ob = events[i].data.ptr;
+
+			if (!ob) {
+				eventfd_t v;
+				(void) eventfd_read(o->efd, &v);
+				continue;
+			}
+
+			/* Observers have nothing to say: whatever they send goes nowhere. */
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				ssize_t len = recv(ob->fd, junk, sizeof(junk), MSG_DONTWAIT);
+
+				if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+					observer_drop(o, ob);
+					continue;
+				}
+			}
+
+			if ((events[i].events & EPOLLOUT) && observer_flush(o, ob) == -1)
+				observer_drop(o, ob);
+		}
+
+		take_incoming(o);
+		send_batch(o);
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Starts watching the connections handed over since last time.
+ *
+ * @param[in out] o
+ */
+static void
+take_incoming(Observers_t *o)
+{
+	pthread_mutex_lock(&o->mutex);
+
+	for (size_t i = 0; i < o->nincoming; ++i) {
+		int fd = o->incoming[i];
+		Observer_t *ob = NULL;
+
+		if (o->count == o->cap) {
+			size_t cap = o->cap ? 2 * o->cap : 64;
+			Observer_t **list = realloc(o->list, cap * sizeof(Observer_t *));
+
+			if (list) {
+				o->list = list;
+				o->cap = cap;
+			}
+		}
+
+		if (o->count < o->cap && (ob = malloc(sizeof(Observer_t)))) {
+			struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = ob };
+
+			ob->fd = fd;
+			ob->backlog = NULL;
+			ob->len = 0;
+
+			if (epoll_ctl(o->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+				free(ob);
+				ob = NULL;
+			}
+		}
+
+		if (!ob) {
+			perror("Error taking an observer: ");
+			close(fd);
+			--o->watching;
+			continue;
+		}
+
+		ob->i = o->count;
+		o->list[o->count++] = ob;
+		o->mem += sizeof(Observer_t);
+	}
+
+	o->nincoming = 0;
+
+	pthread_mutex_unlock(&o->mutex);
+}
+
+/*
+ * @brief Writes what was published since the last batch to every
+ * observer, at once.
+ *
+ * @param[in out] o
+ */
+static void
+send_batch(Observers_t *o)
+{
+	char notice[64];
+	size_t notice_len = 0;
+
+	pthread_mutex_lock(&o->mutex);
+
+	char *batch = o->pending;
+	size_t len = o->pending_len;
+
+	o->pending = o->batch;
+	o->pending_len = 0;
+	o->batch = batch;
+
+	if (o->lost)
+		notice_len = snprintf(notice, sizeof(notice), "[... %zu messages were lost ...]\n", o->lost);
+
+	o->lost = 0;
+	o->woken = 0;
+
+	pthread_mutex_unlock(&o->mutex);
+
+	if (len == 0 && notice_len == 0)
+		return;
+
+	/* Backwards, since dropping one moves the last in its place. */
+	for (size_t i = o->count; i > 0; --i) {
+		Observer_t *ob = o->list[i - 1];
+
+		if ((notice_len && observer_write(o, ob, notice, notice_len) == -1)
+		    || observer_write(o, ob, batch, len) == -1)
+			observer_drop(o, ob);
+	}
+}
+
+/*
+ * @brief Writes DATA to OB, or whatever its socket doesn't take to its
+ * backlog. Nothing is written while OB is behind: all goes after what is
+ * in the backlog.
+ *
+ * @param[in out] o
+ * @param[in out] ob
+ * @param[in] data
+ * @param[in] len
+ *
+ * @return 0 ok; -1 if OB is gone, or too far behind.
+ */
+static int
+observer_write(Observers_t *o, Observer_t *ob, const char *data, size_t len)
+{
+	if (ob->len == 0) {
+		ssize_t n = send(ob->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			n = 0;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	if (len == 0)
+		return 0;
+
+	if (ob->len + len > OBSERVER_BACKLOG)
+		return -1;
+
+	if (!ob->backlog) {
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLOUT, .data.ptr = ob };
+
+		if (!(ob->backlog = malloc(OBSERVER_BACKLOG)))
+			return -1;
+
+		o->mem += OBSERVER_BACKLOG;
+
+		if (epoll_ctl(o->epfd, EPOLL_CTL_MOD, ob->fd, &ev) == -1)
+			return -1;
+	}
+
+	memcpy(ob->backlog + ob->len, data, len);
+	ob->len += len;
+
+	return 0;
+}
+
+/*
+ * @brief Writes as much of the backlog of OB as its socket takes. The
+ * backlog goes away once it is empty.
+ *
+ * @param[in out] o
+ * @param[in out] ob
+ *
+ * @return 0 ok; -1 if OB is gone.
+ */
+static int
+observer_flush(Observers_t *o, Observer_t *ob)
+{
+	ssize_t n = ob->len ? send(ob->fd, ob->backlog, ob->len, MSG_DONTWAIT | MSG_NOSIGNAL) : 0;
+
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+	memmove(ob->backlog, ob->backlog + n, ob->len - n);
+	ob->len -= n;
+
+	if (ob->len == 0 && ob->backlog) {
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = ob };
+
+		free(ob->backlog);
+		ob->backlog = NULL;
+		o->mem -= OBSERVER_BACKLOG;
+
+		if (epoll_ctl(o->epfd, EPOLL_CTL_MOD, ob->fd, &ev) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Hangs up on OB and forgets it. The last observer of the list
+ * takes its place.
+ *
+ * @param[in out] o
+ * @param[in] ob
+ */
+static void
+observer_drop(Observers_t *o, Observer_t *ob)
+{
+	Observer_t *last = o->list[--o->count];
+
+	last->i = ob->i;
+	o->list[ob->i] = last;
+
+	/* Closing it takes it out of the epoll set as well. */
+	close(ob->fd);
+
+	if (ob->backlog) {
+		free(ob->backlog);
+		o->mem -= OBSERVER_BACKLOG;
+	}
+
+	free(ob);
+	o->mem -= sizeof(Observer_t);
+	--o->watching;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define OBSERVER_BACKLOG (64 * 1024) /* Bytes an observer may fall behind before it is dropped. */
+#define OBSERVER_PENDING (1024 * 1024) /* Bytes published between two batches, at most. */
+#define OBSERVER_EVENTS 256 /* Taken from epoll(7) at once. */
+
+/*
+ * Connection that only watches. Whatever its socket can't take right
+ * away waits in its backlog.
+ */
+typedef struct {
+	int fd;
+	size_t i; /* In OBSERVERS_T.LIST. */
+	char *backlog; /* OBSERVER_BACKLOG bytes, only while it is behind. */
+	size_t len;
+} Observer_t;
+
+/*
+ * Read-only connections, in numbers far beyond those of clients. They
+ * don't get a thread each: a single one writes what was published to all
+ * of them, a batch at a time and with one write per observer and batch,
+ * so publishing costs the chatroom a copy however many are watching.
+ *
+ * Observers connect to a port of their own: they get OK_STATUS or
+ * ERR_STATUS, as clients do, and then every public message and notice
+ * as a text client would, without sending anything or having a name.
+ */
+typedef struct {
+	pthread_mutex_t mutex; /* PENDING and INCOMING. */
+	char *pending; /* Published since the last batch. */
+	size_t pending_len;
+	size_t lost; /* Messages that didn't fit in PENDING. */
+	int woken; /* The thread was told about PENDING already. */
+	int *incoming; /* Connections the thread hasn't taken yet. */
+	size_t nincoming;
+	size_t incoming_cap;
+	char *batch; /* Being written. Only the thread touches it, and what follows. */
+	Observer_t **list;
+	size_t count;
+	size_t cap;
+	int efd; /* Wakes the thread up. */
+	int epfd;
+	_Atomic size_t watching; /* COUNT, and INCOMING too. */
+	_Atomic size_t mem; /* Bytes held for observers. */
+	_Atomic int stop;
+	pthread_t thread;
+} Observers_t;
+
+int observers_start(Observers_t *);
+int observers_add(Observers_t *, const int);
+void observers_publish(Observers_t *, const char *, const size_t);
+void observers_stop(Observers_t *);
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "pool.h"
+#include "utils.h"
+
+static int queue_push(Task_queue_t *, const Task_t *);
+static int queue_pop(Task_queue_t *, Task_t *);
+static int queue_steal(Task_queue_t *, Task_t *);
+static int find_task(Pool_t *, const size_t, Task_t *);
+static Task_queue_t *queue_new(void);
+static void *run_worker(void *);
+
+/*
+ * @brief Starts SIZE worker threads, each one with its own task queue.
+ *
+ * With CPUS, worker I is pinned to CPUS[I % NCPUS] and maps its queue
+ * itself once it runs there, so the memory it works on the most lands on
+ * its own NUMA node.
+ *
+ * @param[in out] pool
+ * @param[in] size Number of workers.
+ * @param[in] cpus CPUs to pin the workers to; NULL leaves them alone.
+ * @param[in] ncpus Length of CPUS.
+ *
+ * @return 0 ok; -1 error.
+ */
+int
+pool_init(Pool_t *pool, const size_t size, const int *cpus, const size_t ncpus)
+{
+	pool->size = size;
+	pool->ready = 0;
+	pool->next = 0;
+	pool->pending = 0;
+	pool->quit = 0;
+	pool->threads = calloc(size, sizeof(pthread_t));
+	pool->queues = calloc(size, sizeof(Task_queue_t *));
+	pool->workers = calloc(size, sizeof(Worker_t));
+
+	if (!pool->threads || !pool->queues || !pool->workers) {
+		free(pool->threads);
+		free(pool->queues);
+		free(pool->workers);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (size_t i = 0; i < size; ++i) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pool->workers[i].cpu = cpus && ncpus ? cpus[i % ncpus] : -1;
+
+		if (pthread_create(&pool->threads[i], NULL, run_worker, &pool->workers[i]) != 0) {
+			pool->size = i;
+			pool_destroy(pool);
+			return -1;
+		}
+	}
+
+	/* Nothing can be submitted until every queue is there. */
+	pthread_mutex_lock(&pool->mutex);
+
+	while (pool->ready < size)
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (size_t i = 0; i < size; ++i)
+		if (!pool->queues[i]) {
+			pool_destroy(pool);
+			return -1;
+		}
+
+	return 0;
+}
+
+/*
+ * @brief Hands FN(ARG) over to the pool. Tasks are spread round robin
+ * across the workers; if the chosen queue is full we try the next ones.
+ *
+ * @param[in] pool
+ * @param[in] fn Task to run.
+ * @param[in] arg Argument for FN.
+ *
+ * @return 0 ok; -1 if every queue is full.
+ */
+int
+pool_submit(Pool_t *pool, Task_fn fn, void *arg)
+{
+	Task_t task = { .fn = fn, .arg = arg };
+	size_t start = pool->next++;
+
+	/* Counted before it can be taken, so a worker never takes more than there is. */
+	++pool->pending;
+
+	for (size_t i = 0; i < pool->size; ++i)
+		if (queue_push(pool->queues[(start + i) % pool->size], &task) == 0) {
+			pthread_mutex_lock(&pool->mutex);
+			pthread_cond_signal(&pool->cond);
+			pthread_mutex_unlock(&pool->mutex);
+
+			return 0;
+		}
+
+	--pool->pending;
+
+	return -1;
+}
+
+/*
+ * @brief Stops the workers once they are done with what they are running
+ * and frees the pool. Tasks still queued are dropped.
+ *
+ * @param[in out] pool
+ */
+void
+pool_destroy(Pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (size_t i = 0; i < pool->size; ++i) {
+		pthread_join(pool->threads[i], NULL);
+
+		if (pool->queues[i])
+			munmap(pool->queues[i], sizeof(Task_queue_t));
+	}
+
+	free(pool->threads);
+	free(pool->queues);
+	free(pool->workers);
+}
+
+/*
+ * @brief Maps an empty queue. Pages are placed on the node of the CPU
+ * that first touches them, which is the caller, as it initializes it.
+ *
+ * @return The queue; NULL on error.
+ */
+static Task_queue_t *
+queue_new(void)
+{
+	Task_queue_t *q = mmap(NULL, sizeof(Task_queue_t), PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (q == MAP_FAILED)
+		return NULL;
+
+	q->head = 0;
+	q->tail = 0;
+	pthread_mutex_init(&q->mutex, NULL);
+
+	return q;
+}
+
+static int
+queue_push(Task_queue_t *q, const Task_t *task)
+{
+	pthread_mutex_lock(&q->mutex);
+
+	if (q->tail - q->head == POOL_QUEUE_SIZE) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+
+	q->tasks[q->tail++ % POOL_QUEUE_SIZE] = *task;
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+static int
+queue_pop(Task_queue_t *q, Task_t *task)
+{
+	pthread_mutex_lock(&q->mutex);
+
+	if (q->tail == q->head) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+
+	*task = q->tasks[q->head++ % POOL_QUEUE_SIZE];
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+static int
+queue_steal(Task_queue_t *q, Task_t *task)
+{
+	/* Don't fight over a queue somebody else is already using. */
+	if (pthread_mutex_trylock(&q->mutex) != 0)
+		return -1;
+
+	if (q->tail == q->head) {
+		pthread_mutex_unlock(&q->mutex);
+		return -1;
+	}
+
+	*task = q->tasks[--q->tail % POOL_QUEUE_SIZE];
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return 0;
+}
+
+/*
+ * @brief Look for work: first in our own queue, then in everyone else's.
+ *
+ * @param[in] pool
+ * @param[in] id Worker looking for work.
+ * @param[in out] task Task found.
+ *
+ * @return 0 if a task was found; -1 otherwise.
+ */
+static int
+find_task(Pool_t *pool, const size_t id, Task_t *task)
+{
+	if (queue_pop(pool->queues[id], task) == 0)
+		return 0;
+
+	for (size_t i = 1; i < pool->size; ++i)
+		if (queue_steal(pool->queues[(id + i) % pool->size], task) == 0)
+			return 0;
+
+	return -1;
+}
+
+static void *
+run_worker(void *arg)
+{
+	Worker_t *w = (Worker_t *) arg;
+	Pool_t *pool = w->pool;
+	Task_t task;
+
+	/* Pinned first, so the queue is mapped on the right node. */
+	if (w->cpu != -1 && pin_thread(w->cpu) == -1)
+		perror("Error pinning a worker thread: ");
+
+	Task_queue_t *q = queue_new();
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->queues[w->id] = q;
+	++pool->ready;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (!q)
+		return NULL;
+
+	while (1) {
+		if (find_task(pool, w->id, &task) == 0) {
+			--pool->pending;
+			task.fn(task.arg);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+
+		while (pool->pending == 0 && !pool->quit)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+
+		int quit = pool->quit;
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (quit)
+			return NULL;
+	}
+}
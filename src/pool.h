@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define POOL_QUEUE_SIZE 256
+
+typedef void (*Task_fn)(void *);
+
+typedef struct {
+	Task_fn fn;
+	void *arg;
+} Task_t;
+
+/*
+ * Every worker owns one of these. Tasks come from the I/O threads, not
+ * from the workers, so the owner runs them in the order they came, from
+ * the head, while idle workers steal the newest from the tail.
+ */
+typedef struct {
+	Task_t tasks[POOL_QUEUE_SIZE];
+	size_t head;
+	size_t tail;
+	pthread_mutex_t mutex;
+} Task_queue_t;
+
+typedef struct Pool Pool_t;
+
+typedef struct {
+	Pool_t *pool;
+	size_t id;
+	int cpu; /* CPU the worker is pinned to; -1 if it isn't. */
+} Worker_t;
+
+struct Pool {
+	pthread_t *threads;
+	Task_queue_t **queues; /* Each one mapped by its own worker. */
+	Worker_t *workers;
+	size_t size;
+	size_t ready; /* Workers done setting up their queue. Under MUTEX. */
+	_Atomic size_t next; /* Queue that gets the next submitted task. */
+	_Atomic size_t pending; /* Tasks submitted but not picked up yet. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+};
+
+int pool_init(Pool_t *, const size_t, const int *, const size_t);
+int pool_submit(Pool_t *, Task_fn, void *);
+void pool_destroy(Pool_t *);
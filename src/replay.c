@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "utils.h"
+#include "capture.h"
+
+#define SERVER_IP "::1"
+#define PORTNO 6969
+#define LINGER_MS 1000 /* Reading what is left once everything is sent. */
+
+/*
+ * Record of the capture, with only as much room for its data as it takes.
+ */
+typedef struct {
+	uint64_t time;
+	uint32_t conn;
+	char type;
+	size_t len;
+	char *data;
+} Event_t;
+
+/*
+ * Line waiting to be written, with when the capture says it was sent.
+ */
+typedef struct {
+	size_t end; /* Offset in OUT right after the line. */
+	double due;
+} Pending_t;
+
+/*
+ * A connection of the capture, played again.
+ */
+typedef struct {
+	int fd; /* -1 once closed, or before it is opened. */
+	int closing; /* Hang up as soon as OUT is written. */
+	double opened;
+	int answered; /* Got its first byte from the server. */
+	char *out; /* Bytes still to write, from OUT_OFF to OUT_LEN. */
+	size_t out_off;
+	size_t out_len;
+	size_t out_cap;
+	Pending_t *pending; /* Lines in OUT, oldest first from PENDING_HEAD. */
+	size_t pending_head;
+	size_t pending_len;
+	size_t pending_cap;
+} Replay_conn_t;
+
+/*
+ * Samples to summarize, in seconds.
+ */
+typedef struct {
+	double *values;
+	size_t len;
+	size_t cap;
+} Samples_t;
+
+static int load(const char *, Event_t **, size_t *);
+static Replay_conn_t *find_conn(const uint32_t);
+static int apply(const Event_t *, const double, const double);
+static int queue_line(Replay_conn_t *, const char *, const size_t, const double);
+static void write_conn(Replay_conn_t *, const double);
+static void read_conn(Replay_conn_t *, const double);
+static void hang_up(Replay_conn_t *);
+static void close_conn(Replay_conn_t *);
+static int connect_server(void);
+static int add_sample(Samples_t *, const double);
+static void print_samples(const char *, Samples_t *);
+static int compare_doubles(const void *, const void *);
+static double now(void);
+static void print_usage(const char *);
+
+static long g_port = PORTNO;
+static double g_speed = 1; /* 0 goes as fast as it can. */
+static Replay_conn_t *g_conns = NULL; /* By connection number. */
+static size_t g_nconns = 0;
+static Samples_t g_lag = { NULL, 0, 0 }; /* Of each line written, behind its time. */
+static Samples_t g_join = { NULL, 0, 0 }; /* From connecting to the first byte back. */
+static unsigned long g_received = 0; /* Bytes. */
+static unsigned long g_lines = 0;
+
+/*
+ * Plays a capture of the server back against a server on this host,
+ * with the same connections and at the same pace, or N times faster, or
+ * as fast as it goes. Tells how far behind the capture the lines went
+ * out, which grows when the server doesn't keep up, and how long joins
+ * took to be answered.
+ */
+int
+main(int argc, char *argv[])
+{
+	Event_t *events;
+	size_t nevents;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "mp:s:h")) != -1) {
+		switch (opt) {
+		case 'm':
+			g_speed = 0;
+			break;
+		case 'p':
+			if (parse_long(optarg, 1, UINT16_MAX, &g_port) == -1) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's': {
+			char *end;
+
+			g_speed = strtod(optarg, &end);
+
+			if (*end != '\0' || !(g_speed > 0)) {
+				print_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		default:
+			print_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (load(argv[optind], &events, &nevents) == -1) {
+		perror("Error reading the capture: ");
+		exit(EXIT_FAILURE);
+	}
+
+	struct pollfd *pfds = calloc(g_nconns, sizeof(struct pollfd));
+
+	if (g_nconns && !pfds) {
+		perror("Error allocating memory: ");
+		exit(EXIT_FAILURE);
+	}
+
+	double start = now();
+	double done = 0; /* When the last record was played. */
+	size_t next = 0;
+
+	while (1) {
+		double elapsed = now() - start;
+
+		/* Everything due by now. */
+		while (next < nevents && (g_speed == 0 || events[next].time / 1e9 / g_speed <= elapsed)) {
+			double due = g_speed ? events[next].time / 1e9 / g_speed : elapsed;
+
+			if (apply(&events[next++], start + due, start + elapsed) == -1)
+				perror("Error replaying a connection: ");
+		}
+
+		int timeout = -1;
+		int busy = 0; /* Something left to write. */
+		int open = 0; /* Or to read. */
+
+		if (next < nevents) {
+			timeout = (events[next].time / 1e9 / g_speed - elapsed) * 1000 + 1;
+		} else {
+			if (done == 0)
+				done = now();
+
+			for (size_t i = 0; i < g_nconns; ++i) {
+				busy |= g_conns[i].fd != -1 && g_conns[i].out_off < g_conns[i].out_len;
+				open |= g_conns[i].fd != -1;
+			}
+
+			if (!open || (!busy && now() - done > LINGER_MS / 1000.0))
+				break;
+
+			timeout = busy ? -1 : LINGER_MS;
+		}
+
+		for (size_t i = 0; i < g_nconns; ++i) {
+			pfds[i].fd = g_conns[i].fd;
+			pfds[i].events = POLLIN | (g_conns[i].out_off < g_conns[i].out_len ? POLLOUT : 0);
+		}
+
+		if (poll(pfds, g_nconns, timeout) == -1 && errno != EINTR) {
+			perror("Error polling the connections: ");
+			exit(EXIT_FAILURE);
+		}
+
+		double t = now();
+
+		for (size_t i = 0; i < g_nconns; ++i) {
+			if (g_conns[i].fd == -1)
+				continue;
+
+			if (pfds[i].revents & POLLOUT)
+				write_conn(&g_conns[i], t);
+
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				read_conn(&g_conns[i], t);
+		}
+	}
+
+	printf("Replayed %lu lines over %zu connections in %.3f s", g_lines, g_nconns, now() - start);
+
+	if (g_speed)
+		printf(", at %gx.\n", g_speed);
+	else
+		printf(", as fast as possible.\n");
+
+	printf("Received %lu bytes.\n", g_received);
+	print_samples("Lines behind the capture", &g_lag);
+	print_samples("Connections answered after", &g_join);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * @brief Reads the whole capture in PATH, and makes room for its
+ * connections.
+ *
+ * @param[in] path
+ * @param[in out] events
+ * @param[in out] n How many there are.
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+static int
+load(const char *path, Event_t **events, size_t *n)
+{
+	static Capture_record_t r;
+	FILE *file = capture_open_read(path);
+	size_t cap = 0;
+	int res;
+
+	if (!file)
+		return -1;
+
+	*events = NULL;
+	*n = 0;
+
+	while ((res = capture_read(file, &r)) == 1) {
+		if (*n == cap) {
+			void *p = realloc(*events, (cap = cap ? 2 * cap : 1024) * sizeof(Event_t));
+
+			if (!p) {
+				fclose(file);
+				return -1;
+			}
+
+			*events = p;
+		}
+
+		Event_t *e = &(*events)[*n];
+
+		if (!(e->data = malloc(r.len ? r.len : 1))) {
+			fclose(file);
+			return -1;
+		}
+
+		memcpy(e->data, r.data, r.len);
+		e->time = r.time;
+		e->conn = r.conn;
+		e->type = r.type;
+		e->len = r.len;
+
+		/* Connections are numbered from 1, in the order they came. */
+		if (r.conn > g_nconns) {
+			size_t count = r.conn;
+			Replay_conn_t *p = realloc(g_conns, count * sizeof(Replay_conn_t));
+
+			if (!p) {
+				fclose(file);
+				return -1;
+			}
+
+			memset(p + g_nconns, 0, (count - g_nconns) * sizeof(Replay_conn_t));
+
+			for (size_t i = g_nconns; i < count; ++i)
+				p[i].fd = -1;
+
+			g_conns = p;
+			g_nconns = count;
+		}
+
+		++*n;
+	}
+
+	fclose(file);
+
+	if (res == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @param[in] conn Number of a connection in the capture.
+ *
+ * @return Its state; NULL if there is no such connection.
+ */
+static Replay_conn_t *
+find_conn(const uint32_t conn)
+{
+	return conn >= 1 && conn <= g_nconns ? &g_conns[conn - 1] : NULL;
+}
+
+/*
+ * @brief Plays event R.
+ *
+ * @param[in] r
+ * @param[in] due When it should happen.
+ * @param[in] t Now.
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+static int
+apply(const Event_t *r, const double due, const double t)
+{
+	Replay_conn_t *c = find_conn(r->conn);
+
+	if (!c)
+		return 0;
+
+	switch (r->type) {
+	case CAPTURE_OPEN:
+		if ((c->fd = connect_server()) == -1)
+			return -1;
+
+		c->opened = t;
+		return 0;
+	case CAPTURE_LINE:
+		/* Lines of connections that couldn't be opened go nowhere. */
+		if (c->fd == -1)
+			return 0;
+
+		++g_lines;
+		return queue_line(c, r->data, r->len, due);
+	case CAPTURE_CLOSE:
+		c->closing = 1;
+
+		if (c->fd != -1 && c->out_off == c->out_len)
+			hang_up(c);
+
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * @brief Appends a line to what C has to write.
+ *
+ * @param[in out] c
+ * @param[in] line Without the newline.
+ * @param[in] len
+ * @param[in] due When it was sent, as far as the capture goes.
+ *
+ * @return 0 ok; -1 no memory.
+ */
+static int
+queue_line(Replay_conn_t *c, const char *line, const size_t len, const double due)
+{
+	/* Written already: start over at the beginning of the buffer. */
+	if (c->out_off == c->out_len)
+		c->out_off = c->out_len = 0;
+
+	if (c->out_len + len + 1 > c->out_cap) {
+		size_t cap = c->out_cap ? c->out_cap : LINE_BUFF_SIZE;
+
+		while (cap < c->out_len + len + 1)
+			cap *= 2;
+
+		char *p = realloc(c->out, cap);
+
+		if (!p)
+			return -1;
+
+		c->out = p;
+		c->out_cap = cap;
+	}
+
+	if (c->pending_head + c->pending_len == c->pending_cap) {
+		/* Move what is left to the front before growing. */
+		memmove(c->pending, c->pending + c->pending_head, c->pending_len * sizeof(Pending_t));
+		c->pending_head = 0;
+
+		if (c->pending_len == c->pending_cap) {
+			size_t cap = c->pending_cap ? 2 * c->pending_cap : 64;
+			Pending_t *p = realloc(c->pending, cap * sizeof(Pending_t));
+
+			if (!p)
+				return -1;
+
+			c->pending = p;
+			c->pending_cap = cap;
+		}
+	}
+
+	memcpy(c->out + c->out_len, line, len);
+	c->out[c->out_len + len] = '\n';
+	c->out_len += len + 1;
+
+	Pending_t *p = &c->pending[c->pending_head + c->pending_len++];
+
+	p->end = c->out_len;
+	p->due = due;
+
+	return 0;
+}
+
+/*
+ * @brief Writes as much of what C has to write as the socket takes, and
+ * samples how late each line that is out made it.
+ *
+ * @param[in out] c
+ * @param[in] t Now.
+ */
+static void
+write_conn(Replay_conn_t *c, const double t)
+{
+	ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			close_conn(c);
+
+		return;
+	}
+
+	c->out_off += n;
+
+	while (c->pending_len && c->pending[c->pending_head].end <= c->out_off) {
+		if (add_sample(&g_lag, t - c->pending[c->pending_head].due) == -1)
+			perror("Error recording a sample: ");
+
+		++c->pending_head;
+		--c->pending_len;
+	}
+
+	if (c->pending_len == 0)
+		c->pending_head = 0;
+
+	if (c->closing && c->out_off == c->out_len)
+		hang_up(c);
+}
+
+/*
+ * @brief Reads and drops whatever the server sent to C, so it never
+ * waits on us.
+ *
+ * @param[in out] c
+ * @param[in] t Now.
+ */
+static void
+read_conn(Replay_conn_t *c, const double t)
+{
+	char buff[BUFSIZ];
+	ssize_t n;
+
+	while ((n = recv(c->fd, buff, sizeof(buff), 0)) > 0) {
+		if (!c->answered && add_sample(&g_join, t - c->opened) == -1)
+			perror("Error recording a sample: ");
+
+		c->answered = 1;
+		g_received += n;
+	}
+
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		close_conn(c);
+}
+
+/*
+ * @brief Tells the server C is done writing, but goes on reading what it
+ * still has for C until it closes the connection.
+ *
+ * @param[in out] c
+ */
+static void
+hang_up(Replay_conn_t *c)
+{
+	if (shutdown(c->fd, SHUT_WR) == -1)
+		close_conn(c);
+}
+
+static void
+close_conn(Replay_conn_t *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->out_off = c->out_len = 0;
+	c->pending_head = c->pending_len = 0;
+}
+
+/*
+ * @return A non-blocking socket connected to the server; -1 on error,
+ * with errno set.
+ */
+static int
+connect_server(void)
+{
+	struct sockaddr_in6 sa6 = { .sin6_family = AF_INET6, .sin6_port = htons(g_port) };
+	int fd;
+
+	if (inet_pton(AF_INET6, SERVER_IP, &sa6.sin6_addr) <= 0)
+		return -1;
+
+	if ((fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &sa6, sizeof(sa6)) == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+add_sample(Samples_t *s, const double value)
+{
+	if (s->len == s->cap) {
+		size_t cap = s->cap ? 2 * s->cap : 1024;
+		double *p = realloc(s->values, cap * sizeof(double));
+
+		if (!p)
+			return -1;
+
+		s->values = p;
+		s->cap = cap;
+	}
+
+	s->values[s->len++] = value;
+
+	return 0;
+}
+
+/*
+ * @brief Prints the median, 99th percentile and maximum of S.
+ *
+ * @param[in] what
+ * @param[in out] s Gets sorted.
+ */
+static void
+print_samples(const char *what, Samples_t *s)
+{
+	if (s->len == 0) {
+		printf("%s: no samples.\n", what);
+		return;
+	}
+
+	qsort(s->values, s->len, sizeof(double), compare_doubles);
+
+	printf("%s: p50 %.3f ms, p99 %.3f ms, max %.3f ms.\n", what, s->values[s->len / 2] * 1e3,
+	       s->values[s->len * 99 / 100] * 1e3, s->values[s->len - 1] * 1e3);
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * @return Seconds from the monotonic clock.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * @brief Prints the command line options.
+ *
+ * @param[in] prog Name of the program.
+ */
+static void
+print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-s speed | -m] capture\n", prog);
+	fprintf(stderr, "  -p port   Port of the server, on this host (default %d).\n", PORTNO);
+	fprintf(stderr, "  -s speed  Play the capture SPEED times faster (default 1).\n");
+	fprintf(stderr, "  -m        Play it as fast as possible.\n");
+}
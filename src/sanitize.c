@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "sanitize.h"
+
+static size_t printable_run(const unsigned char *, const size_t);
+#if defined(__x86_64__) || defined(__i386__)
+static size_t printable_run_avx2(const unsigned char *, const size_t);
+#endif
+static size_t utf8_length(const unsigned char *, const size_t);
+
+#if defined(__x86_64__) || defined(__i386__)
+static _Atomic int g_avx2 = -1; /* Whether the CPU has AVX2; -1 until we know. */
+#endif
+
+/*
+ * @brief Makes MSG safe to show on anybody's terminal, in place and in a
+ * single pass:
+ *
+ * - Control characters (C0, DEL and C1) are removed, which takes care of
+ *   escape sequences. Tabs become spaces.
+ * - Every byte that is not part of a valid UTF-8 character becomes '?'.
+ * - Spaces at both ends are trimmed.
+ *
+ * Runs of printable ASCII, which is what most messages are made of, are
+ * found a whole vector at a time; only the bytes around them are looked
+ * at one by one.
+ *
+ * @param[in out] msg NUL-terminated.
+ * @param[in] len strlen(msg)
+ *
+ * @return The new length of MSG. It never grows.
+ */
+size_t
+sanitize(char *msg, const size_t len)
+{
+	unsigned char *s = (unsigned char *) msg;
+	size_t in = 0;
+	size_t out = 0;
+	size_t end = 0; /* Up to the last character that is not a space. */
+
+	while (in < len) {
+		size_t run = printable_run(s + in, len - in);
+
+		if (run > 0) {
+			/* Nothing written yet: leading spaces go away. */
+			while (out == 0 && run > 0 && s[in] == ' ') {
+				++in;
+				--run;
+			}
+
+			if (run == 0)
+				continue;
+
+			if (out != in)
+				memmove(s + out, s + in, run);
+
+			size_t last = run - 1;
+
+			while (last > 0 && s[out + last] == ' ')
+				--last;
+
+			if (s[out + last] != ' ')
+				end = out + last + 1;
+
+			in += run;
+			out += run;
+			continue;
+		}
+
+		if (s[in] < 0x80) {
+			/* C0 or DEL. */
+			if (s[in] == '\t' && out > 0)
+				s[out++] = ' ';
+
+			++in;
+			continue;
+		}
+
+		size_t n = utf8_length(s + in, len - in);
+
+		if (n == 0) {
+			s[out++] = '?';
+			end = out;
+			++in;
+			continue;
+		}
+
+		/* U+0080 to U+009F are the C1 controls. */
+		if (!(n == 2 && s[in] == 0xc2 && s[in + 1] < 0xa0)) {
+			memmove(s + out, s + in, n);
+			out += n;
+			end = out;
+		}
+
+		in += n;
+	}
+
+	s[end] = '\0';
+
+	return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * @brief Same as printable_run(), 32 bytes at a time. Stops before the
+ * last 32 bytes if they are all printable.
+ */
+__attribute__((target("avx2")))
+static size_t
+printable_run_avx2(const unsigned char *s, const size_t len)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		/* Signed compare: bytes from 0x80 up are below the space too. */
+		__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+		uint32_t hits = _mm256_movemask_epi8(bad);
+
+		if (hits)
+			return i + __builtin_ctz(hits);
+	}
+
+	return i;
+}
+
+/*
+ * @brief Counts the printable ASCII bytes at the start of S.
+ *
+ * @param[in] s
+ * @param[in] len Length of S.
+ *
+ * @return How many there are, from 0 to LEN.
+ */
+static size_t
+printable_run(const unsigned char *s, const size_t len)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i del = _mm_set1_epi8(0x7f);
+	size_t i = 0;
+
+	if (g_avx2 == -1)
+		g_avx2 = __builtin_cpu_supports("avx2") != 0;
+
+	if (g_avx2) {
+		i = printable_run_avx2(s, len);
+
+		if (i + 32 <= len)
+			return i;
+	}
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+		unsigned int hits = _mm_movemask_epi8(bad);
+
+		if (hits)
+			return i + __builtin_ctz(hits);
+	}
+
+	while (i < len && s[i] >= 0x20 && s[i] < 0x7f)
+		++i;
+
+	return i;
+}
+#else
+/*
+ * @brief Counts the printable ASCII bytes at the start of S.
+ *
+ * @param[in] s
+ * @param[in] len Length of S.
+ *
+ * @return How many there are, from 0 to LEN.
+ */
+static size_t
+printable_run(const unsigned char *s, const size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && s[i] >= 0x20 && s[i] < 0x7f)
+		++i;
+
+	return i;
+}
+#endif
+
+/*
+ * @brief Tells how long the UTF-8 character at the start of S is, if it is
+ * a valid one: no overlong forms, surrogates or code points past U+10FFFF.
+ *
+ * @param[in] s Starts with a byte from 0x80 up.
+ * @param[in] len Length of S.
+ *
+ * @return Its length in bytes; 0 if it is not valid.
+ */
+static size_t
+utf8_length(const unsigned char *s, const size_t len)
+{
+	size_t n;
+	unsigned char lo = 0x80; /* Range of the second byte. */
+	unsigned char hi = 0xbf;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		n = 2;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		n = 3;
+
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else if (s[0] == 0xed)
+			hi = 0x9f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		n = 4;
+
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else if (s[0] == 0xf4)
+			hi = 0x8f;
+	} else {
+		return 0;
+	}
+
+	if (len < n || s[1] < lo || s[1] > hi)
+		return 0;
+
+	for (size_t i = 2; i < n; ++i)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+	return n;
+}
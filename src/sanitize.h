@@ -0,0 +1,5 @@
+#pragma once
+
+#include <stddef.h>
+
+size_t sanitize(char *, const size_t);
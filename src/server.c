@@ -1,8 +1,20 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,29 +22,243 @@
 #include <time.h>
 #include <errno.h>
 #include "common.h"
+#include "utils.h"
+#include "pool.h"
+#include "shmring.h"
+#include "federation.h"
+#include "filter.h"
+#include "sanitize.h"
+#include "deflater.h"
+#include "wheel.h"
+#include "trace.h"
+#include "capture.h"
+#include "snapshot.h"
+#include "logfile.h"
+#include "observer.h"
 
 #define PORTNO 6969
 #define MAX_CLIENTS 7
+#define LISTEN_BACKLOG 4096
 #define LOG_FILE_NAME "log.txt"
+#define LOG_ARCHIVE_DIR "archive" /* Where the log goes once rotated. */
+#define TRACE_FILE_NAME "trace.json"
+#define BUSY_MSG "The server is busy. Please try again.\n"
+#define DROPPED_MSG "Your message was not sent: it contains a banned term.\n"
+#define HISTORY_USAGE_MSG "Usage: " HISTORY_CMD " <from> <to>, as YYYY-MM-DD[THH:MM[:SS]] in UTC.\n"
+#define HISTORY_DENIED_MSG "The history can't be sent over this connection right now.\n"
+#define SHM_BATCH 64 /* Messages read from a ring before checking the rest. */
+#define SHM_RETRY_MS 1 /* Between looks at a full ring, for room. */
+#define LIST_PAGE_SIZE 10 /* Names per page of !list. */
+#define HISTORY_SIZE 1024 /* Public messages kept for clients resuming. */
+#define MAX_SESSIONS (2 * MAX_CLIENTS)
+#define SESSION_TTL 300 /* Seconds a session can be resumed after its client left. */
+#define MAX_PEERS 8 /* Links to other nodes. */
+#define MAX_REMOTE_USERS 256 /* Users connected to other nodes. */
+#define MAX_MEMBERS (MAX_CLIENTS + MAX_REMOTE_USERS)
+#define PEER_RETRY_MAX 30 /* Seconds between attempts to link to a node, at most. */
 
-#define COLOUR_SIZE 20
-#define TOTAL_COLOURS 7
-#define RED "\x1B[31m"
-#define GREEN "\x1B[32m"
-#define YELLOW "\x1B[33m"
-#define BLUE "\x1B[34m"
-#define MAGENTA "\x1B[35m"
-#define CYAN "\x1B[36m"
-#define WHITE "\x1B[37m"
-#define RESET "\x1B[0m"
+#define REMOTE_COLOUR WHITE /* Users connected to other nodes. */
+
+#define TICK_MS 100 /* Resolution of the timers. */
+#define TICKS(seconds) ((uint64_t) (seconds) * 1000 / TICK_MS)
+#define HANDSHAKE_TIMEOUT 10 /* Seconds to join, or to link for other nodes. */
+#define HEARTBEAT 30 /* Seconds of silence before we ping. */
+#define MAX_CPUS 256 /* In the list threads get pinned to. */
+#define LOG_WINDOW 1024 /* Bytes read to find a line of the log. Longer than any line. */
+#define SNAPSHOT_INTERVAL 60 /* Seconds between snapshots, besides the one on the way out. */
+#define SNAPSHOT_VERSION 3 /* Of Server_state_t. Bump it whenever it changes. */
+#define NAME_SLOTS 16 /* Of G_NAMES: a power of two, at least twice MAX_CLIENTS. */
+#define MAX_MENTIONS 8 /* Names looked up per message. */
+#define OFFLINE_MENTIONS 256 /* Kept for users who are away, the oldest going first. */
+#define USER_MENTIONS 32 /* Kept for each user who is away, at most. */
+#define DEPARTED_USERS 256 /* Names of users who left, remembered so their mentions are kept. */
+#define MEM_BUDGET 256 /* Default megabytes connections may hold. */
+#define CONN_MEM (64 * 1024) /* What a connection holds besides its replies: its state, buffers and stack. */
+#define RETRY_AFTER 5 /* Seconds clients turned away for lack of memory wait. */
+#define MAX_OBSERVERS 65536
+
+/* Room for a whole message plus the coloured name in front of it. */
+#define LINE_SIZE (BUFF_SIZE + NAME_SIZE + 2 * COLOUR_SIZE)
+
+/* Biggest frame we send, header and sequence number included. */
+#define FRAME_SIZE (FRAME_HEADER_SIZE + LINE_SIZE + 32)
+
+/*
+ * Public messages between the points where every compressed stream is
+ * flushed in full, so the clients that get the same messages can share
+ * a stream again.
+ */
+#define DEFLATE_RESYNC 256
+
+/*
+ * Response produced by a worker, waiting for the client's own thread
+ * to write it to the socket.
+ */
+typedef struct Reply_t {
+	struct Reply_t *next;
+	size_t len;
+	char data[];
+} Reply_t;
+
+/*
+ * Piece of an export: a segment of the archive, or the log being
+ * written.
+ */
+typedef struct {
+	int fd; /* -1 until it is opened, for segments. */
+	unsigned long id; /* Of the segment. */
+	off_t off;
+	off_t end;
+	int compressed; /* Gets uncompressed into memory to be sent. */
+} Export_part_t;
+
+/*
+ * Stretch of the log a client asked for with HISTORY_CMD, on its way
+ * from the page cache to the socket one part after the other. Only the
+ * client's thread touches it.
+ */
+typedef struct {
+	int fd; /* Of the part being sent; -1 if there is nothing to send. */
+	off_t off; /* Next byte to send. */
+	off_t end;
+	Export_part_t *parts;
+	size_t nparts;
+	size_t next; /* Part to send after this one. */
+	size_t held; /* Charged to the memory budget for compressed parts. */
+} Export_t;
 
 typedef struct {
 	char name[NAME_SIZE];
 	unsigned int id;
 	int fd;
+	int efd; /* Signalled whenever a reply gets queued. */
 	char colour[COLOUR_SIZE];
+	_Atomic unsigned int refs; /* The client's thread plus pending tasks. */
+	/*
+	 * Writes straight to the socket, and QUEUED. Taken after CLIENT_MUTEX
+	 * and DEFLATE_MUTEX, before REPLY_MUTEX.
+	 */
+	pthread_mutex_t write_mutex;
+	pthread_mutex_t reply_mutex;
+	Reply_t *replies_head;
+	Reply_t *replies_tail;
+	_Atomic size_t mem; /* Bytes of replies waiting, charged to the budget. */
+	Shm_link_t *shm; /* Set if the client talks to us through shared memory. */
+	int presence; /* Subscribed to presence changes. Under CLIENT_MUTEX. */
+	/*
+	 * Everything for the client goes through the reply queue until its
+	 * thread has drained it once, so nothing overtakes the handshake or
+	 * the messages replayed on resume. It is set again whenever a reply
+	 * gets queued: until the queue is empty, only the client's thread
+	 * writes to the socket. Set under WRITE_MUTEX, cleared under
+	 * CLIENT_MUTEX as well.
+	 */
+	_Atomic int queued;
+	int seq; /* Wants sequence numbers. */
+	char token[SESSION_TOKEN_SIZE]; /* Session, if any. */
+	unsigned int node; /* Node at the other end of a federation link; 0 for clients. */
+	int binary; /* Gets frames instead of lines. */
+	int deflate; /* Gets everything compressed, through Z. */
+	Deflater_t *z; /* Under DEFLATE_MUTEX. */
+	Timer_t timer; /* Heartbeat and idle timeout. Under WHEEL_MUTEX. */
+	_Atomic uint64_t last_seen; /* Tick we last got anything from it. */
+	_Atomic uint64_t last_message; /* Tick it last said something, pongs aside. */
+	uint64_t pinged; /* Tick we last pinged it. Under WHEEL_MUTEX. */
+	_Atomic int expired; /* Why the timer hung up on it, if it did. */
+	Export_t export; /* Everything else is queued while it goes on. */
 } Client_t;
 
+/*
+ * How close connections are to the memory budget. Work goes in order as
+ * it gets tighter.
+ */
+typedef enum {
+	MEM_OK = 0,
+	MEM_SHED, /* Three quarters spent: no exports, nor scrollback on resume. */
+	MEM_FULL /* Seven eighths: nobody else gets in either. */
+} Mem_pressure;
+
+typedef enum {
+	EXPIRED_NOT = 0,
+	EXPIRED_DEAD, /* Didn't answer our pings. */
+	EXPIRED_IDLE /* Didn't say anything for too long. */
+} Expired_reason;
+
+/*
+ * Command handed over to the worker pool.
+ */
+typedef struct {
+	Client_t *client; /* Who asked for it. We hold a reference. */
+	long page;
+} Command_t;
+
+/*
+ * What a client asked for when joining, after its name.
+ */
+typedef struct {
+	int shm;
+	int binary;
+	int deflate;
+	int seq;
+	int resume; /* Joining again with TOKEN instead of a name. */
+	char token[SESSION_TOKEN_SIZE];
+	unsigned long last_seq; /* Last message seen before losing the connection. */
+} Client_options_t;
+
+/*
+ * Public message kept around for clients that resume their session.
+ */
+typedef struct {
+	unsigned long seq;
+	char sender[NAME_SIZE];
+	char line[LINE_SIZE];
+} History_entry_t;
+
+/*
+ * Mention of someone who wasn't connected anywhere, kept until they join.
+ */
+typedef struct {
+	char target[NAME_SIZE]; /* Empty if the slot is free. */
+	unsigned long seq;
+	char sender[NAME_SIZE];
+	char msg[BUFF_SIZE];
+} Mention_t;
+
+typedef struct {
+	char token[SESSION_TOKEN_SIZE];
+	char name[NAME_SIZE];
+	time_t expires; /* 0 while its client is connected. */
+	int colour; /* In G_COLOURS_USED, the last its client had; -1 none yet. */
+} Session_t;
+
+/*
+ * What a snapshot keeps, so that a server that restarts carries on where
+ * it left off: sessions can be resumed, with their colours and whatever
+ * was said meanwhile, and no number starts over.
+ */
+typedef struct {
+	unsigned long seq;
+	unsigned long presence_version;
+	unsigned int client_id;
+	Session_t sessions[MAX_SESSIONS];
+	History_entry_t history[HISTORY_SIZE];
+	Mention_t mentions[OFFLINE_MENTIONS];
+	size_t mentions_next;
+	char departed[DEPARTED_USERS][NAME_SIZE];
+	size_t departed_next;
+} Server_state_t;
+
+/*
+ * Someone connected to another node, as announced through a link.
+ */
+typedef struct {
+	char name[NAME_SIZE]; /* Empty if the slot is free. */
+	unsigned int id; /* Ours, for binary clients. */
+	unsigned int origin; /* Node they are connected to. */
+	unsigned long seq; /* Of the frame announcing them, to pass it on to new links. */
+	Client_t *via; /* Link the announcement came through: the way to ORIGIN. */
+} Remote_user_t;
+
 typedef struct {
 	char colour[COLOUR_SIZE];
 	int used;
@@ -45,6 +271,7 @@ typedef enum {
 
 typedef enum {
 	NEW_CONN_SV_FULL_ERR,
+	NEW_CONN_SV_BUSY_ERR, /* Short of memory: told to retry later. */
 	NEW_CONN_SYSTEM_ERR,
 	NEW_CONN_OK
 } New_connection_status_codes;
@@ -65,13 +292,96 @@ typedef struct {
 	int system_err;
 } Client_name_status_codes_wrapper;
 
+typedef struct {
+	int backlog; /* Length of the kernel's accept queue. */
+	int defer_accept; /* TCP_DEFER_ACCEPT seconds; 0 disables it. */
+	int workers; /* Threads running the heavy commands. */
+	const char *socket_path; /* Unix domain socket to listen on too, if any. */
+	int port; /* For clients. */
+	unsigned int node; /* Our id among federated nodes; 0 if we run alone. */
+	int peer_port; /* For links from other nodes; 0 if we don't take any. */
+	const char *peers[MAX_PEERS]; /* "host:port" of the nodes we link to. */
+	int npeers;
+	const char *filter_path; /* Terms to filter out of public messages, if any. */
+	int heartbeat; /* Seconds of silence before a ping; 0 disables them. */
+	int idle; /* Seconds without a message before a client is dropped; 0 never. */
+	int cpus[MAX_CPUS]; /* To pin threads to, round robin. */
+	size_t ncpus; /* 0 leaves threads to the scheduler. */
+	int busy_poll; /* SO_BUSY_POLL microseconds for connections; 0 disables it. */
+	long spin; /* Microseconds a connection polls before it goes to sleep. */
+	unsigned int trace_every; /* Trace one message in this many; 0 none. */
+	const char *capture_path; /* To record what clients send, if any. */
+	const char *snapshot_path; /* To keep the state across restarts, if any. */
+	off_t log_size; /* Bytes the log grows to before it is rotated; 0 no limit. */
+	time_t log_age; /* Seconds the log is written to before it is rotated; 0 no limit. */
+	size_t mem_budget; /* Bytes connections may hold; 0 no limit. */
+	int observer_port; /* For observers; 0 if we don't take any. */
+} Server_config_t;
+
 pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Compressed streams. Taken after CLIENT_MUTEX, before any REPLY_MUTEX. */
+static pthread_mutex_t deflate_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static _Atomic unsigned int g_clients_connected = 0;
+static _Atomic size_t g_mem = 0; /* Charged to the budget, by every connection. */
 static Client_t *g_clients[MAX_CLIENTS];
+static unsigned long g_presence_version = 0; /* Under CLIENT_MUTEX. */
+static unsigned long g_seq = 0; /* Last public message. Under CLIENT_MUTEX. */
+static History_entry_t g_history[HISTORY_SIZE]; /* Under CLIENT_MUTEX. */
+static Session_t g_sessions[MAX_SESSIONS]; /* Under CLIENT_MUTEX. */
+static Client_t *g_names[NAME_SLOTS]; /* G_CLIENTS by name, open addressing. Under CLIENT_MUTEX. */
+static Mention_t g_mentions[OFFLINE_MENTIONS]; /* Under CLIENT_MUTEX. */
+static size_t g_mentions_next = 0; /* Slot the next one takes. Under CLIENT_MUTEX. */
+static char g_departed[DEPARTED_USERS][NAME_SIZE]; /* Under CLIENT_MUTEX. */
+static size_t g_departed_next = 0; /* Slot the next one takes. Under CLIENT_MUTEX. */
+static Client_t *g_peers[MAX_PEERS]; /* Under CLIENT_MUTEX. */
+static Remote_user_t g_remote[MAX_REMOTE_USERS]; /* Under CLIENT_MUTEX. */
+static Fed_seen_t g_fed_seen; /* Under CLIENT_MUTEX. */
+static unsigned long g_fed_seq; /* Last frame born here. Under CLIENT_MUTEX. */
 static _Atomic unsigned int g_client_id = 1;
-static FILE *g_log_file;
-static int g_quit = 0;
+static Logfile_t g_log;
+static Observers_t g_observers; /* Running if G_CONFIG.OBSERVER_PORT. */
+static volatile sig_atomic_t g_quit = 0;
+static volatile sig_atomic_t g_reload = 0; /* Read the filter terms again. */
+static volatile sig_atomic_t g_dump_trace = 0; /* Write the spans traced so far. */
+static sigset_t g_wait_mask; /* Signals the accept loop takes while it waits. */
+static Filter_t *g_filter = NULL; /* Under FILTER_LOCK. */
+static pthread_rwlock_t filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Wheel_t g_wheel; /* Under WHEEL_MUTEX. */
+/* Timers fire with it held. Taken before any other lock. */
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t g_tick; /* Last tick the wheel ran. */
+static _Atomic size_t g_next_cpu = 0; /* Index into G_CONFIG.CPUS. */
+static Capture_t *g_capture = NULL; /* Set while capturing. */
+static _Atomic uint32_t g_capture_conns = 0; /* Connections captured so far. */
+static _Thread_local uint32_t g_capture_conn; /* The one the thread serves. */
+static Server_state_t g_snapshot; /* Copy on its way to disk. Under SNAPSHOT_MUTEX. */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Server_config_t g_config =
+{
+	.backlog = LISTEN_BACKLOG,
+	.defer_accept = 0,
+	.workers = 0,
+	.socket_path = NULL,
+	.port = PORTNO,
+	.node = 0,
+	.peer_port = 0,
+	.npeers = 0,
+	.filter_path = NULL,
+	.heartbeat = HEARTBEAT,
+	.idle = 0,
+	.ncpus = 0,
+	.busy_poll = 0,
+	.spin = 0,
+	.trace_every = 0,
+	.capture_path = NULL,
+	.snapshot_path = NULL,
+	.log_size = 0,
+	.log_age = 0,
+	.mem_budget = (size_t) MEM_BUDGET * 1024 * 1024,
+	.observer_port = 0
+};
+static Pool_t g_pool;
 static Chat_colours_t g_colours_used[TOTAL_COLOURS] =
 {
 	{RED, 0},
@@ -84,122 +394,363 @@ static Chat_colours_t g_colours_used[TOTAL_COLOURS] =
 };
 
 static Client_t *create_client(char *, unsigned int, int);
-static void add_client(Client_t *);
+static void client_ref(Client_t *);
+static void client_unref(Client_t *);
+static int add_client(Client_t *, const Client_options_t *);
+static int open_session(Client_t *, const Client_options_t *);
+static void close_session(const Client_t *);
+static Session_t *find_session(const char *);
+static void replay_history(Client_t *, const unsigned long);
 static void remove_client(const unsigned int);
+static void accept_connections(const int, void *(*)(void *));
+static void accept_observers(const int);
+static void *handle_connection(void *);
+static void pin_connection(const int);
+static void capture(const char, const char *, const size_t);
 static void *manage_client(void *);
-static int client_exists(const char *);
+static void process_message(char *, Client_t *);
+static void sanitize_message(char *);
+static const char *command_args(const char *, const char *);
+static void submit_command(Task_fn, Client_t *, const long);
+static int receive_shm_messages(Client_t *);
+static int client_send(Client_t *, const char *, const size_t);
+static int client_send_frame(Client_t *, const char, const char *, const size_t);
+static void queue_reply(Client_t *, const char *, const size_t);
+static void queue_frame(Client_t *, const char, const char *, const size_t);
+static void queue_data(Client_t *, const char *, const size_t);
+static Reply_t *new_reply(Client_t *, const size_t);
+static void push_reply(Client_t *, Reply_t *);
+static void append_reply(Client_t *, Reply_t *);
+static int mem_charge(Client_t *, const size_t);
+static void mem_release(Client_t *, const size_t);
+static Mem_pressure mem_pressure(void);
+static ssize_t deflate_frame(Client_t *, const char, const char *, const size_t, const int, char *, const size_t);
+static void queue_deflated(const int, const char, const char *, const size_t, const int, const Client_t *, int *);
+static void deflate_resync(void);
+static void send_replies(Client_t *);
+static void start_export(Client_t *, const char *);
+static int continue_export(Client_t *);
+static int next_export_part(Export_t *);
+static void finish_export(Client_t *);
+static void clear_export(Client_t *);
+static int parse_log_time(const char *, time_t *, time_t *);
+static off_t log_search(const int, off_t, off_t, const time_t);
+static int log_line(const int, const off_t, const off_t, time_t *, off_t *);
+static ssize_t send_wait(const int, const void *, const size_t);
+static int shm_send_wait(Client_t *, const void *, const size_t);
 static void broadcast_message(const char*, Client_t *, const Message_source);
+static void deliver_line(const char *, const char *, Client_t *, const unsigned int, const char *);
+static void notify_mentions(const char *, const char *, const unsigned int, const unsigned long,
+			    const Client_t *);
+static int known_user(const char *);
+static void departed_add(const char *);
+static int departed_find(const char *);
+static void keep_mention(const char *, const char *, const unsigned long, const char *);
+static void deliver_mentions(Client_t *);
 static void send_whisper(char *, Client_t *);
-static void send_client_list(Client_t *);
+static void send_client_list(void *);
+static void subscribe_presence(void *);
+static void notify_presence(const char, const char *, const unsigned int, const int);
+static void queue_member(Client_t *, const char, const unsigned int, const int, const char *);
+static int colour_index(const char *);
+static const char *member_name(const int);
+static void *handle_peer(void *);
+static void *dial_peer(void *);
+static void serve_peer(const int);
+static void *peer_writer(void *);
+static void *run_timers(void *);
+static uint64_t clock_tick(void);
+static void arm_handshake(Timer_t *, const int);
+static void handshake_expired(Timer_t *);
+static void start_heartbeat(Client_t *);
+static void stop_timer(Timer_t *);
+static void heartbeat(Timer_t *);
+static int add_peer(Client_t *);
+static void remove_peer(Client_t *);
+static void fed_frame(Fed_frame_t *, const char, const char *);
+static void fed_send(Client_t *, const Fed_frame_t *);
+static void fed_relay(const Fed_frame_t *, const Client_t *);
+static void fed_receive(Fed_frame_t *, Client_t *);
+static int fed_sanitize(Fed_frame_t *);
+static Remote_user_t *remote_find(const char *);
+static uint32_t name_hash(const char *);
+static Client_t *client_find(const char *);
+static void name_add(Client_t *);
+static void name_remove(const Client_t *);
 static void log_message(const char *, Client_t *, const Message_source);
+static int moderate_message(char *, Client_t *);
+static void reload_filter(void);
+static void dump_trace(void);
 static void sig_quit_program(int);
+static void sig_reload_filter(int);
+static void sig_dump_trace(int);
 static int setup_signals(void);
-static int prepare_server(struct sockaddr_in6 *, size_t, int *);
+static int parse_options(int, char *[]);
+static int parse_cpus(const char *);
+static void print_usage(const char *);
+static int prepare_server(struct sockaddr_in6 *, size_t, const int, int *);
+static int prepare_unix_server(const char *, int *);
 static New_connection_status_codes_wrapper process_new_connection(const int);
 static Client_name_status_codes_wrapper process_client_name(const int, char *,
-                                                            const size_t);
-static void cleanup(int, FILE *);
+                                                            const size_t,
+                                                            Client_t **);
+static int parse_hello(char *, char *, const size_t, Client_options_t *);
+static int session_name(const char *, char *);
+static Shm_link_t *create_shm_link(const int, int *);
+static void restore_snapshot(void);
+static void save_snapshot(void);
+static void *run_snapshots(void *);
+static void cleanup(int, int, int, int);
 
 int
-main(void)
+main(int argc, char *argv[])
 {
 	int fd = 0;
+	int ufd = -1; /* Unix domain socket, for clients on this host. */
+	int pfd = -1; /* Links from other nodes. */
+	int ofd = -1; /* Observers. */
 	struct sockaddr_in6 sa6;
 
-	if (prepare_server(&sa6, sizeof(sa6), &fd) == -1) {
+	if (parse_options(argc, argv) == -1) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (prepare_server(&sa6, sizeof(sa6), g_config.port, &fd) == -1) {
 		perror("Error preparing the server to listen for connections: ");
 		exit(EXIT_FAILURE);
 	}
 
+	if (g_config.socket_path && prepare_unix_server(g_config.socket_path, &ufd) == -1) {
+		perror("Error preparing the server to listen on the unix socket: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_config.peer_port && prepare_server(&sa6, sizeof(sa6), g_config.peer_port, &pfd) == -1) {
+		perror("Error preparing the server to listen for other nodes: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_config.observer_port && prepare_server(&sa6, sizeof(sa6), g_config.observer_port, &ofd) == -1) {
+		perror("Error preparing the server to listen for observers: ");
+		exit(EXIT_FAILURE);
+	}
+
 	if (setup_signals() == -1) {
 		perror("Error setting up signals: ");
 		exit(EXIT_FAILURE);
 	}
 
+	if (g_config.capture_path && !(g_capture = capture_open(g_config.capture_path))) {
+		perror("Error starting the capture: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (trace_init(g_config.trace_every) == -1) {
+		perror("Error setting up tracing: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_config.filter_path && !(g_filter = filter_load(g_config.filter_path))) {
+		perror("Error loading the filter terms: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_config.snapshot_path)
+		restore_snapshot();
+
+	if (g_config.workers == 0 && g_config.ncpus)
+		g_config.workers = g_config.ncpus;
+	else if (g_config.workers == 0)
+		g_config.workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	/* The accept loop, and the timer thread it starts, share the first CPU. */
+	if (g_config.ncpus && pin_thread(g_config.cpus[0]) == -1) {
+		perror("Error pinning the main thread: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pool_init(&g_pool, g_config.workers, g_config.cpus, g_config.ncpus) == -1) {
+		fprintf(stderr, "Error starting the worker threads.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	/* Open the file to save a log of public messages. */
-	g_log_file = fopen(LOG_FILE_NAME, "a");
+	if (logfile_open(&g_log, LOG_FILE_NAME, LOG_ARCHIVE_DIR, g_config.log_size, g_config.log_age) == -1) {
+		perror("Error opening the log: ");
+		exit(EXIT_FAILURE);
+	}
 
-	puts("Server started.");
+	g_fed_seq = fed_first_seq();
 
-	while (!g_quit) {
-		pthread_t tid;
-		struct sockaddr_in6 ca6; /* Client address IPv6. */
-		socklen_t ca6_len = sizeof(ca6);
+	g_tick = clock_tick();
+	wheel_init(&g_wheel, g_tick);
 
-		int cfd = accept(fd, (struct sockaddr*) &ca6, (socklen_t*) &ca6_len);
-		New_connection_status_codes_wrapper ncscw = process_new_connection(cfd);
+	pthread_t timers;
 
-		switch (ncscw.nconn_err) {
-		case NEW_CONN_SYSTEM_ERR:
-			perror("Error processing new connection: ");
-			close(cfd);
-			continue;
-		case NEW_CONN_SV_FULL_ERR:
-			close(cfd);
-			continue;
-		case NEW_CONN_OK:
-			break;
+	if (pthread_create(&timers, NULL, run_timers, NULL) != 0) {
+		fprintf(stderr, "Error creating the timer thread.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_detach(timers);
+
+	if (g_config.observer_port && observers_start(&g_observers) == -1) {
+		perror("Error starting the observers' thread: ");
+		exit(EXIT_FAILURE);
+	}
+
+	if (g_config.snapshot_path) {
+		pthread_t snapshots;
+
+		if (pthread_create(&snapshots, NULL, run_snapshots, NULL) != 0) {
+			fprintf(stderr, "Error creating the snapshot thread.\n");
+			exit(EXIT_FAILURE);
 		}
 
-		char name[NAME_SIZE];
-		Client_name_status_codes_wrapper cnscw = process_client_name(cfd, name, sizeof(name));
+		pthread_detach(snapshots);
+	}
 
-		switch (cnscw.cname_err) {
-		case CL_NAME_SYSTEM_ERR:
-			perror("Error processing client's name: ");
-			close(cfd);
-			continue;
-		case CL_NAME_EXISTS_ERR:
-			close(cfd);
-			continue;
-		case CL_NAME_OK:
-			break;
+	for (int i = 0; i < g_config.npeers; ++i) {
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, dial_peer, (void *) g_config.peers[i]) != 0) {
+			fprintf(stderr, "Error creating thread to link to %s.\n", g_config.peers[i]);
+			exit(EXIT_FAILURE);
 		}
 
-		Client_t *c = create_client(name, g_client_id, cfd);
-		add_client(c);
+		pthread_detach(tid);
+	}
+
+	puts("Server started.");
+
+	struct pollfd pfds[4] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = ufd, .events = POLLIN }, /* Ignored by poll(2) if -1. */
+		{ .fd = pfd, .events = POLLIN },
+		{ .fd = ofd, .events = POLLIN }
+	};
+
+	while (!g_quit) {
+		if (ppoll(pfds, 4, NULL, &g_wait_mask) == -1) {
+			if (errno != EINTR)
+				perror("Error polling the listening sockets: ");
+
+			if (g_reload) {
+				g_reload = 0;
+				reload_filter();
+			}
+
+			if (g_dump_trace) {
+				g_dump_trace = 0;
+				dump_trace();
+			}
 
-		++g_clients_connected;
-		++g_client_id;
+			continue;
+		}
 
-		/* Notify everyone that someone has connected. */
-		char buff[BUFF_SIZE];
-		snprintf(buff, sizeof(buff), "%s has connected.", c->name);
-		printf("%s\n", buff);
-		broadcast_message(buff, c, SRC_SERVER);
-		log_message(buff, c, SRC_SERVER);
+		for (int i = 0; i < 3; ++i)
+			if (pfds[i].revents & POLLIN)
+				accept_connections(pfds[i].fd, pfds[i].fd == pfd ? handle_peer : handle_connection);
 
-		pthread_create(&tid, NULL, manage_client, (void *) c);
+		if (pfds[3].revents & POLLIN)
+			accept_observers(ofd);
 	}
 
-	cleanup(fd, g_log_file);
+	if (g_config.snapshot_path)
+		save_snapshot();
+
+	cleanup(fd, ufd, pfd, ofd);
 
 	return EXIT_SUCCESS;
 }
 
 /*
  * @brief Find the first NULL slot in the array of current clients
- * connected and assign it to the new client.
+ * connected and assign it to the new client, along with a colour that
+ * is not in use yet.
+ *
+ * Checking the name and taking the slot happen under the same lock, since
+ * several connections may be going through the handshake at once. For the
+ * same reason, the session is opened and what the client missed is queued
+ * here too: no public message can slip in between.
  *
  * @param[in] c New client connected.
+ * @param[in] opts What the client asked for when joining.
+ *
+ * @return 0 ok; -1 if the name is already taken, there is no free slot or
+ * the session can't be resumed.
  */
-static void
-add_client(Client_t *c)
+static int
+add_client(Client_t *c, const Client_options_t *opts)
 {
+	int slot = -1;
+
 	pthread_mutex_lock(&client_mutex);
 
-	for (int i = 0; i < MAX_CLIENTS; ++i)
-		if (g_clients[i] == NULL) {
-			g_clients[i] = c;
-			break;
+	for (int i = 0; i < MAX_CLIENTS && slot == -1; ++i)
+		if (g_clients[i] == NULL)
+			slot = i;
+
+	/* Names are unique across every node we know of. */
+	if (client_find(c->name) || remote_find(c->name))
+		slot = -1;
+
+	if (slot != -1 && c->seq && open_session(c, opts) == -1)
+		slot = -1;
+
+	if (slot != -1) {
+		/* Binary clients need to know everyone before their first message. */
+		if (c->binary)
+			for (int i = 0; i < MAX_CLIENTS; ++i)
+				if (g_clients[i])
+					queue_member(c, FRAME_JOIN, g_clients[i]->id,
+						     colour_index(g_clients[i]->colour), g_clients[i]->name);
+
+		if (c->binary)
+			for (int i = 0; i < MAX_REMOTE_USERS; ++i)
+				if (g_remote[i].name[0])
+					queue_member(c, FRAME_JOIN, g_remote[i].id,
+						     colour_index(REMOTE_COLOUR), g_remote[i].name);
+
+		g_clients[slot] = c;
+		name_add(c);
+
+		/* Assign a colour that is not yet used: the one of its session, if it can. */
+		Session_t *session = c->token[0] ? find_session(c->token) : NULL;
+		int colour = session && session->colour >= 0 && !g_colours_used[session->colour].used
+			     ? session->colour : -1;
+
+		for (int i = 0; colour == -1 && i < TOTAL_COLOURS; ++i)
+			if (!g_colours_used[i].used)
+				colour = i;
+
+		if (colour != -1) {
+			strcpy(c->colour, g_colours_used[colour].colour);
+			g_colours_used[colour].used = 1;
+
+			if (session)
+				session->colour = colour;
 		}
 
+		notify_presence('+', c->name, c->id, colour_index(c->colour));
+
+		Fed_frame_t frame;
+		fed_frame(&frame, FED_JOIN, c->name);
+		fed_relay(&frame, NULL);
+
+		deliver_mentions(c);
+	}
+
 	pthread_mutex_unlock(&client_mutex);
+
+	return slot == -1 ? -1 : 0;
 }
 
 /*
  * @brief Find the client that has the id passed as parameter.
- * Then, close its fd and free everything.
+ * Then, close its fd and drop the chatroom's reference to it. The memory
+ * goes away once the tasks still working for the client are done.
  *
  * @param[in] id Id of the client to remove.
  */
@@ -215,9 +766,18 @@ remove_client(const unsigned int id)
 			/* Release colour. */
 			for (int j = 0; j < TOTAL_COLOURS; ++j)
 				if (strcmp(g_clients[i]->colour, g_colours_used[j].colour) == 0)
-					g_colours_used[i].used = 0;
+					g_colours_used[j].used = 0;
+
+			notify_presence('-', g_clients[i]->name, g_clients[i]->id, 0);
+			close_session(g_clients[i]);
 
-			free(g_clients[i]);
+			Fed_frame_t frame;
+			fed_frame(&frame, FED_LEAVE, g_clients[i]->name);
+			fed_relay(&frame, NULL);
+
+			name_remove(g_clients[i]);
+			departed_add(g_clients[i]->name);
+			client_unref(g_clients[i]);
 			g_clients[i] = NULL;
 			break;
 		}
@@ -226,306 +786,3527 @@ remove_client(const unsigned int id)
 }
 
 /*
- * @brief malloc a new client with the given parameters and return it.
+ * @brief Gives C a session: the one it is resuming, or a new one. Then
+ * queues the session line and, when resuming, what was missed.
  *
- * @param[in] name Client name in the chatroom.
- * @param[in] id Client id.
- * @param[in] fd Client file descriptor.
+ * @param[in out] c
+ * @param[in] opts What the client asked for when joining.
+ *
+ * @return 0 ok; -1 if the session to resume is gone or in use.
  *
- * @return New allocated client.
+ * @note CLIENT_MUTEX has to be held.
  */
-static Client_t *
-create_client(char *name, unsigned int id, int fd)
+static int
+open_session(Client_t *c, const Client_options_t *opts)
 {
-	Client_t *c = (Client_t *) malloc(sizeof(Client_t));
-	strcpy(c->name, name);
-	c->id = id;
-	c->fd = fd;
-	strcpy(c->colour, RESET);
-
-	/* Assign a colour that is not yet used. */
-	for (int i = 0; i < TOTAL_COLOURS; ++i)
-		if (!g_colours_used[i].used) {
-			strcpy(c->colour, g_colours_used[i].colour);
-			g_colours_used[i].used = 1;
-			break;
-		}
+	Session_t *session = NULL;
+	char buff[BUFF_SIZE];
+	time_t now = time(NULL);
 
-	return c;
-}
+	if (opts->resume) {
+		session = find_session(opts->token);
 
-/*
- * @brief Each client connected will be managed by this function. It
- * basically handles incoming messages from the client.
- *
- * @param[in] c New client connected to the chatroom.
- */
-static void *
-manage_client(void *c)
-{
-	Client_t *client = (Client_t *) c;
+		if (!session || session->expires == 0 || strcmp(session->name, c->name) != 0)
+			return -1;
+	} else {
+		unsigned char bytes[SESSION_TOKEN_SIZE / 2];
 
-	char msg[BUFF_SIZE];
-	int response = 0;
+		if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+			return -1;
 
-	while (1) {
-		memset(msg, '\0', sizeof(msg));
+		/* Take a free slot, or else the one expiring first. */
+		for (int i = 0; i < MAX_SESSIONS; ++i) {
+			Session_t *s = &g_sessions[i];
 
-		if ((response = recv(client->fd, msg, sizeof(msg), 0)) > 0) {
-			if (strcmp(msg, LIST_CMD) == 0) {
-				send_client_list(client);
-			} else if (strstr(msg, WHISP_CMD) != NULL) {
-				send_whisper(msg, client);
-			} else {
-				broadcast_message(msg, client, SRC_CLIENT);
-				log_message(msg, client, SRC_CLIENT);
+			if (s->token[0] == '\0' || (s->expires != 0 && s->expires < now)) {
+				session = s;
+				break;
 			}
-		} else if (response == 0) {
-			snprintf(msg, sizeof(msg), "%s has quit.", client->name);
-			broadcast_message(msg, client, SRC_SERVER);
-			log_message(msg, client, SRC_SERVER);
-			printf("%s\n", msg);
-			break;
-		} else {
-			perror("Error recv'ing data from client: ");
-			break;
+
+			if (s->expires != 0 && (!session || s->expires < session->expires))
+				session = s;
 		}
 
+		if (!session)
+			return -1;
+
+		for (size_t i = 0; i < sizeof(bytes); ++i)
+			sprintf(session->token + 2 * i, "%02x", bytes[i]);
+
+		strcpy(session->name, c->name);
+		session->colour = -1;
 	}
 
-	remove_client(client->id);
-	--g_clients_connected;
+	session->expires = 0;
+	strcpy(c->token, session->token);
 
-	return NULL;
+	int len = snprintf(buff, sizeof(buff), SESSION_CMD " %s %lu\n", c->token, g_seq);
+	queue_reply(c, buff, len);
+
+	if (opts->resume)
+		replay_history(c, opts->last_seq);
+
+	return 0;
 }
 
 /*
- * @brief Checks if NAME is already in G_CLIENTS.
+ * @brief The client of the session is gone: it can be resumed for
+ * SESSION_TTL seconds.
  *
- * @param[in] name Client's name.
+ * @param[in] c
  *
- * @return 1 if the NAME already exists; 0 otherwise.
+ * @note CLIENT_MUTEX has to be held.
  */
-static int
-client_exists(const char *name)
+static void
+close_session(const Client_t *c)
 {
-	pthread_mutex_lock(&client_mutex);
+	Session_t *session;
 
-	for (int i = 0; i < MAX_CLIENTS; ++i)
-		if (g_clients[i] && strcmp(g_clients[i]->name, name) == 0) {
-			pthread_mutex_unlock(&client_mutex);
-			return 1;
-		}
-
-	pthread_mutex_unlock(&client_mutex);
-
-	return 0;
+	if (c->token[0] && (session = find_session(c->token)))
+		session->expires = time(NULL) + SESSION_TTL;
 }
 
 /*
- * @brief Broadcasts message to everyone connected to the chat room
- * except the sender.
+ * @brief Looks for the session with TOKEN, if it hasn't expired.
  *
- * @param[in] msg
- * @param[in] sender
- * @param[in] cmsg Client message: 1 or 0.
+ * @param[in] token
+ *
+ * @return The session; NULL if there is none.
+ *
+ * @note CLIENT_MUTEX has to be held.
  */
-static void
-broadcast_message(const char *msg, Client_t *sender, const Message_source ms)
+static Session_t *
+find_session(const char *token)
 {
-	pthread_mutex_lock(&client_mutex);
-
-	char buff[BUFF_SIZE];
+	time_t now = time(NULL);
 
-	if (ms == SRC_SERVER)
-		snprintf(buff, sizeof(buff), "%s\n", msg);
-	else
-		snprintf(buff, sizeof(buff), "%s%s%s: %s\n",
-			 sender->colour,
-			 sender->name,
-			 RESET,
-			 msg);
+	for (int i = 0; i < MAX_SESSIONS; ++i)
+		if (strcmp(g_sessions[i].token, token) == 0) {
+			if (g_sessions[i].expires != 0 && g_sessions[i].expires < now)
+				return NULL;
 
-	for (int i = 0; i < MAX_CLIENTS; ++i) {
-		if (g_clients[i] && g_clients[i]->fd != sender->fd) {
-			if ((send(g_clients[i]->fd, buff, strlen(buff), 0)) == -1)
-				perror("Error broadcasting msg: ");
+			return &g_sessions[i];
 		}
-	}
 
-	pthread_mutex_unlock(&client_mutex);
+	return NULL;
 }
 
 /*
- * @brief Parse MSG to extract the client that has to receive the message
- * and the actual message.
+ * @brief Queues for C the public messages after LAST_SEQ that are still
+ * in the history. If some of them are gone already, C is told how many.
  *
- * @param[in] msg format: "Clientname: !whisp receivername message"
- * @param[in] sender
+ * @param[in] c
+ * @param[in] last_seq Last message C saw.
  *
+ * @note CLIENT_MUTEX has to be held.
  */
 static void
-send_whisper(char *msg, Client_t *sender)
+replay_history(Client_t *c, const unsigned long last_seq)
 {
-	/* Copy MSG To TMP because strtok modifies it. */
-	char tmp[MSG_SIZE] = "";
+	char buff[LINE_SIZE + 24];
+	unsigned long oldest = g_seq >= HISTORY_SIZE ? g_seq - HISTORY_SIZE + 1 : 1;
+	unsigned long from = last_seq + 1;
 
-	for (size_t i = 0; i < strlen(msg); ++i)
-		tmp[i] = msg[i];
+	/* Short of memory, scrollback is the first thing to go. */
+	if (mem_pressure() >= MEM_SHED)
+		oldest = g_seq + 1;
 
-	char name[NAME_SIZE] = "";
-	char contents[MSG_SIZE] = "";
+	if (from < oldest) {
+		int len = snprintf(buff, sizeof(buff), "[... %lu messages were lost ...]\n", oldest - from);
+		queue_reply(c, buff, len);
+		from = oldest;
+	}
 
-	int i = 0;
-	const int name_pos = 1;
-	char *tok = strtok(tmp, " ");
+	for (unsigned long seq = from; seq <= g_seq; ++seq) {
+		History_entry_t *e = &g_history[seq % HISTORY_SIZE];
 
-	while (tok) {
-		if (i == name_pos)
-			strncpy(name, tok, NAME_SIZE - 1);
-		else if (i > name_pos) {
-			strcat(contents, tok);
-			strcat(contents, " ");
-		}
+		/* Nobody gets their own messages back. */
+		if (strcmp(e->sender, c->name) == 0)
+			continue;
 
-		tok = strtok(NULL, " ");
-		++i;
+		int len = snprintf(buff, sizeof(buff), "#%lu %s", e->seq, e->line);
+		queue_reply(c, buff, len);
 	}
+}
+
+/*
+ * @brief malloc a new client with the given parameters and return it.
+ * The colour is assigned once the client gets added to the chatroom.
+ *
+ * @param[in] name Client name in the chatroom.
+ * @param[in] id Client id.
+ * @param[in] fd Client file descriptor.
+ *
+ * @return New allocated client; NULL on error.
+ */
+static Client_t *
+create_client(char *name, unsigned int id, int fd)
+{
+	Client_t *c = (Client_t *) malloc(sizeof(Client_t));
+
+	if (!c)
+		return NULL;
+
+	if ((c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		free(c);
+		return NULL;
+	}
+
+	strcpy(c->name, name);
+	c->id = id;
+	c->fd = fd;
+	strcpy(c->colour, RESET);
+	c->refs = 1;
+	pthread_mutex_init(&c->write_mutex, NULL);
+	pthread_mutex_init(&c->reply_mutex, NULL);
+	c->replies_head = NULL;
+	c->replies_tail = NULL;
+	c->mem = 0;
+	c->shm = NULL;
+	c->presence = 0;
+	c->queued = 1;
+	c->seq = 0;
+	c->token[0] = '\0';
+	c->node = 0;
+	c->binary = 0;
+	c->deflate = 0;
+	c->z = NULL;
+	timer_init(&c->timer, heartbeat, c);
+	c->last_seen = 0;
+	c->last_message = 0;
+	c->pinged = 0;
+	c->expired = EXPIRED_NOT;
+	c->export.fd = -1;
+	c->export.parts = NULL;
+	c->export.held = 0;
+
+	return c;
+}
+
+/*
+ * @brief Takes a reference to C so it outlives its connection while a
+ * task still needs it.
+ *
+ * @param[in] c
+ */
+static void
+client_ref(Client_t *c)
+{
+	++c->refs;
+}
+
+/*
+ * @brief Drops a reference to C and frees it when it was the last one.
+ *
+ * @param[in] c
+ */
+static void
+client_unref(Client_t *c)
+{
+	if (--c->refs > 0)
+		return;
+
+	while (c->replies_head) {
+		Reply_t *r = c->replies_head;
+		c->replies_head = r->next;
+		mem_release(c, sizeof(Reply_t) + r->len);
+		free(r);
+	}
+
+	if (c->shm) {
+		shm_link_destroy(c->shm);
+		free(c->shm);
+	}
+
+	pthread_mutex_lock(&deflate_mutex);
+	deflater_unref(c->z);
+	pthread_mutex_unlock(&deflate_mutex);
+
+	clear_export(c);
+	close(c->efd);
+	pthread_mutex_destroy(&c->write_mutex);
+	pthread_mutex_destroy(&c->reply_mutex);
+	free(c);
+}
+
+/*
+ * @brief Accept every connection waiting on the listening socket FD and
+ * hand each one to its own thread running HANDLER. TCP and unix domain
+ * sockets go through the exact same path from here on. We keep calling
+ * accept4(2) until the kernel tells us the queue is empty, so a burst of
+ * reconnects is drained in a single wake-up instead of one poll(2) round
+ * trip per connection.
+ *
+ * @param[in] fd Server's file descriptor.
+ * @param[in] handler Gets the connection's file descriptor.
+ */
+static void
+accept_connections(const int fd, void *(*handler)(void *))
+{
+	while (1) {
+		int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Error accepting connection: ");
+
+			return;
+		}
+
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, handler, (void *) (intptr_t) cfd) != 0) {
+			fprintf(stderr, "Error creating thread for a new connection.\n");
+			close(cfd);
+			continue;
+		}
+
+		pthread_detach(tid);
+	}
+}
+
+/*
+ * @brief Accepts every observer waiting on FD and hands it over to the
+ * observers' thread. The handshake is the status line alone: observers
+ * don't send anything, and need no name, so no thread of their own. The
+ * ones beyond MAX_OBSERVERS get ERR_STATUS, and the ones coming while
+ * the server is short of memory are told to retry later.
+ *
+ * @param[in] fd Listening socket for observers.
+ */
+static void
+accept_observers(const int fd)
+{
+	char buff[BUFF_SIZE];
+
+	while (1) {
+		int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Error accepting observer: ");
+
+			return;
+		}
+
+		int ok = 0;
+
+		if (g_observers.watching >= MAX_OBSERVERS) {
+			strcpy(buff, ERR_STATUS "\n");
+		} else if (mem_pressure() == MEM_FULL) {
+			snprintf(buff, sizeof(buff), ERR_STATUS " " RETRY_STATUS " %d\n", RETRY_AFTER);
+		} else {
+			strcpy(buff, OK_STATUS "\n");
+			ok = 1;
+		}
+
+		/* A fresh socket always has room for it. */
+		if (send(cfd, buff, strlen(buff), MSG_NOSIGNAL) == -1 || !ok || observers_add(&g_observers, cfd) == -1)
+			close(cfd);
+	}
+}
+
+/*
+ * @brief Runs the handshake with a freshly accepted connection and, if
+ * everything goes well, keeps managing it as a client of the chatroom.
+ *
+ * The handshake lives here instead of the accept loop so a slow client
+ * can't hold back everyone else trying to connect.
+ *
+ * @param[in] arg Client's file descriptor.
+ */
+static void *
+handle_connection(void *arg)
+{
+	int cfd = (int) (intptr_t) arg;
+	Timer_t handshake;
+
+	pin_connection(cfd);
+	capture(CAPTURE_OPEN, NULL, 0);
+	arm_handshake(&handshake, cfd);
+
+	New_connection_status_codes_wrapper ncscw = process_new_connection(cfd);
+
+	switch (ncscw.nconn_err) {
+	case NEW_CONN_SYSTEM_ERR:
+		errno = ncscw.system_err;
+		perror("Error processing new connection: ");
+		stop_timer(&handshake);
+		close(cfd);
+		capture(CAPTURE_CLOSE, NULL, 0);
+		return NULL;
+	case NEW_CONN_SV_FULL_ERR:
+	case NEW_CONN_SV_BUSY_ERR:
+		stop_timer(&handshake);
+		close(cfd);
+		capture(CAPTURE_CLOSE, NULL, 0);
+		return NULL;
+	case NEW_CONN_OK:
+		break;
+	}
+
+	char name[NAME_SIZE];
+	Client_t *c = NULL;
+	Client_name_status_codes_wrapper cnscw = process_client_name(cfd, name, sizeof(name), &c);
+
+	stop_timer(&handshake);
+
+	switch (cnscw.cname_err) {
+	case CL_NAME_SYSTEM_ERR:
+		errno = cnscw.system_err;
+		perror("Error processing client's name: ");
+		/* FALLTHROUGH */
+	case CL_NAME_EXISTS_ERR:
+		if (c)
+			remove_client(c->id);
+		else
+			close(cfd);
+		--g_clients_connected;
+		g_mem -= CONN_MEM;
+		capture(CAPTURE_CLOSE, NULL, 0);
+		return NULL;
+	case CL_NAME_OK:
+		break;
+	}
+
+	/* Notify everyone that someone has connected. */
+	char buff[BUFF_SIZE];
+	snprintf(buff, sizeof(buff), "%s has connected.", c->name);
+	printf("%s\n", buff);
+	broadcast_message(buff, c, SRC_SERVER);
+	log_message(buff, c, SRC_SERVER);
+
+	return manage_client(c);
+}
+
+/*
+ * @brief Sets up the thread serving FD for low latency: the socket busy
+ * polls the device queue if so configured and, with a CPU list, both the
+ * thread and the kernel's processing of FD's packets move to the next
+ * CPU of the list.
+ *
+ * @param[in] fd
+ */
+static void
+pin_connection(const int fd)
+{
+	if (g_config.busy_poll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &g_config.busy_poll,
+					     sizeof(g_config.busy_poll)) == -1)
+		perror("Error setting SO_BUSY_POLL: ");
+
+	if (!g_config.ncpus)
+		return;
+
+	int cpu = g_config.cpus[g_next_cpu++ % g_config.ncpus];
+
+	if (pin_thread(cpu) == -1)
+		perror("Error pinning a connection thread: ");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+		perror("Error setting SO_INCOMING_CPU: ");
+}
+
+/*
+ * @brief Adds an event of the connection the calling thread serves to
+ * the capture, if there is one. CAPTURE_OPEN gives the connection its
+ * number.
+ *
+ * @param[in] type A Capture_type.
+ * @param[in] data
+ * @param[in] len
+ */
+static void
+capture(const char type, const char *data, const size_t len)
+{
+	if (!g_capture)
+		return;
+
+	if (type == CAPTURE_OPEN)
+		g_capture_conn = ++g_capture_conns;
+
+	capture_record(g_capture, g_capture_conn, type, data, len);
+}
+
+/*
+ * @brief Each client connected will be managed by this function. It
+ * basically handles incoming messages from the client, and writes the
+ * replies the workers prepared for it.
+ *
+ * @param[in] c New client connected to the chatroom.
+ */
+static void *
+manage_client(void *c)
+{
+	Client_t *client = (Client_t *) c;
+
+	Line_buffer_t lb = { .start = 0, .end = 0 };
+	struct pollfd pfds[3] = {
+		{ .fd = client->fd, .events = POLLIN },
+		{ .fd = client->efd, .events = POLLIN },
+		{ .fd = client->shm ? client->shm->efd_in : -1, .events = POLLIN }
+	};
+	char msg[BUFF_SIZE];
+	int response = 0;
+
+	start_heartbeat(client);
+
+	while (1) {
+		int timeout = -1;
+
+		/* Replies wait until the history is out; the socket is all its. */
+		pfds[0].events = client->export.fd == -1 ? POLLIN : POLLIN | POLLOUT;
+		pfds[1].events = client->export.fd == -1 ? POLLIN : 0;
+
+		if (client->shm) {
+			if (receive_shm_messages(client) == -1) {
+				perror("Error reading from shared memory: ");
+				break;
+			}
+
+			/* Don't go to sleep if more messages are waiting. */
+			if (!shm_link_prepare_wait(client->shm))
+				timeout = 0;
+		}
+
+		int res = poll_spin(pfds, 3, timeout, g_config.spin);
+
+		if (client->shm && timeout == -1)
+			shm_link_finish_wait(client->shm);
+
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Error polling client: ");
+			break;
+		}
+
+		if (pfds[1].revents & POLLIN)
+			send_replies(client);
+
+		if ((pfds[0].revents & POLLOUT) && continue_export(client) == -1) {
+			perror("Error sending the history: ");
+			break;
+		}
+
+		if (!(pfds[0].revents & ~POLLOUT))
+			continue;
+
+		uint64_t recv_start = trace_clock();
+
+		if ((response = line_buffer_fill(&lb, client->fd)) > 0) {
+			uint64_t recv_end = trace_clock();
+			char *line;
+
+			while ((line = line_buffer_next(&lb))) {
+				capture(CAPTURE_LINE, line, strlen(line));
+				trace_message(recv_start, recv_end);
+				process_message(line, client);
+			}
+
+			g_trace_id = 0;
+		} else if (response == 0) {
+			if (client->expired == EXPIRED_DEAD)
+				snprintf(msg, sizeof(msg), "%s has lost the connection.", client->name);
+			else if (client->expired == EXPIRED_IDLE)
+				snprintf(msg, sizeof(msg), "%s has been idle for too long.", client->name);
+			else
+				snprintf(msg, sizeof(msg), "%s has quit.", client->name);
+
+			broadcast_message(msg, client, SRC_SERVER);
+			log_message(msg, client, SRC_SERVER);
+			printf("%s\n", msg);
+			break;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("Error recv'ing data from client: ");
+			break;
+		}
+	}
+
+	stop_timer(&client->timer);
+	remove_client(client->id);
+	--g_clients_connected;
+	g_mem -= CONN_MEM;
+	capture(CAPTURE_CLOSE, NULL, 0);
+
+	return NULL;
+}
+
+/*
+ * @brief Acts on a single message sent by CLIENT. Cheap things are done
+ * right here; heavy commands are handed over to the worker pool so they
+ * never hold back the chat traffic. Whatever the client sent, nothing
+ * that could mess with other terminals gets past this point.
+ *
+ * @param[in out] msg Message, without the newline.
+ * @param[in] client Sender.
+ */
+static void
+process_message(char *msg, Client_t *client)
+{
+	uint64_t parse = trace_enter();
+
+	sanitize_message(msg);
+	client->last_seen = g_tick;
+
+	if (*msg == '\0' || strcmp(msg, PONG_CMD) == 0)
+		return;
+
+	client->last_message = g_tick;
+
+	const char *args;
+	long page = 1;
+
+	if ((args = command_args(msg, LIST_CMD))) {
+		if (*args && parse_long(args, 1, MAX_MEMBERS, &page) == -1)
+			page = 1;
+
+		submit_command(send_client_list, client, page);
+	} else if ((args = command_args(msg, HISTORY_CMD))) {
+		start_export(client, args);
+	} else if ((args = command_args(msg, PRESENCE_CMD))) {
+		if (strcmp(args, PRESENCE_OFF) == 0) {
+			pthread_mutex_lock(&client_mutex);
+			client->presence = 0;
+			pthread_mutex_unlock(&client_mutex);
+		} else {
+			submit_command(subscribe_presence, client, 0);
+		}
+	} else if (strstr(msg, WHISP_CMD) != NULL) {
+		send_whisper(msg, client);
+	} else if (moderate_message(msg, client) == 0) {
+		trace_leave(TRACE_PARSE, parse);
+		broadcast_message(msg, client, SRC_CLIENT);
+		log_message(msg, client, SRC_CLIENT);
+	}
+}
+
+/*
+ * @brief Runs the public message MSG of CLIENT through the filter, which
+ * may mask parts of it. Flagged messages are shown on the console.
+ *
+ * @param[in out] msg
+ * @param[in] client Sender. Told if the message gets dropped.
+ *
+ * @return 0 the message can go on; -1 it has to be dropped.
+ */
+static int
+moderate_message(char *msg, Client_t *client)
+{
+	int res = FILTER_PASS;
+
+	pthread_rwlock_rdlock(&filter_lock);
+
+	if (g_filter)
+		res = filter_apply(g_filter, msg, strlen(msg));
+
+	pthread_rwlock_unlock(&filter_lock);
+
+	if (res & FILTER_FLAG)
+		printf("Flagged message from %s: %s\n", client->name, msg);
+
+	if (res & FILTER_DROP) {
+		queue_reply(client, DROPPED_MSG, strlen(DROPPED_MSG));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Builds the filter again from its file, and swaps it for the one
+ * in use. If the file can't be read, the old filter stays.
+ */
+static void
+reload_filter(void)
+{
+	Filter_t *f;
+
+	if (!g_config.filter_path)
+		return;
+
+	if (!(f = filter_load(g_config.filter_path))) {
+		perror("Error reloading the filter terms, keeping the old ones: ");
+		return;
+	}
+
+	pthread_rwlock_wrlock(&filter_lock);
+	Filter_t *old = g_filter;
+	g_filter = f;
+	pthread_rwlock_unlock(&filter_lock);
+
+	filter_free(old);
+	printf("Filter reloaded: %zu terms.\n", f->terms);
+}
+
+/*
+ * @brief Writes the spans of the messages traced so far to
+ * TRACE_FILE_NAME, for Perfetto.
+ */
+static void
+dump_trace(void)
+{
+	int n;
+
+	if (!g_config.trace_every) {
+		fprintf(stderr, "Tracing is off: nothing to dump.\n");
+		return;
+	}
+
+	if ((n = trace_dump(TRACE_FILE_NAME)) == -1) {
+		perror("Error dumping the trace: ");
+		return;
+	}
+
+	printf("Trace dumped to " TRACE_FILE_NAME ": %d spans.\n", n);
+}
+
+/*
+ * @brief Checks whether MSG is the command CMD.
+ *
+ * @param[in] msg
+ * @param[in] cmd
+ *
+ * @return The arguments of the command, possibly empty; NULL if MSG is
+ * not CMD.
+ */
+static const char *
+command_args(const char *msg, const char *cmd)
+{
+	size_t len = strlen(cmd);
+
+	if (strncmp(msg, cmd, len) != 0)
+		return NULL;
+
+	if (msg[len] == '\0')
+		return msg + len;
+
+	return msg[len] == ' ' ? ltrim((char *) msg + len) : NULL;
+}
+
+/*
+ * @brief Hands the command FN over to the worker pool. If the pool can't
+ * take it, CLIENT is told to try again later.
+ *
+ * @param[in] fn Command to run.
+ * @param[in] client Who asked for it.
+ * @param[in] page Page wanted, for paginated commands.
+ */
+static void
+submit_command(Task_fn fn, Client_t *client, const long page)
+{
+	Command_t *cmd = malloc(sizeof(Command_t));
+
+	if (cmd) {
+		client_ref(client);
+		cmd->client = client;
+		cmd->page = page;
+
+		if (pool_submit(&g_pool, fn, cmd) == 0)
+			return;
+
+		client_unref(client);
+		free(cmd);
+	}
+
+	queue_reply(client, BUSY_MSG, strlen(BUSY_MSG));
+}
+
+/*
+ * @brief Processes the messages a shared memory peer left in its ring.
+ * At most SHM_BATCH of them, so the replies for the peer are not held
+ * back by a long burst.
+ *
+ * @param[in] client
+ *
+ * @return 0 ok; -1 if the ring is corrupted.
+ */
+static int
+receive_shm_messages(Client_t *client)
+{
+	char msg[BUFF_SIZE];
+	ssize_t len;
+
+	for (int i = 0; i < SHM_BATCH; ++i) {
+		if ((len = shm_link_recv(client->shm, msg, sizeof(msg) - 1)) <= 0)
+			return len;
+
+		msg[len] = '\0';
+		msg[strcspn(msg, "\n")] = '\0';
+		capture(CAPTURE_LINE, msg, strlen(msg));
+		trace_message(0, 0);
+		process_message(msg, client);
+	}
+
+	g_trace_id = 0;
+
+	return 0;
+}
+
+/*
+ * @brief Writes a message to CLIENT, over whatever it is connected
+ * through. Never waits: if the socket doesn't take the whole message, the
+ * rest is queued, and so is everything after it until it is out. While
+ * the client is QUEUED, the message joins its reply queue instead.
+ *
+ * @param[in] client Receiver.
+ * @param[in] buff
+ * @param[in] len
+ *
+ * @return 0 ok; -1 error.
+ */
+static int
+client_send(Client_t *client, const char *buff, const size_t len)
+{
+	return client_send_frame(client, FRAME_TEXT, buff, len);
+}
+
+/*
+ * @brief Same as client_send(), but binary clients get it as a frame of
+ * TYPE. Text clients only ever get FRAME_TEXT.
+ *
+ * @param[in] client Receiver.
+ * @param[in] type
+ * @param[in] buff
+ * @param[in] len
+ *
+ * @return 0 ok, sent or queued; -1 error, and nothing was.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static int
+client_send_frame(Client_t *client, const char type, const char *buff, size_t len)
+{
+	char frame[FRAME_SIZE];
+	const char *data = buff;
+	size_t size = len;
+	int res = 0;
+
+	/* A compressed stream can't lose a single byte: it always waits its turn. */
+	if (client->deflate) {
+		queue_frame(client, type, buff, len);
+		return 0;
+	}
+
+	pthread_mutex_lock(&client->write_mutex);
+
+	/*
+	 * The client's thread has the socket, and can't give it back while we
+	 * hold CLIENT_MUTEX.
+	 */
+	if (client->queued) {
+		pthread_mutex_unlock(&client->write_mutex);
+		queue_frame(client, type, buff, len);
+		return 0;
+	}
+
+	if (client->binary) {
+		if (len > sizeof(frame) - FRAME_HEADER_SIZE) {
+			pthread_mutex_unlock(&client->write_mutex);
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		frame_header(frame, type, len);
+		memcpy(frame + FRAME_HEADER_SIZE, buff, len);
+		data = frame;
+		size += FRAME_HEADER_SIZE;
+	}
+
+	if (client->shm) {
+		/* A full ring is like a full socket: the message waits its turn. */
+		if ((res = shm_link_send(client->shm, data, size)) == -1 && errno == EAGAIN) {
+			Reply_t *r = new_reply(client, size);
+
+			if (r) {
+				memcpy(r->data, data, size);
+				append_reply(client, r);
+				res = 0;
+			}
+		}
+
+		pthread_mutex_unlock(&client->write_mutex);
+		return res;
+	}
+
+	ssize_t n = send(client->fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (n == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			pthread_mutex_unlock(&client->write_mutex);
+			return -1;
+		}
+
+		n = 0;
+	}
+
+	/*
+	 * A frame goes whole or not at all: what the socket didn't take goes
+	 * first in the queue, and the client's thread writes it, and whatever
+	 * comes after, as the socket takes it.
+	 */
+	if ((size_t) n < size) {
+		Reply_t *r = new_reply(client, size - n);
+
+		if (r) {
+			memcpy(r->data, data + n, size - n);
+			append_reply(client, r);
+		} else {
+			/* Half a frame would leave the client out of step for good. */
+			if (n > 0)
+				shutdown(client->fd, SHUT_RDWR);
+
+			res = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&client->write_mutex);
+
+	return res;
+}
+
+/*
+ * @brief Leaves a reply for CLIENT's thread to write, and wakes it up.
+ *
+ * @param[in] client Receiver.
+ * @param[in] data
+ * @param[in] len
+ */
+static void
+queue_reply(Client_t *client, const char *data, const size_t len)
+{
+	queue_frame(client, FRAME_TEXT, data, len);
+}
+
+/*
+ * @brief Same as queue_reply(), but binary clients get it as a frame of
+ * TYPE. Text clients only ever get FRAME_TEXT.
+ *
+ * @param[in] client Receiver.
+ * @param[in] type
+ * @param[in] data
+ * @param[in] len
+ */
+static void
+queue_frame(Client_t *client, const char type, const char *data, const size_t len)
+{
+	size_t header = client->binary ? FRAME_HEADER_SIZE : 0;
+
+	if (client->deflate) {
+		char out[DEFLATER_BOUND(FRAME_SIZE)];
+
+		pthread_mutex_lock(&deflate_mutex);
+
+		ssize_t n = deflater_unshare(&client->z) == -1 ? -1
+			    : deflate_frame(client, type, data, len, Z_PARTIAL_FLUSH, out, sizeof(out));
+
+		if (n > 0) {
+			queue_data(client, out, n);
+		} else if (n == -1) {
+			perror("Error compressing reply: ");
+			shutdown(client->fd, SHUT_RDWR);
+		}
+
+		pthread_mutex_unlock(&deflate_mutex);
+		return;
+	}
+
+	Reply_t *r = new_reply(client, header + len);
+
+	if (!r)
+		return;
+
+	if (header)
+		frame_header(r->data, type, len);
+
+	memcpy(r->data + header, data, len);
+	push_reply(client, r);
+}
+
+/*
+ * @brief Same as queue_reply(), but DATA goes out exactly as it is, not
+ * even framed.
+ *
+ * @param[in] client Receiver.
+ * @param[in] data
+ * @param[in] len
+ */
+static void
+queue_data(Client_t *client, const char *data, const size_t len)
+{
+	Reply_t *r = new_reply(client, len);
+
+	if (!r)
+		return;
+
+	memcpy(r->data, data, len);
+	push_reply(client, r);
+}
+
+/*
+ * @brief Allocates a reply of LEN bytes for CLIENT, charged to the
+ * memory budget. Once the budget is spent the reply is dropped, as a full
+ * socket would drop it. A compressed stream can't lose a byte, and a
+ * client holding more than its share is too slow to keep up: both get
+ * hung up on instead, which gives their memory back.
+ *
+ * @param[in out] client
+ * @param[in] len
+ *
+ * @return The reply; NULL if it was dropped.
+ */
+static Reply_t *
+new_reply(Client_t *client, const size_t len)
+{
+	const size_t size = sizeof(Reply_t) + len;
+	Reply_t *r = NULL;
+
+	if (mem_charge(client, size) == 0 && !(r = (Reply_t *) malloc(size)))
+		mem_release(client, size);
+
+	if (!r) {
+		if (client->deflate || client->mem > g_config.mem_budget / MAX_CLIENTS)
+			shutdown(client->fd, SHUT_RDWR);
+
+		return NULL;
+	}
+
+	r->next = NULL;
+	r->len = len;
+
+	return r;
+}
+
+/*
+ * @brief Appends R to the reply queue of CLIENT, and wakes its thread up.
+ *
+ * @param[in out] client
+ * @param[in] r From new_reply(), filled in.
+ */
+static void
+push_reply(Client_t *client, Reply_t *r)
+{
+	pthread_mutex_lock(&client->write_mutex);
+	append_reply(client, r);
+	pthread_mutex_unlock(&client->write_mutex);
+}
+
+/*
+ * @brief Same as push_reply(). From now on, and until its thread has
+ * written the queue out, nobody else writes to the client's socket.
+ *
+ * @param[in out] client
+ * @param[in] r
+ *
+ * @note CLIENT's WRITE_MUTEX has to be held.
+ */
+static void
+append_reply(Client_t *client, Reply_t *r)
+{
+	pthread_mutex_lock(&client->reply_mutex);
+
+	if (client->replies_tail)
+		client->replies_tail->next = r;
+	else
+		client->replies_head = r;
+
+	client->replies_tail = r;
+	client->queued = 1;
+
+	pthread_mutex_unlock(&client->reply_mutex);
+
+	if (eventfd_write(client->efd, 1) == -1)
+		perror("Error waking up client thread: ");
+}
+
+/*
+ * @brief Charges SIZE bytes held for CLIENT to the memory budget.
+ *
+ * @param[in out] client
+ * @param[in] size
+ *
+ * @return 0 ok; -1 if that would go over the budget.
+ */
+static int
+mem_charge(Client_t *client, const size_t size)
+{
+	if ((g_mem += size) > g_config.mem_budget && g_config.mem_budget) {
+		g_mem -= size;
+		return -1;
+	}
+
+	client->mem += size;
+
+	return 0;
+}
+
+/*
+ * @brief Gives back SIZE bytes charged with mem_charge().
+ *
+ * @param[in out] client
+ * @param[in] size
+ */
+static void
+mem_release(Client_t *client, const size_t size)
+{
+	client->mem -= size;
+	g_mem -= size;
+}
+
+/*
+ * @brief Tells how close connections are to the memory budget.
+ *
+ * @return The pressure.
+ */
+static Mem_pressure
+mem_pressure(void)
+{
+	size_t used = g_mem + (g_config.observer_port ? g_observers.mem : 0);
+
+	if (!g_config.mem_budget || used < g_config.mem_budget / 4 * 3)
+		return MEM_OK;
+
+	return used < g_config.mem_budget / 8 * 7 ? MEM_SHED : MEM_FULL;
+}
+
+/*
+ * @brief Frames DATA the way CLIENT wants it, and compresses it through
+ * the stream of CLIENT. Whoever shares that stream has to get the result
+ * too.
+ *
+ * @param[in] client
+ * @param[in] type
+ * @param[in] data
+ * @param[in] len
+ * @param[in] flush Z_PARTIAL_FLUSH, or Z_FULL_FLUSH.
+ * @param[in out] out
+ * @param[in] size sizeof(out)
+ *
+ * @return Bytes written to OUT; -1 error, and the stream is broken.
+ *
+ * @note DEFLATE_MUTEX has to be held.
+ */
+static ssize_t
+deflate_frame(Client_t *client, const char type, const char *data, const size_t len,
+	      const int flush, char *out, const size_t size)
+{
+	char plain[FRAME_SIZE];
+	size_t header = client->binary ? FRAME_HEADER_SIZE : 0;
+
+	if (header + len > sizeof(plain)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (header)
+		frame_header(plain, type, len);
+
+	memcpy(plain + header, data, len);
+
+	return deflater_run(client->z, plain, header + len, out, size, flush);
+}
+
+/*
+ * @brief Compresses DATA once for the I-th client and every client after
+ * it sharing its stream, and queues it for all of them but EXCEPT.
+ *
+ * @param[in] i
+ * @param[in] type
+ * @param[in] data
+ * @param[in] len
+ * @param[in] flush Z_PARTIAL_FLUSH, or Z_FULL_FLUSH.
+ * @param[in] except Doesn't share a stream with anybody.
+ * @param[in out] done Clients served already.
+ *
+ * @note CLIENT_MUTEX and DEFLATE_MUTEX have to be held.
+ */
+static void
+queue_deflated(const int i, const char type, const char *data, const size_t len,
+	       const int flush, const Client_t *except, int *done)
+{
+	char out[DEFLATER_BOUND(FRAME_SIZE)];
+	Deflater_t *z = g_clients[i]->z;
+	ssize_t n = deflate_frame(g_clients[i], type, data, len, flush, out, sizeof(out));
+
+	for (int j = i; j < MAX_CLIENTS; ++j) {
+		Client_t *c = g_clients[j];
+
+		if (!c || c == except || c->z != z)
+			continue;
+
+		done[j] = 1;
+
+		if (n > 0) {
+			queue_data(c, out, n);
+		} else if (n == -1) {
+			perror("Error compressing message: ");
+			shutdown(c->fd, SHUT_RDWR);
+		}
+	}
+}
+
+/*
+ * @brief Flushes every compressed stream in full, so what comes next
+ * doesn't refer to anything sent before. From then on, clients that get
+ * the same messages in the same shape share a single stream: they only
+ * go apart again when one of them gets something of its own.
+ *
+ * @note CLIENT_MUTEX and DEFLATE_MUTEX have to be held.
+ */
+static void
+deflate_resync(void)
+{
+	Deflater_t *shared[4] = { NULL };
+	int done[MAX_CLIENTS] = { 0 };
+
+	for (int i = 0; i < MAX_CLIENTS; ++i)
+		if (g_clients[i] && g_clients[i]->deflate && !done[i])
+			queue_deflated(i, FRAME_TEXT, "", 0, Z_FULL_FLUSH, NULL, done);
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		Client_t *c = g_clients[i];
+
+		if (!c || !c->deflate)
+			continue;
+
+		/* Same shape: framed or not, numbered or not. */
+		Deflater_t **z = &shared[2 * c->binary + c->seq];
+
+		if (!*z) {
+			*z = c->z;
+		} else if (c->z != *z) {
+			deflater_unref(c->z);
+			c->z = deflater_ref(*z);
+		}
+	}
+}
+
+/*
+ * @brief Writes every reply waiting for CLIENT to its socket.
+ *
+ * @param[in] client
+ */
+static void
+send_replies(Client_t *client)
+{
+	eventfd_t n;
+	(void) eventfd_read(client->efd, &n);
+
+	pthread_mutex_lock(&client->reply_mutex);
+	Reply_t *r = client->replies_head;
+	client->replies_head = NULL;
+	client->replies_tail = NULL;
+	pthread_mutex_unlock(&client->reply_mutex);
+
+	while (r) {
+		Reply_t *next = r->next;
+
+		if (client->shm) {
+			if (shm_send_wait(client, r->data, r->len) == -1)
+				perror("Error sending reply: ");
+		} else if (send_wait(client->fd, r->data, r->len) == -1) {
+			perror("Error sending reply: ");
+		}
+
+		mem_release(client, sizeof(Reply_t) + r->len);
+		free(r);
+		r = next;
+	}
+
+	/*
+	 * Once the queue is empty, and with CLIENT_MUTEX held so nobody can be
+	 * queueing a broadcast meanwhile, messages can go straight to the
+	 * client.
+	 */
+	if (client->queued && client->export.fd == -1) {
+		pthread_mutex_lock(&client_mutex);
+		pthread_mutex_lock(&client->write_mutex);
+		pthread_mutex_lock(&client->reply_mutex);
+
+		if (!client->replies_head)
+			client->queued = 0;
+
+		pthread_mutex_unlock(&client->reply_mutex);
+		pthread_mutex_unlock(&client->write_mutex);
+		pthread_mutex_unlock(&client_mutex);
+	}
+}
+
+/*
+ * @brief Sets CLIENT up to get the stretch of the log that ARGS asks for,
+ * from the segments of the archive it spans and from the log being
+ * written. The bytes go from the page cache straight to the socket as it
+ * takes them, with sendfile(2), so even huge exports cost next to no CPU.
+ * Only the timestamps of a few lines are read, to find where the stretch
+ * starts and ends. Segments the archive compressed are the exception:
+ * they get uncompressed into memory first, which costs CPU and is charged
+ * to the memory budget, and the export is refused with BUSY_MSG if the
+ * budget can't take it. From here on, and until the export is over,
+ * whatever else the client gets waits in its reply queue.
+ *
+ * Compressed streams and shared memory links can't take the bytes as
+ * they are, so they don't get any.
+ *
+ * @param[in out] client Its own thread calls us.
+ * @param[in] args "<from> <to>"
+ */
+static void
+start_export(Client_t *client, const char *args)
+{
+	char from_str[32];
+	char to_str[32];
+	char extra;
+	time_t from;
+	time_t to;
+	time_t span;
+	struct stat st;
+	Export_t *e = &client->export;
+
+	if (sscanf(args, "%31s %31s %c", from_str, to_str, &extra) != 2
+	    || parse_log_time(from_str, &from, &span) == -1
+	    || parse_log_time(to_str, &to, &span) == -1) {
+		queue_reply(client, HISTORY_USAGE_MSG, strlen(HISTORY_USAGE_MSG));
+		return;
+	}
+
+	if (client->deflate || client->shm || e->fd != -1) {
+		queue_reply(client, HISTORY_DENIED_MSG, strlen(HISTORY_DENIED_MSG));
+		return;
+	}
+
+	/* Everything else for the client piles up meanwhile: not while short of memory. */
+	if (mem_pressure() >= MEM_SHED) {
+		queue_reply(client, BUSY_MSG, strlen(BUSY_MSG));
+		return;
+	}
+
+	Log_segment_t *segments;
+	size_t nsegments;
+	int fd = logfile_segments(&g_log, from, to + span, &segments, &nsegments);
+
+	e->nparts = nsegments + 1;
+	e->next = 0;
+
+	if (fd == -1 || fstat(fd, &st) == -1 || !(e->parts = calloc(e->nparts, sizeof(Export_part_t)))) {
+		perror("Error opening the log: ");
+
+		if (fd != -1)
+			close(fd);
+
+		free(segments);
+		queue_reply(client, HISTORY_DENIED_MSG, strlen(HISTORY_DENIED_MSG));
+		return;
+	}
+
+	for (size_t i = 0; i < nsegments; ++i)
+		e->parts[i] = (Export_part_t) { .fd = -1, .id = segments[i].id, .off = 0, .end = segments[i].size,
+						.compressed = segments[i].compressed };
+
+	e->parts[nsegments] = (Export_part_t) { .fd = fd, .off = 0, .end = st.st_size };
+	free(segments);
+
+	/*
+	 * Compressed segments are sent from memory, uncompressed whole: the
+	 * first one, the last two and one in between are held at most.
+	 */
+	size_t held = 0;
+	size_t middle = 0;
+
+	for (size_t i = 0; i < nsegments; ++i) {
+		Export_part_t *p = &e->parts[i];
+
+		if (!p->compressed)
+			continue;
+
+		if (i == 0 || i + 2 >= e->nparts)
+			held += p->end;
+		else if ((size_t) p->end > middle)
+			middle = p->end;
+	}
+
+	if (held + middle && mem_charge(client, held + middle) == -1) {
+		clear_export(client);
+		queue_reply(client, BUSY_MSG, strlen(BUSY_MSG));
+		return;
+	}
+
+	e->held = held + middle;
+
+	/*
+	 * Lines are in order from one part to the next, so only the first
+	 * segment, the last one and the log may have lines out of the stretch.
+	 */
+	long long bytes = 0;
+
+	for (size_t i = 0; i < e->nparts; ++i) {
+		Export_part_t *p = &e->parts[i];
+
+		if (i == 0 || i + 2 >= e->nparts) {
+			if (p->fd == -1 && (p->fd = logfile_open_segment(&g_log, p->id)) == -1) {
+				perror("Error opening a segment of the log: ");
+				clear_export(client);
+				queue_reply(client, HISTORY_DENIED_MSG, strlen(HISTORY_DENIED_MSG));
+				return;
+			}
+
+			p->off = log_search(p->fd, 0, p->end, from);
+			p->end = log_search(p->fd, p->off, p->end, to + span);
+		}
+
+		bytes += p->end - p->off;
+	}
+
+	if (next_export_part(e) == -1) {
+		perror("Error opening a segment of the log: ");
+		clear_export(client);
+		queue_reply(client, HISTORY_DENIED_MSG, strlen(HISTORY_DENIED_MSG));
+		return;
+	}
+
+	/* Nothing can go straight to the socket now; send what came before. */
+	pthread_mutex_lock(&client_mutex);
+	pthread_mutex_lock(&client->write_mutex);
+	client->queued = 1;
+	pthread_mutex_unlock(&client->write_mutex);
+	pthread_mutex_unlock(&client_mutex);
+
+	send_replies(client);
+
+	char header[BUFF_SIZE];
+	int len;
+
+	if (client->binary) {
+		frame_header(header, FRAME_HISTORY, 8);
+		put_be(header + FRAME_HEADER_SIZE, bytes, 8);
+		len = FRAME_HEADER_SIZE + 8;
+	} else {
+		len = snprintf(header, sizeof(header), HISTORY_CMD " %lld\n", bytes);
+	}
+
+	if (send_wait(client->fd, header, len) == -1)
+		perror("Error sending the history: ");
+
+	/* Nothing in the stretch: that was it. */
+	if (e->fd == -1)
+		finish_export(client);
+}
+
+/*
+ * @brief Sends as much of the export in progress as the socket takes
+ * without blocking, and wraps it up once it is all out.
+ *
+ * @param[in out] client
+ *
+ * @return 0 ok; -1 error, the connection is no good anymore.
+ */
+static int
+continue_export(Client_t *client)
+{
+	Export_t *e = &client->export;
+
+	if (e->fd == -1)
+		return 0;
+
+	while (e->fd != -1) {
+		if (e->off == e->end) {
+			if (next_export_part(e) == -1)
+				return -1;
+
+			continue;
+		}
+
+		ssize_t n = sendfile(client->fd, e->fd, &e->off, e->end - e->off);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		/* The log got shorter under us: we can't keep our word. */
+		if (n == 0)
+			errno = EIO;
+
+		if (n <= 0)
+			return -1;
+
+		/* The client is busy reading, not gone: no need to ping it. */
+		client->last_seen = g_tick;
+	}
+
+	finish_export(client);
+
+	return 0;
+}
+
+/*
+ * @brief Moves E on to the next part with something to send, and opens
+ * it if it is a segment of the archive that isn't open yet.
+ *
+ * @param[in out] e
+ *
+ * @return 0 ok, with E->FD at -1 if there is nothing left; -1 if the part
+ * can't be opened, with errno set.
+ */
+static int
+next_export_part(Export_t *e)
+{
+	if (e->fd != -1)
+		close(e->fd);
+
+	e->fd = -1;
+
+	while (e->next < e->nparts) {
+		Export_part_t *p = &e->parts[e->next++];
+
+		if (p->off == p->end) {
+			if (p->fd != -1)
+				close(p->fd);
+
+			p->fd = -1;
+			continue;
+		}
+
+		if (p->fd == -1 && (p->fd = logfile_open_segment(&g_log, p->id)) == -1)
+			return -1;
+
+		e->fd = p->fd;
+		e->off = p->off;
+		e->end = p->end;
+		p->fd = -1;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Closes the export of CLIENT, and lets the replies that piled up
+ * meanwhile out.
+ *
+ * @param[in out] client
+ */
+static void
+finish_export(Client_t *client)
+{
+	clear_export(client);
+	send_replies(client);
+}
+
+/*
+ * @brief Closes whatever the export of CLIENT still has open, frees its
+ * parts and gives back the memory they were charged.
+ *
+ * @param[in out] client
+ */
+static void
+clear_export(Client_t *client)
+{
+	Export_t *e = &client->export;
+
+	if (e->held) {
+		mem_release(client, e->held);
+		e->held = 0;
+	}
+
+	if (e->fd != -1)
+		close(e->fd);
+
+	e->fd = -1;
+
+	if (!e->parts)
+		return;
+
+	for (size_t i = e->next; i < e->nparts; ++i)
+		if (e->parts[i].fd != -1)
+			close(e->parts[i].fd);
+
+	free(e->parts);
+	e->parts = NULL;
+}
+
+/*
+ * @brief Reads a time given to HISTORY_CMD.
+ *
+ * @param[in] str YYYY-MM-DD[THH:MM[:SS]], in UTC.
+ * @param[in out] t Its first second.
+ * @param[in out] span Seconds it covers: a day, a minute or one.
+ *
+ * @return 0 ok; -1 if STR is not a valid time.
+ */
+static int
+parse_log_time(const char *str, time_t *t, time_t *span)
+{
+	struct tm tm = { 0 };
+	int n = 0;
+	int m = 0;
+
+	if (sscanf(str, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3)
+		return -1;
+
+	*span = 24 * 60 * 60;
+
+	if (str[n] == 'T') {
+		if (sscanf(str + n, "T%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &m) != 2)
+			return -1;
+
+		n += m;
+		*span = 60;
+
+		if (str[n] == ':') {
+			if (sscanf(str + n, ":%2d%n", &tm.tm_sec, &m) != 1)
+				return -1;
+
+			n += m;
+			*span = 1;
+		}
+	}
+
+	if (str[n] != '\0' || tm.tm_year < 1970 || tm.tm_mon < 1 || tm.tm_mon > 12
+	    || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour < 0 || tm.tm_hour > 23
+	    || tm.tm_min < 0 || tm.tm_min > 59 || tm.tm_sec < 0 || tm.tm_sec > 60)
+		return -1;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*t = timegm(&tm);
+
+	return 0;
+}
+
+/*
+ * @brief Looks for the first line of the log, between LO and HI, logged
+ * at T or later. Lines are in the order they were logged, so a binary
+ * search over the bytes finds it reading a handful of them.
+ *
+ * @param[in] fd Of the log.
+ * @param[in] lo Start of a line.
+ * @param[in] hi Start of a line, or the size of the log.
+ * @param[in] t
+ *
+ * @return Where the line starts; HI if there is none.
+ */
+static off_t
+log_search(const int fd, off_t lo, off_t hi, const time_t t)
+{
+	char buff[LOG_WINDOW];
+
+	while (lo < hi) {
+		off_t mid = lo + (hi - lo) / 2;
+		off_t line = lo;
+		time_t when;
+		off_t next;
+
+		/* First line starting at MID or later, if there is one before HI. */
+		if (mid > lo) {
+			ssize_t n = pread(fd, buff, sizeof(buff), mid - 1);
+			char *nl = n > 0 ? memchr(buff, '\n', n) : NULL;
+
+			if (nl && mid + (nl - buff) < hi)
+				line = mid + (nl - buff);
+		}
+
+		/* Lines we can't make sense of count as old ones. */
+		if (log_line(fd, line, hi, &when, &next) == -1 || when < t)
+			lo = next;
+		else
+			hi = line;
+	}
+
+	return lo;
+}
+
+/*
+ * @brief Reads when the line of the log at OFF was logged.
+ *
+ * @param[in] fd Of the log.
+ * @param[in] off Start of the line.
+ * @param[in] hi Where the search ends; the line doesn't go past it.
+ * @param[in out] when
+ * @param[in out] next Start of the next line, or HI. Always past OFF.
+ *
+ * @return 0 ok; -1 if the line has no timestamp.
+ */
+static int
+log_line(const int fd, const off_t off, const off_t hi, time_t *when, off_t *next)
+{
+	char buff[LOG_WINDOW];
+	struct tm tm = { 0 };
+	ssize_t n = pread(fd, buff, sizeof(buff) - 1, off);
+
+	if (n <= 0) {
+		*next = hi;
+		return -1;
+	}
+
+	char *nl = memchr(buff, '\n', n);
+
+	*next = nl && off + (nl - buff) + 1 < hi ? off + (nl - buff) + 1 : hi;
+	buff[n] = '\0';
+
+	if (sscanf(buff, "[%d-%d-%d %d:%d:%d]", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		   &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return -1;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	*when = timegm(&tm);
+
+	return 0;
+}
+
+/*
+ * @brief Writes all of BUFF to the non-blocking socket FD, waiting with
+ * poll(2) whenever the socket buffer is full.
+ *
+ * @param[in] fd Socket to write to.
+ * @param[in] buff
+ * @param[in] size
+ *
+ * @return SIZE ok; -1 error.
+ */
+static ssize_t
+send_wait(const int fd, const void *buff, const size_t size)
+{
+	size_t sent = 0;
+
+	while (sent < size) {
+		ssize_t res = send(fd, (const char *) buff + sent, size - sent, 0);
+
+		if (res >= 0) {
+			sent += res;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return -1;
+	}
+
+	return sent;
+}
+
+/*
+ * @brief Same as send_wait(), through the shared memory link of CLIENT.
+ * The peer doesn't tell us when it makes room in the ring, so we look
+ * again every SHM_RETRY_MS until it does, or hangs up.
+ *
+ * @param[in] client
+ * @param[in] buff
+ * @param[in] size
+ *
+ * @return 0 ok; -1 error.
+ */
+static int
+shm_send_wait(Client_t *client, const void *buff, const size_t size)
+{
+	while (shm_link_send(client->shm, buff, size) == -1) {
+		if (errno != EAGAIN)
+			return -1;
+
+		/* Only hangups wake us up: whatever the peer sends can wait. */
+		struct pollfd pfd = { .fd = client->fd, .events = POLLRDHUP };
+		int res = poll(&pfd, 1, SHM_RETRY_MS);
+
+		if (res == -1 && errno != EINTR)
+			return -1;
+
+		if (res > 0) {
+			errno = EPIPE;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Broadcasts message to everyone connected to the chat room
+ * except the sender, and to the other nodes.
+ *
+ * @param[in] msg
+ * @param[in] sender
+ * @param[in] cmsg Client message: 1 or 0.
+ */
+static void
+broadcast_message(const char *msg, Client_t *sender, const Message_source ms)
+{
+	/* Room for the whole message plus the coloured name in front of it. */
+	char buff[LINE_SIZE];
+	Fed_frame_t frame;
+
+	if (ms == SRC_SERVER)
+		snprintf(buff, sizeof(buff), "%s\n", msg);
+	else
+		snprintf(buff, sizeof(buff), "%s%s%s: %s\n",
+			 sender->colour,
+			 sender->name,
+			 RESET,
+			 msg);
+
+	uint64_t lock = trace_enter();
+	pthread_mutex_lock(&client_mutex);
+	trace_leave(TRACE_LOCK, lock);
+
+	uint64_t send = trace_enter();
+
+	deliver_line(buff, sender->name, sender, ms == SRC_CLIENT ? sender->id : 0, msg);
+
+	fed_frame(&frame, ms == SRC_SERVER ? FED_NOTICE : FED_MESSAGE, sender->name);
+	snprintf(frame.text, sizeof(frame.text), "%s", msg);
+	fed_relay(&frame, NULL);
+
+	trace_leave(TRACE_SEND, send);
+	pthread_mutex_unlock(&client_mutex);
+}
+
+/*
+ * @brief Sends a public message to the clients connected to us, and keeps
+ * it in the history. Binary clients get a chat message as the id of its
+ * sender and the message alone.
+ *
+ * @param[in] line Message ready to be shown, newline included.
+ * @param[in] sender Name of who the message comes from, or is about.
+ * @param[in] except Client that doesn't get it. May be NULL.
+ * @param[in] id Id of the sender of a chat message; 0 for anything else.
+ * @param[in] msg The chat message, without the sender's name.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+deliver_line(const char *line, const char *sender, Client_t *except,
+	     const unsigned int id, const char *msg)
+{
+	History_entry_t *e = &g_history[++g_seq % HISTORY_SIZE];
+	int done[MAX_CLIENTS] = { 0 };
+
+	e->seq = g_seq;
+	strcpy(e->sender, sender);
+	snprintf(e->line, sizeof(e->line), "%s", line);
+
+	/* Same message, numbered, for the clients that want it. */
+	char seqbuff[LINE_SIZE + 24];
+	snprintf(seqbuff, sizeof(seqbuff), "#%lu %s", e->seq, e->line);
+
+	/* And in frames: sequence number, sender, message. */
+	char frame[8 + 4 + BUFF_SIZE];
+	size_t frame_len = 0;
+
+	if (id) {
+		put_be(frame, e->seq, 8);
+		put_be(frame + 8, id, 4);
+		frame_len = 8 + 4 + snprintf(frame + 12, sizeof(frame) - 12, "%s", msg);
+	}
+
+	pthread_mutex_lock(&deflate_mutex);
+
+	/* The sender goes its own way from whoever it shares a stream with. */
+	if (except && except->deflate && deflater_unshare(&except->z) == -1) {
+		perror("Error copying compressed stream: ");
+		shutdown(except->fd, SHUT_RDWR);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		Client_t *c = g_clients[i];
+		int res = 0;
+
+		if (!c || c == except || done[i])
+			continue;
+
+		char type = FRAME_TEXT;
+		const char *data = c->seq ? seqbuff : e->line;
+		size_t len = strlen(data);
+
+		if (c->binary && id) {
+			type = c->seq ? FRAME_SEQ_MESSAGE : FRAME_MESSAGE;
+			data = c->seq ? frame : frame + 8;
+			len = c->seq ? frame_len : frame_len - 8;
+		}
+
+		/* Compressed once for everyone sharing the stream. */
+		if (c->deflate)
+			queue_deflated(i, type, data, len, Z_PARTIAL_FLUSH, except, done);
+		else
+			res = client_send_frame(c, type, data, len);
+
+		if (res == -1)
+			perror("Error broadcasting msg: ");
+	}
+
+	if (g_seq % DEFLATE_RESYNC == 0)
+		deflate_resync();
+
+	pthread_mutex_unlock(&deflate_mutex);
+
+	/* Observers get it as a text client would, from their own thread. */
+	if (g_config.observer_port)
+		observers_publish(&g_observers, e->line, strlen(e->line));
+
+	/* Every node gets the message, but only the one it was born on keeps mentions. */
+	if (id)
+		notify_mentions(msg, sender, id, e->seq, except);
+}
+
+/*
+ * @brief Tells the users mentioned as "@name" in MSG that they were. The
+ * ones connected here get it right away; the ones not connected anywhere
+ * get it when they join again, if MSG comes from a client of ours and
+ * they were connected here before. Words naming nobody we know of are
+ * just words.
+ *
+ * @param[in] msg Chat message.
+ * @param[in] sender Its sender's name.
+ * @param[in] id Its sender's id.
+ * @param[in] seq Its sequence number.
+ * @param[in] except Its sender, if it is a client of ours; NULL otherwise.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+notify_mentions(const char *msg, const char *sender, const unsigned int id, const unsigned long seq,
+		const Client_t *except)
+{
+	char seen[MAX_MENTIONS][NAME_SIZE];
+	int n = 0;
+
+	for (const char *p = strchr(msg, '@'); p && n < MAX_MENTIONS; p = strchr(p, '@')) {
+		/* Only at the start of a word, so mail addresses don't count. */
+		if (p != msg && p[-1] != ' ') {
+			++p;
+			continue;
+		}
+
+		size_t len = strcspn(++p, " ");
+		char name[NAME_SIZE];
+		Client_t *c;
+
+		if (len < MIN_NAME_LEN || len >= NAME_SIZE) {
+			p += len;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%.*s", (int) len, p);
+		p += len;
+
+		/* "@name," or "@name:" mention name, unless there is someone called that. */
+		while (!known_user(name) && len > MIN_NAME_LEN && strchr(",.:;!?", name[len - 1]))
+			name[--len] = '\0';
+
+		if (!known_user(name))
+			continue;
+
+		int dup = strcmp(name, sender) == 0;
+
+		for (int i = 0; i < n && !dup; ++i)
+			dup = strcmp(seen[i], name) == 0;
+
+		if (dup)
+			continue;
+
+		strcpy(seen[n++], name);
+
+		if ((c = client_find(name))) {
+			char buff[NAME_SIZE + 48];
+			int res;
+
+			if (c->binary) {
+				put_be(buff, seq, 8);
+				put_be(buff + 8, id, 4);
+				res = client_send_frame(c, FRAME_MENTION, buff, 12);
+			} else {
+				snprintf(buff, sizeof(buff), MENTION_CMD " %lu %s\n", seq, sender);
+				res = client_send(c, buff, strlen(buff));
+			}
+
+			if (res == -1)
+				perror("Error sending mention: ");
+		} else if (except && !remote_find(name)) {
+			/* Known, so they left from here. */
+			keep_mention(name, sender, seq, msg);
+		}
+	}
+}
+
+/*
+ * @brief Tells whether NAME is a user: connected here or on another node,
+ * or one of the last DEPARTED_USERS to leave from here.
+ *
+ * @param[in] name
+ *
+ * @return 1 if so; 0 otherwise.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static int
+known_user(const char *name)
+{
+	return client_find(name) || remote_find(name) || departed_find(name);
+}
+
+/*
+ * @brief Remembers that the user called NAME left, taking the place of
+ * the one who left first if there is no room.
+ *
+ * @param[in] name
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+departed_add(const char *name)
+{
+	if (departed_find(name))
+		return;
+
+	strcpy(g_departed[g_departed_next++ % DEPARTED_USERS], name);
+}
+
+/*
+ * @param[in] name
+ *
+ * @return 1 if the user called NAME is remembered to have left; 0
+ * otherwise.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static int
+departed_find(const char *name)
+{
+	for (int i = 0; i < DEPARTED_USERS; ++i)
+		if (strcmp(g_departed[i], name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * @brief Keeps a mention of TARGET for when they join. The oldest one
+ * kept goes if there is no room, and nothing more is kept for TARGET once
+ * they have USER_MENTIONS waiting.
+ *
+ * @param[in] target
+ * @param[in] sender
+ * @param[in] seq
+ * @param[in] msg
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+keep_mention(const char *target, const char *sender, const unsigned long seq, const char *msg)
+{
+	int count = 0;
+
+	for (int i = 0; i < OFFLINE_MENTIONS; ++i)
+		if (strcmp(g_mentions[i].target, target) == 0)
+			++count;
+
+	if (count >= USER_MENTIONS)
+		return;
+
+	Mention_t *m = &g_mentions[g_mentions_next++ % OFFLINE_MENTIONS];
+
+	strcpy(m->target, target);
+	m->seq = seq;
+	strcpy(m->sender, sender);
+	snprintf(m->msg, sizeof(m->msg), "%s", msg);
+}
+
+/*
+ * @brief Queues the mentions C missed, oldest first, so they go out
+ * together with the rest of what C gets when joining, and forgets them.
+ *
+ * @param[in out] c
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+deliver_mentions(Client_t *c)
+{
+	char buff[LINE_SIZE + 48];
+
+	for (size_t i = 0; i < OFFLINE_MENTIONS; ++i) {
+		Mention_t *m = &g_mentions[(g_mentions_next + i) % OFFLINE_MENTIONS];
+
+		if (strcmp(m->target, c->name) != 0)
+			continue;
+
+		snprintf(buff, sizeof(buff), MENTION_CMD " %lu %s %s\n", m->seq, m->sender, m->msg);
+		queue_reply(c, buff, strlen(buff));
+		m->target[0] = '\0';
+	}
+}
+
+/*
+ * @brief Parse MSG to extract the client that has to receive the message
+ * and the actual message.
+ *
+ * @param[in] msg format: "Clientname: !whisp receivername message"
+ * @param[in] sender
+ *
+ */
+static void
+send_whisper(char *msg, Client_t *sender)
+{
+	/* Copy MSG To TMP because strtok modifies it. */
+	char tmp[MSG_SIZE] = "";
+
+	for (size_t i = 0; i < strlen(msg); ++i)
+		tmp[i] = msg[i];
+
+	char name[NAME_SIZE] = "";
+	char contents[MSG_SIZE] = "";
+
+	int i = 0;
+	const int name_pos = 1;
+	char *tok = strtok(tmp, " ");
+
+	while (tok) {
+		if (i == name_pos)
+			strncpy(name, tok, NAME_SIZE - 1);
+		else if (i > name_pos) {
+			strcat(contents, tok);
+			strcat(contents, " ");
+		}
+
+		tok = strtok(NULL, " ");
+		++i;
+	}
+
+	/* Find the client fd and send the message. */
+	pthread_mutex_lock(&client_mutex);
+
+	int found = 0;
+	char buff[BUFF_SIZE] = "Client not found.\n";
+	Client_t *c = client_find(name);
+
+	if (c) {
+		snprintf(buff, sizeof(buff), "%s" ITALIC "%s" ITALIC_OFF "%s: %s\n",
+			 sender->colour,
+			 sender->name,
+			 RESET,
+			 contents);
+
+		if (client_send(c, buff, strlen(buff)) == -1)
+			perror("Error sending whisper: ");
+
+		found = 1;
+	}
+
+	/* Someone on another node: it goes down the link towards them. */
+	Remote_user_t *r;
+
+	if (!found && (r = remote_find(name))) {
+		Fed_frame_t frame;
+
+		fed_frame(&frame, FED_WHISPER, sender->name);
+		strcpy(frame.target, name);
+		snprintf(frame.text, sizeof(frame.text), "%s", contents);
+		fed_send(r->via, &frame);
+		found = 1;
+	}
+
+	if (!found)
+		if (client_send(sender, buff, strlen(buff)) == -1)
+			perror("Error sending whisper, client not found: ");
+
+
+	pthread_mutex_unlock(&client_mutex);
+}
+
+/*
+ * @brief Builds one page of the client list and leaves it for the client's
+ * thread to send. The page number is only shown when there is more than
+ * one. Runs on the worker pool.
+ *
+ * @param[in] arg Command_t asking for the list. We own it.
+ */
+static void
+send_client_list(void *arg)
+{
+	Command_t *cmd = (Command_t *) arg;
+	char msg[BUFF_SIZE] = "\n";
+	char names[BUFF_SIZE] = "";
+	long first = (cmd->page - 1) * LIST_PAGE_SIZE;
+	long total = 0;
+
+	pthread_mutex_lock(&client_mutex);
+
+	for (int i = 0; i < MAX_MEMBERS; ++i)
+		if (member_name(i)) {
+			if (total >= first && total < first + LIST_PAGE_SIZE) {
+				strcat(names, member_name(i));
+				strcat(names, "\n");
+			}
+
+			++total;
+		}
+
+	pthread_mutex_unlock(&client_mutex);
+
+	long pages = (total + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE;
+
+	if (pages > 1)
+		snprintf(msg, sizeof(msg), "\nPage %ld/%ld\n", cmd->page, pages);
+
+	strcat(msg, names);
+
+	queue_reply(cmd->client, msg, strlen(msg));
+	client_unref(cmd->client);
+	free(cmd);
+}
+
+/*
+ * @brief Subscribes the client to presence changes. It first gets a
+ * snapshot of everyone connected, tagged with the current version:
+ *
+ *   !presence <version> snapshot <count>
+ *   !presence <version> = name1 name2 ...   (as many lines as needed)
+ *   !presence <version> end
+ *
+ * and from then on, one line per change, each one bumping the version:
+ *
+ *   !presence <version> +name
+ *   !presence <version> -name
+ *
+ * The snapshot is queued with CLIENT_MUTEX held, so no change can slip in
+ * between it and the first delta. Runs on the worker pool.
+ *
+ * @param[in] arg Command_t asking for the subscription. We own it.
+ */
+static void
+subscribe_presence(void *arg)
+{
+	Command_t *cmd = (Command_t *) arg;
+	char msg[BUFF_SIZE];
+	int count = 0;
+
+	pthread_mutex_lock(&client_mutex);
+
+	for (int i = 0; i < MAX_MEMBERS; ++i)
+		if (member_name(i))
+			++count;
+
+	int len = snprintf(msg, sizeof(msg), PRESENCE_CMD " %lu snapshot %d\n", g_presence_version, count);
+	queue_reply(cmd->client, msg, len);
+
+	len = 0;
+
+	for (int i = 0; i < MAX_MEMBERS; ++i) {
+		const char *name = member_name(i);
+
+		if (!name)
+			continue;
+
+		if (len > 0 && len + strlen(name) + 2 > MSG_SIZE) {
+			msg[len++] = '\n';
+			queue_reply(cmd->client, msg, len);
+			len = 0;
+		}
+
+		if (len == 0)
+			len = snprintf(msg, sizeof(msg), PRESENCE_CMD " %lu =", g_presence_version);
+
+		len += snprintf(msg + len, sizeof(msg) - len, " %s", name);
+	}
+
+	if (len > 0) {
+		msg[len++] = '\n';
+		queue_reply(cmd->client, msg, len);
+	}
+
+	len = snprintf(msg, sizeof(msg), PRESENCE_CMD " %lu end\n", g_presence_version);
+	queue_reply(cmd->client, msg, len);
+
+	cmd->client->presence = 1;
+
+	pthread_mutex_unlock(&client_mutex);
+
+	client_unref(cmd->client);
+	free(cmd);
+}
+
+/*
+ * @brief Bumps the presence version and tells every subscriber that NAME
+ * joined ('+') or left ('-'). Binary clients get it as a frame, with the
+ * id and colour of NAME.
+ *
+ * @param[in] op '+' or '-'.
+ * @param[in] name
+ * @param[in] id
+ * @param[in] colour Number of the colour of NAME.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+notify_presence(const char op, const char *name, const unsigned int id, const int colour)
+{
+	char msg[BUFF_SIZE];
+	int len = snprintf(msg, sizeof(msg), PRESENCE_CMD " %lu %c%s\n", ++g_presence_version, op, name);
+
+	for (int i = 0; i < MAX_CLIENTS; ++i) {
+		if (!g_clients[i])
+			continue;
+
+		if (g_clients[i]->presence)
+			queue_reply(g_clients[i], msg, len);
+
+		if (g_clients[i]->binary)
+			queue_member(g_clients[i], op == '+' ? FRAME_JOIN : FRAME_LEAVE, id, colour, name);
+	}
+}
+
+/*
+ * @brief Queues for the binary client C a FRAME_JOIN or FRAME_LEAVE.
+ *
+ * @param[in] c
+ * @param[in] type
+ * @param[in] id
+ * @param[in] colour Number of the colour.
+ * @param[in] name
+ */
+static void
+queue_member(Client_t *c, const char type, const unsigned int id, const int colour, const char *name)
+{
+	char payload[4 + 1 + NAME_SIZE];
+	size_t len = 4;
+
+	put_be(payload, id, 4);
+
+	if (type == FRAME_JOIN) {
+		put_be(payload + len++, colour, 1);
+		len += snprintf(payload + len, sizeof(payload) - len, "%s", name);
+	}
+
+	queue_frame(c, type, payload, len);
+}
+
+/*
+ * @brief Finds the number of COLOUR, as sent to binary clients.
+ *
+ * @param[in] colour
+ *
+ * @return Its position in G_COLOURS_USED.
+ */
+static int
+colour_index(const char *colour)
+{
+	for (int i = 0; i < TOTAL_COLOURS; ++i)
+		if (strcmp(g_colours_used[i].colour, colour) == 0)
+			return i;
+
+	return TOTAL_COLOURS - 1;
+}
+
+/*
+ * @brief Gives the name of the I-th member of the chatroom, counting the
+ * clients connected to us first and then the ones on other nodes.
+ *
+ * @param[in] i From 0 to MAX_MEMBERS.
+ *
+ * @return The name; NULL if the place is empty.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static const char *
+member_name(const int i)
+{
+	if (i < MAX_CLIENTS)
+		return g_clients[i] ? g_clients[i]->name : NULL;
+
+	return g_remote[i - MAX_CLIENTS].name[0] ? g_remote[i - MAX_CLIENTS].name : NULL;
+}
+
+/*
+ * @brief Runs a link another node opened to us.
+ *
+ * @param[in] arg File descriptor of the link.
+ */
+static void *
+handle_peer(void *arg)
+{
+	serve_peer((int) (intptr_t) arg);
+
+	return NULL;
+}
+
+/*
+ * @brief Keeps a link to the node at ADDR up for as long as we run. Each
+ * time it goes down, we try again a bit later than the last time.
+ *
+ * @param[in] arg "host:port", where host may be an IPv6 address between
+ * brackets.
+ */
+static void *
+dial_peer(void *arg)
+{
+	const char *addr = (const char *) arg;
+	const char *port = strrchr(addr, ':') + 1;
+	char host[NI_MAXHOST];
+	unsigned int delay = 1;
+
+	snprintf(host, sizeof(host), "%.*s", (int) (port - addr - 1), addr);
+
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		host[strlen(host) - 1] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	while (!g_quit) {
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+		struct addrinfo *res;
+		int fd = -1;
+
+		if (getaddrinfo(host, port, &hints, &res) == 0) {
+			for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+				fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+				if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+					close(fd);
+					fd = -1;
+				}
+			}
+
+			freeaddrinfo(res);
+		}
+
+		if (fd != -1) {
+			if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+				close(fd);
+			else
+				serve_peer(fd);
+
+			delay = 1;
+		}
+
+		sleep(delay);
+
+		if (delay < PEER_RETRY_MAX)
+			delay *= 2;
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Runs a link with another node until it goes down. Both ends
+ * start by telling their id; then frames flow both ways.
+ *
+ * Frames we get are handled right here. The ones we send are queued by
+ * whoever produces them, and written by a thread of their own: two nodes
+ * busy writing to each other never wait on one another.
+ *
+ * @param[in] fd Socket of the link, non-blocking. Closed when we are done.
+ */
+static void
+serve_peer(const int fd)
+{
+	char buff[BUFF_SIZE];
+	long node;
+	Client_t *peer;
+	pthread_t writer;
+	Timer_t handshake;
+
+	pin_connection(fd);
+	arm_handshake(&handshake, fd);
+
+	int len = snprintf(buff, sizeof(buff), NODE_CMD " %u\n", g_config.node);
+	int res = send_wait(fd, buff, len) == -1 || recv_line(fd, buff, sizeof(buff)) <= 0 ? -1 : 0;
+
+	stop_timer(&handshake);
+
+	if (res == -1 || strncmp(buff, NODE_CMD " ", strlen(NODE_CMD " ")) != 0
+	    || parse_long(buff + strlen(NODE_CMD " "), 1, UINT16_MAX, &node) == -1
+	    || node == g_config.node) {
+		close(fd);
+		return;
+	}
+
+	snprintf(buff, sizeof(buff), "node%ld", node);
+
+	if (!(peer = create_client(buff, 0, fd))) {
+		close(fd);
+		return;
+	}
+
+	peer->node = node;
+
+	if (add_peer(peer) == -1) {
+		fprintf(stderr, "Refused link to node %ld: linked already, or too many links.\n", node);
+		close(fd);
+		client_unref(peer);
+		return;
+	}
+
+	if (pthread_create(&writer, NULL, peer_writer, peer) != 0) {
+		remove_peer(peer);
+		close(fd);
+		client_unref(peer);
+		return;
+	}
+
+	printf("Linked to node %ld.\n", node);
+
+	start_heartbeat(peer);
+
+	Line_buffer_t lb = { .start = 0, .end = 0 };
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	Fed_frame_t frame;
+
+	while (1) {
+		if (poll_spin(&pfd, 1, -1, g_config.spin) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		ssize_t res = line_buffer_fill(&lb, fd);
+
+		if (res == 0 || (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			break;
+
+		char *line;
+
+		while ((line = line_buffer_next(&lb))) {
+			peer->last_seen = g_tick;
+
+			if (fed_parse(line, &frame) == -1 || fed_sanitize(&frame) == -1) {
+				fprintf(stderr, "Bad frame from node %ld.\n", node);
+				continue;
+			}
+
+			/* Heartbeats stay on this link. */
+			if (frame.type == FED_PING || frame.type == FED_PONG) {
+				if (frame.type == FED_PING) {
+					frame.type = FED_PONG;
+					frame.origin = g_config.node;
+					fed_send(peer, &frame);
+				}
+
+				continue;
+			}
+
+			pthread_mutex_lock(&client_mutex);
+			fed_receive(&frame, peer);
+			pthread_mutex_unlock(&client_mutex);
+		}
+	}
+
+	printf("Lost the link to node %ld%s.\n", node, peer->expired ? ": it stopped answering" : "");
+
+	stop_timer(&peer->timer);
+	remove_peer(peer);
+
+	/* Wakes the writer up, wherever it is waiting. */
+	shutdown(fd, SHUT_RDWR);
+	pthread_join(writer, NULL);
+
+	close(fd);
+	client_unref(peer);
+}
+
+/*
+ * @brief Writes the frames queued for PEER until its link is shut down.
+ *
+ * @param[in] arg Client_t of the link.
+ */
+static void *
+peer_writer(void *arg)
+{
+	Client_t *peer = (Client_t *) arg;
+	struct pollfd pfds[2] = {
+		{ .fd = peer->efd, .events = POLLIN },
+		{ .fd = peer->fd, .events = 0 } /* Only POLLHUP and POLLERR. */
+	};
+
+	while (1) {
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if (pfds[1].revents)
+			break;
+
+		if (pfds[0].revents & POLLIN)
+			send_replies(peer);
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Runs the timers, one tick every TICK_MS. Only the timers due on
+ * a tick are looked at, however many connections there are: each one has
+ * a single timer, and getting bytes from it doesn't touch the wheel.
+ *
+ * @param[in] arg Unused.
+ */
+static void *
+run_timers(void *arg)
+{
+	(void) arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!g_quit) {
+		next.tv_nsec += TICK_MS * 1000000L;
+
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			++next.tv_sec;
+		}
+
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+			continue;
+
+		pthread_mutex_lock(&wheel_mutex);
+		g_tick = clock_tick();
+		wheel_advance(&g_wheel, g_tick);
+		pthread_mutex_unlock(&wheel_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Reads the tick we are at from the monotonic clock.
+ *
+ * @return The tick.
+ */
+static uint64_t
+clock_tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+/*
+ * @brief Gives the connection FD HANDSHAKE_TIMEOUT seconds to get through
+ * the handshake. After that, it is shut down, which makes the handshake
+ * fail wherever it is waiting.
+ *
+ * @param[in out] t Has to be stopped before FD is closed.
+ * @param[in] fd
+ */
+static void
+arm_handshake(Timer_t *t, const int fd)
+{
+	timer_init(t, handshake_expired, (void *) (intptr_t) fd);
+
+	pthread_mutex_lock(&wheel_mutex);
+	timer_arm(&g_wheel, t, g_tick + TICKS(HANDSHAKE_TIMEOUT));
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * @brief Fires when a handshake took too long.
+ *
+ * @param[in] t
+ *
+ * @note WHEEL_MUTEX is held.
+ */
+static void
+handshake_expired(Timer_t *t)
+{
+	shutdown((int) (intptr_t) t->arg, SHUT_RDWR);
+}
+
+/*
+ * @brief Starts watching C, a client or a link, now that it is through
+ * the handshake.
+ *
+ * @param[in out] c
+ */
+static void
+start_heartbeat(Client_t *c)
+{
+	c->last_seen = g_tick;
+	c->last_message = g_tick;
+
+	if (!g_config.heartbeat && (!g_config.idle || c->node))
+		return;
+
+	pthread_mutex_lock(&wheel_mutex);
+	timer_arm(&g_wheel, &c->timer, g_tick);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * @brief Disarms T. Once we return, its callback is not running either,
+ * so whatever it refers to can go away.
+ *
+ * @param[in out] t
+ */
+static void
+stop_timer(Timer_t *t)
+{
+	pthread_mutex_lock(&wheel_mutex);
+	timer_cancel(t);
+	pthread_mutex_unlock(&wheel_mutex);
+}
+
+/*
+ * @brief Looks after a client or a link. After G_CONFIG.HEARTBEAT seconds
+ * without getting anything from it, we ping it; if it stays silent for as
+ * long again, it is gone and we hang up. Clients that don't say anything
+ * for G_CONFIG.IDLE seconds, pongs aside, are dropped too.
+ *
+ * Timers are not moved each time something arrives: the timer fires when
+ * it would be due if nothing had, and is armed again from whatever did.
+ *
+ * @param[in] t Timer of the client.
+ *
+ * @note WHEEL_MUTEX is held.
+ */
+static void
+heartbeat(Timer_t *t)
+{
+	Client_t *c = (Client_t *) t->arg;
+	uint64_t now = g_tick;
+	uint64_t seen = c->last_seen;
+	uint64_t beat = TICKS(g_config.heartbeat);
+	uint64_t idle = TICKS(g_config.idle);
+	uint64_t next = UINT64_MAX;
+
+	if (idle && !c->node) {
+		if (now - c->last_message >= idle) {
+			c->expired = EXPIRED_IDLE;
+			shutdown(c->fd, SHUT_RDWR);
+			return;
+		}
+
+		next = c->last_message + idle;
+	}
+
+	if (beat) {
+		if (now - seen >= 2 * beat) {
+			c->expired = EXPIRED_DEAD;
+			shutdown(c->fd, SHUT_RDWR);
+			return;
+		}
+
+		if (now - seen >= beat && c->pinged <= seen) {
+			if (c->node) {
+				Fed_frame_t frame = { .type = FED_PING, .origin = g_config.node, .seq = 0 };
+
+				strcpy(frame.name, "-");
+				fed_send(c, &frame);
+			} else {
+				queue_reply(c, PING_CMD "\n", strlen(PING_CMD "\n"));
+			}
+
+			c->pinged = now;
+		}
+
+		/* Next ping, or time to give up on the one sent. */
+		uint64_t due = now - seen >= beat ? seen + 2 * beat : seen + beat;
+
+		if (due < next)
+			next = due;
+	}
+
+	if (next != UINT64_MAX)
+		timer_arm(&g_wheel, t, next);
+}
+
+/*
+ * @brief Adds the link PEER, and tells the node at the other end about
+ * everyone we know of: the clients connected to us, and the users other
+ * nodes told us about, as they announced them.
+ *
+ * @param[in] peer
+ *
+ * @return 0 ok; -1 if we are linked to that node already, or there is no
+ * room for another link.
+ */
+static int
+add_peer(Client_t *peer)
+{
+	int slot = -1;
+	Fed_frame_t frame;
 
-	/* Find the client fd and send the message. */
 	pthread_mutex_lock(&client_mutex);
 
-	int found = 0;
-	char buff[BUFF_SIZE] = "Client not found.\n";
-	for (int i = 0; i < MAX_CLIENTS; ++i)
-		if (g_clients[i] && strcmp(g_clients[i]->name, name) == 0) {
-			snprintf(buff, sizeof(buff), "%s\x1B[3m%s\x1B%s: %s\n", /* Print name with italic style. */
-				 sender->colour,
-				 sender->name,
-				 RESET,
-				 contents);
+	for (int i = 0; i < MAX_PEERS; ++i) {
+		if (!g_peers[i]) {
+			if (slot == -1)
+				slot = i;
+		} else if (g_peers[i]->node == peer->node) {
+			slot = -1;
+			break;
+		}
+	}
+
+	if (slot != -1) {
+		g_peers[slot] = peer;
+
+		for (int i = 0; i < MAX_CLIENTS; ++i)
+			if (g_clients[i]) {
+				fed_frame(&frame, FED_JOIN, g_clients[i]->name);
+				fed_send(peer, &frame);
+			}
+
+		for (int i = 0; i < MAX_REMOTE_USERS; ++i)
+			if (g_remote[i].name[0]) {
+				frame.type = FED_JOIN;
+				frame.origin = g_remote[i].origin;
+				frame.seq = g_remote[i].seq;
+				strcpy(frame.name, g_remote[i].name);
+				fed_send(peer, &frame);
+			}
+	}
+
+	pthread_mutex_unlock(&client_mutex);
+
+	return slot == -1 ? -1 : 0;
+}
+
+/*
+ * @brief Removes the link PEER. The users we learnt about through it are
+ * gone for us as well, until some node tells us about them again.
+ *
+ * @param[in] peer
+ */
+static void
+remove_peer(Client_t *peer)
+{
+	pthread_mutex_lock(&client_mutex);
+
+	for (int i = 0; i < MAX_PEERS; ++i)
+		if (g_peers[i] == peer)
+			g_peers[i] = NULL;
+
+	for (int i = 0; i < MAX_REMOTE_USERS; ++i)
+		if (g_remote[i].name[0] && g_remote[i].via == peer) {
+			notify_presence('-', g_remote[i].name, g_remote[i].id, 0);
+			g_remote[i].name[0] = '\0';
+		}
+
+	pthread_mutex_unlock(&client_mutex);
+}
+
+/*
+ * @brief Fills FRAME as a new frame of ours, with the next sequence
+ * number. Whatever goes after the name is left empty.
+ *
+ * @param[in out] frame
+ * @param[in] type
+ * @param[in] name
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+fed_frame(Fed_frame_t *frame, const char type, const char *name)
+{
+	frame->type = type;
+	frame->origin = g_config.node;
+	frame->seq = ++g_fed_seq;
+	strcpy(frame->name, name);
+	frame->target[0] = '\0';
+	frame->text[0] = '\0';
+}
+
+/*
+ * @brief Queues FRAME to be written to the link PEER.
+ *
+ * @param[in] peer
+ * @param[in] frame
+ */
+static void
+fed_send(Client_t *peer, const Fed_frame_t *frame)
+{
+	char buff[2 * BUFF_SIZE];
+	int len = fed_format(buff, sizeof(buff), frame);
+
+	if (len != -1)
+		queue_reply(peer, buff, len);
+}
+
+/*
+ * @brief Passes FRAME on to every link but FROM, the one it came
+ * through. Nothing is sent when we run alone.
+ *
+ * @param[in] frame
+ * @param[in] from May be NULL.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+fed_relay(const Fed_frame_t *frame, const Client_t *from)
+{
+	for (int i = 0; i < MAX_PEERS; ++i)
+		if (g_peers[i] && g_peers[i] != from)
+			fed_send(g_peers[i], frame);
+}
+
+/*
+ * @brief Makes MSG safe for everybody's terminal with sanitize(), and cuts
+ * it to MSG_SIZE on a character boundary.
+ *
+ * @param[in out] msg
+ */
+static void
+sanitize_message(char *msg)
+{
+	size_t len = sanitize(msg, strlen(msg));
+
+	if (len > MSG_SIZE - 1) {
+		len = MSG_SIZE - 1;
+
+		while (len > 0 && ((unsigned char) msg[len] & 0xc0) == 0x80)
+			--len;
+
+		msg[len] = '\0';
+	}
+}
+
+/*
+ * @brief Does to FRAME what process_message() does to what clients send:
+ * other nodes may run anything, and their names and text end up on our
+ * clients' terminals all the same.
+ *
+ * @param[in out] frame
+ *
+ * @return 0 ok; -1 if nothing is left of its name, or of its message.
+ */
+static int
+fed_sanitize(Fed_frame_t *frame)
+{
+	sanitize(frame->name, strlen(frame->name));
+	sanitize(frame->target, strlen(frame->target));
+
+	if (frame->type == FED_MESSAGE || frame->type == FED_WHISPER)
+		sanitize_message(frame->text);
+	else
+		sanitize(frame->text, strlen(frame->text));
+
+	if (!frame->name[0])
+		return -1;
+
+	if (frame->type == FED_WHISPER && !frame->target[0])
+		return -1;
+
+	return (frame->type == FED_MESSAGE || frame->type == FED_WHISPER) && !frame->text[0] ? -1 : 0;
+}
+
+/*
+ * @brief Acts on a frame that came through the link PEER. Every frame is
+ * acted on once: our own ones coming back, and the ones that already got
+ * here through another link, are dropped. Public frames are passed on to
+ * the other links; whispers only go down the link towards their target.
+ *
+ * @param[in out] frame
+ * @param[in] peer
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+fed_receive(Fed_frame_t *frame, Client_t *peer)
+{
+	char buff[LINE_SIZE];
+	Remote_user_t *r;
+	Client_t *c;
+
+	if (frame->origin == g_config.node || fed_seen(&g_fed_seen, frame->origin, frame->seq) != 0)
+		return;
+
+	switch (frame->type) {
+	case FED_MESSAGE:
+		snprintf(buff, sizeof(buff), "%s%s%s: %s\n", REMOTE_COLOUR, frame->name, RESET, frame->text);
+		r = remote_find(frame->name);
+		deliver_line(buff, frame->name, NULL, r ? r->id : 0, frame->text);
+		break;
+	case FED_NOTICE:
+		snprintf(buff, sizeof(buff), "%s\n", frame->text);
+		deliver_line(buff, frame->name, NULL, 0, NULL);
+		break;
+	case FED_JOIN:
+		if (!(r = remote_find(frame->name))) {
+			for (int i = 0; i < MAX_REMOTE_USERS && !r; ++i)
+				if (!g_remote[i].name[0])
+					r = &g_remote[i];
+
+			if (!r) {
+				fprintf(stderr, "No room for %s, from node %u.\n", frame->name, frame->origin);
+				return;
+			}
+
+			strcpy(r->name, frame->name);
+			r->id = g_client_id++;
+			notify_presence('+', r->name, r->id, colour_index(REMOTE_COLOUR));
+		}
+
+		r->origin = frame->origin;
+		r->seq = frame->seq;
+		r->via = peer;
+		break;
+	case FED_LEAVE:
+		if ((r = remote_find(frame->name)) && r->origin == frame->origin) {
+			notify_presence('-', r->name, r->id, 0);
+			r->name[0] = '\0';
+		}
+		break;
+	case FED_WHISPER:
+		if ((c = client_find(frame->target))) {
+			snprintf(buff, sizeof(buff), "%s" ITALIC "%s" ITALIC_OFF "%s: %s\n",
+				 REMOTE_COLOUR, frame->name, RESET, frame->text);
+			client_send(c, buff, strlen(buff));
+			return;
+		}
+
+		if ((r = remote_find(frame->target)) && r->via != peer)
+			fed_send(r->via, frame);
+		return;
+	}
+
+	fed_relay(frame, peer);
+}
+
+/*
+ * @brief Looks for NAME among the users connected to other nodes.
+ *
+ * @param[in] name
+ *
+ * @return The user; NULL if there is none.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static Remote_user_t *
+remote_find(const char *name)
+{
+	for (int i = 0; i < MAX_REMOTE_USERS; ++i)
+		if (g_remote[i].name[0] && strcmp(g_remote[i].name, name) == 0)
+			return &g_remote[i];
+
+	return NULL;
+}
+
+/*
+ * @brief FNV-1a hash of NAME.
+ *
+ * @param[in] name
+ *
+ * @return The hash.
+ */
+static uint32_t
+name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *name; ++name)
+		h = (h ^ (unsigned char) *name) * 16777619u;
+
+	return h;
+}
+
+/*
+ * @brief Looks NAME up among the clients connected to us.
+ *
+ * @param[in] name
+ *
+ * @return The client; NULL if there is none.
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static Client_t *
+client_find(const char *name)
+{
+	for (size_t i = name_hash(name) & (NAME_SLOTS - 1);; i = (i + 1) & (NAME_SLOTS - 1)) {
+		if (!g_names[i])
+			return NULL;
+
+		if (strcmp(g_names[i]->name, name) == 0)
+			return g_names[i];
+	}
+}
+
+/*
+ * @brief Indexes C by its name, which no other client has. There is
+ * always room: the table has twice as many slots as there are clients.
+ *
+ * @param[in] c
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+name_add(Client_t *c)
+{
+	size_t i = name_hash(c->name) & (NAME_SLOTS - 1);
+
+	while (g_names[i])
+		i = (i + 1) & (NAME_SLOTS - 1);
+
+	g_names[i] = c;
+}
+
+/*
+ * @brief Drops C from the index. The clients after it in its run are
+ * moved back, so lookups never stop early.
+ *
+ * @param[in] c
+ *
+ * @note CLIENT_MUTEX has to be held.
+ */
+static void
+name_remove(const Client_t *c)
+{
+	const size_t mask = NAME_SLOTS - 1;
+	size_t hole = name_hash(c->name) & mask;
+
+	while (g_names[hole] != c) {
+		if (!g_names[hole])
+			return;
+
+		hole = (hole + 1) & mask;
+	}
+
+	for (size_t i = (hole + 1) & mask; g_names[i]; i = (i + 1) & mask) {
+		size_t home = name_hash(g_names[i]->name) & mask;
+
+		/* It can fill the hole if its home is not between the hole and it. */
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			g_names[hole] = g_names[i];
+			hole = i;
+		}
+	}
+
+	g_names[hole] = NULL;
+}
+
+/*
+ * @brief Append MSG to the log file.
+ *
+ * @param[in] MSG to be appended.
+ * @param[in] SENDER of the message.
+ * @param[in] MS source of the message (server/client).
+ *
+ * @note The file has to be opened already.
+ */
+static void
+log_message(const char *msg, Client_t *sender, const Message_source ms)
+{
+	uint64_t start = trace_enter();
+	time_t t;
+	time(&t);
+	struct tm *date = gmtime(&t);
+	char datestr[50];
+	snprintf(datestr, sizeof(datestr), "[%d-%d-%d %d:%d:%d]",
+		 date->tm_year + 1900,
+		 date->tm_mon + 1,
+		 date->tm_mday,
+		 date->tm_hour,
+		 date->tm_min,
+		 date->tm_sec);
+
+	char line[LINE_SIZE + sizeof(datestr)];
+	int len;
+
+	if (ms == SRC_SERVER)
+		len = snprintf(line, sizeof(line), "%s %s\n", datestr, msg);
+	else
+		len = snprintf(line, sizeof(line), "%s %s: %s\n", datestr, sender->name, msg);
+
+	logfile_write(&g_log, t, line, (size_t) len < sizeof(line) ? (size_t) len : sizeof(line) - 1);
+	trace_leave(TRACE_LOG, start);
+}
+
+/*
+ * @brief Sets G_QUIT to 1 and thus the program terminates if someone
+ * presses Ctrl+C.
+ *
+ * @param[in] signo Signal number.
+ */
+static void
+sig_quit_program(int signo)
+{
+	g_quit = 1;
+	printf("Catched signal %d\n.", signo);
+}
+
+/*
+ * @brief Sets G_RELOAD to 1, so the filter gets read again on SIGHUP.
+ *
+ * @param[in] signo Signal number.
+ */
+static void
+sig_reload_filter(int signo)
+{
+	(void) signo;
+	g_reload = 1;
+}
+
+/*
+ * @brief Sets G_DUMP_TRACE to 1, so the spans traced so far get written
+ * out, if someone sends SIGUSR1.
+ *
+ * @param[in] signo Signal number.
+ */
+static void
+sig_dump_trace(int signo)
+{
+	(void) signo;
+	g_dump_trace = 1;
+}
+
+/*
+ * @brief SIGINT and SIGTERM stop the server, SIGHUP reloads the filter
+ * and SIGUSR1 dumps the trace. SIGPIPE is ignored: a client or a node
+ * going away in the middle of a write must only fail that write.
+ *
+ * These four are blocked from here on, in every thread we start too, and
+ * only let through while the accept loop waits. That way they always
+ * interrupt the wait, instead of landing on some other thread.
+ *
+ * @return 0 ok; -1 error.
+ */
+static int
+setup_signals(void)
+{
+	struct sigaction sact;
+	sigset_t mask;
+
+	sigemptyset(&sact.sa_mask);
+	sact.sa_flags = 0;
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		return -1;
+
+	sact.sa_handler = sig_quit_program;
+
+	if (sigaction(SIGINT, &sact, NULL) == -1 || sigaction(SIGTERM, &sact, NULL) == -1)
+		return -1;
 
-			if (send(g_clients[i]->fd, buff, strlen(buff), 0) == -1)
-				perror("Error sending whisper: ");
+	sact.sa_handler = sig_reload_filter;
 
-			found = 1;
-			break;
-		}
+	if (sigaction(SIGHUP, &sact, NULL) == -1)
+		return -1;
 
-	if (!found)
-		if (send(sender->fd, buff, strlen(buff), 0) == -1)
-			perror("Error sending whisper, client not found: ");
+	sact.sa_handler = sig_dump_trace;
+
+	if (sigaction(SIGUSR1, &sact, NULL) == -1)
+		return -1;
 
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
 
-	pthread_mutex_unlock(&client_mutex);
+	return pthread_sigmask(SIG_BLOCK, &mask, &g_wait_mask) == 0 ? 0 : -1;
 }
 
 /*
- * @brief Sends a message with the client list to CLIENT.
+ * @brief Reads the command line options into G_CONFIG.
  *
- * @param[in] client Message receiver.
+ * @param[in] argc
+ * @param[in] argv
+ *
+ * @return 0 ok; -1 if an option is unknown or has an invalid value.
  */
-static void
-send_client_list(Client_t *client)
+static int
+parse_options(int argc, char *argv[])
 {
-	char msg[BUFF_SIZE] = "\n";
+	int opt;
+	long n;
 
-	for (int i = 0; i < MAX_CLIENTS && strlen(msg) < MSG_SIZE; ++i)
-		if (g_clients[i]) {
-			strcat(msg, g_clients[i]->name);
-			strcat(msg, "\n");
+	while ((opt = getopt(argc, argv, "a:b:c:d:e:f:g:i:k:l:m:n:o:p:r:s:t:u:v:w:y:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			g_config.snapshot_path = optarg;
+			break;
+		case 'b':
+			if (parse_long(optarg, 1, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.backlog = n;
+			break;
+		case 'c':
+			if (parse_cpus(optarg) == -1)
+				return -1;
+			break;
+		case 'd':
+			if (parse_long(optarg, 0, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.defer_accept = n;
+			break;
+		case 'f':
+			if (parse_long(optarg, 1, UINT16_MAX, &n) == -1)
+				return -1;
+			g_config.peer_port = n;
+			break;
+		case 'e':
+			if (parse_long(optarg, 1, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.log_age = n;
+			break;
+		case 'g':
+			if (parse_long(optarg, 1, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.log_size = (off_t) n * 1024 * 1024;
+			break;
+		case 'i':
+			if (parse_long(optarg, 0, INT32_MAX / 1000, &n) == -1)
+				return -1;
+			g_config.idle = n;
+			break;
+		case 'm':
+			if (parse_long(optarg, 0, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.mem_budget = (size_t) n * 1024 * 1024;
+			break;
+		case 'k':
+			if (parse_long(optarg, 0, INT32_MAX / 1000, &n) == -1)
+				return -1;
+			g_config.heartbeat = n;
+			break;
+		case 'l':
+			if (g_config.npeers == MAX_PEERS || !strrchr(optarg, ':')
+			    || strrchr(optarg, ':') - optarg >= NI_MAXHOST)
+				return -1;
+			g_config.peers[g_config.npeers++] = optarg;
+			break;
+		case 'n':
+			if (parse_long(optarg, 1, UINT16_MAX, &n) == -1)
+				return -1;
+			g_config.node = n;
+			break;
+		case 'o':
+			g_config.capture_path = optarg;
+			break;
+		case 'p':
+			if (parse_long(optarg, 1, UINT16_MAX, &n) == -1)
+				return -1;
+			g_config.port = n;
+			break;
+		case 'r':
+			if (parse_long(optarg, 0, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.trace_every = n;
+			break;
+		case 's':
+			if (parse_long(optarg, 0, 1000000, &n) == -1)
+				return -1;
+			g_config.spin = n;
+			break;
+		case 't':
+			g_config.filter_path = optarg;
+			break;
+		case 'u':
+			if (strlen(optarg) >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+				return -1;
+			g_config.socket_path = optarg;
+			break;
+		case 'v':
+			if (parse_long(optarg, 1, UINT16_MAX, &n) == -1)
+				return -1;
+			g_config.observer_port = n;
+			break;
+		case 'w':
+			if (parse_long(optarg, 1, 1024, &n) == -1)
+				return -1;
+			g_config.workers = n;
+			break;
+		case 'y':
+			if (parse_long(optarg, 0, INT32_MAX, &n) == -1)
+				return -1;
+			g_config.busy_poll = n;
+			break;
+		default:
+			return -1;
 		}
+	}
+
+	/* Links need to know who is who. */
+	if ((g_config.peer_port || g_config.npeers) && !g_config.node)
+		return -1;
 
-	if (send(client->fd, msg, strlen(msg), 0) == -1)
-		perror("Error sending list of clients: ");
+	return optind == argc ? 0 : -1;
 }
 
 /*
- * @brief Append MSG to the log file.
+ * @brief Reads a list of CPUs like "2,4-7" into the configuration.
  *
- * @param[in] MSG to be appended.
- * @param[in] SENDER of the message.
- * @param[in] MS source of the message (server/client).
+ * @param[in] list
  *
- * @note The file has to be opened already.
+ * @return 0 ok; -1 if it is not a valid list, or it is too long.
  */
-static void
-log_message(const char *msg, Client_t *sender, const Message_source ms)
+static int
+parse_cpus(const char *list)
 {
-	time_t t;
-	time(&t);
-	struct tm *date = gmtime(&t);
-	char datestr[50];
-	snprintf(datestr, sizeof(datestr), "[%d-%d-%d %d:%d:%d]",
-		 date->tm_year + 1900,
-		 date->tm_mon + 1,
-		 date->tm_mday,
-		 date->tm_hour,
-		 date->tm_min,
-		 date->tm_sec);
+	char buff[BUFF_SIZE];
+	char *saveptr = NULL;
+	long first;
+	long last;
 
-	if (ms == SRC_SERVER)
-		(void)fprintf(g_log_file, "%s %s\n", datestr, msg);
-	else
-		(void)fprintf(g_log_file, "%s %s: %s\n", datestr, sender->name, msg);
+	if (strlen(list) >= sizeof(buff))
+		return -1;
 
-	fflush(g_log_file);
-}
+	strcpy(buff, list);
+	g_config.ncpus = 0;
 
-/*
- * @brief Sets G_QUIT to 1 and thus the program terminates if someone
- * presses Ctrl+C.
- *
- * @param[in] signo Signal number.
- */
-static void
-sig_quit_program(int signo)
-{
-	g_quit = 1;
-	printf("Catched signal %d\n.", signo);
+	for (char *p = strtok_r(buff, ",", &saveptr); p; p = strtok_r(NULL, ",", &saveptr)) {
+		char *dash = strchr(p, '-');
+
+		if (dash)
+			*dash = '\0';
+
+		if (parse_long(p, 0, CPU_SETSIZE - 1, &first) == -1)
+			return -1;
+
+		if (!dash)
+			last = first;
+		else if (parse_long(dash + 1, first, CPU_SETSIZE - 1, &last) == -1)
+			return -1;
+
+		for (long cpu = first; cpu <= last; ++cpu) {
+			if (g_config.ncpus == MAX_CPUS)
+				return -1;
+
+			g_config.cpus[g_config.ncpus++] = cpu;
+		}
+	}
+
+	return g_config.ncpus ? 0 : -1;
 }
 
 /*
- * @brief We're only handling the SIGINT signal at the moment.
+ * @brief Prints the command line options.
  *
- * @return 0 ok; -1 error.
+ * @param[in] prog Name of the program.
  */
-static int
-setup_signals(void)
+static void
+print_usage(const char *prog)
 {
-	struct sigaction sact;
-	sact.sa_handler = sig_quit_program;
-	sigemptyset(&sact.sa_mask);
-	sact.sa_flags = 0;
-
-	return sigaction(SIGINT, &sact, NULL);
+	fprintf(stderr, "Usage: %s [-p port] [-b backlog] [-d seconds] [-t path] [-u path] [-w workers]\n"
+	                "       [-k seconds] [-i seconds] [-c cpus] [-y usec] [-s usec] [-r n] [-o path]\n"
+	                "       [-a path] [-g mb] [-e seconds] [-m mb] [-v port]\n"
+	                "       [-n node [-f port] [-l host:port ...]]\n", prog);
+	fprintf(stderr, "  -p port     Port clients connect to (default %d).\n", PORTNO);
+	fprintf(stderr, "  -b backlog  Length of the accept queue (default %d).\n", LISTEN_BACKLOG);
+	fprintf(stderr, "  -d seconds  Enable TCP_DEFER_ACCEPT: only wake up the server once\n"
+	                "              the client has sent data, or SECONDS have passed.\n");
+	fprintf(stderr, "  -n node     Our id, from 1 to 65535, when federated with other servers.\n");
+	fprintf(stderr, "  -f port     Take links from other nodes on PORT.\n");
+	fprintf(stderr, "  -l host:port\n"
+	                "              Link to the node taking links at HOST:PORT. Up to %d times.\n", MAX_PEERS);
+	fprintf(stderr, "  -t path     Filter public messages with the terms in PATH, one per line after\n"
+	                "              its action: mask, drop or flag. SIGHUP reads them again.\n");
+	fprintf(stderr, "  -u path     Also listen on a unix domain socket, for clients on this host.\n");
+	fprintf(stderr, "  -v port     Take read-only observers on PORT, up to %d.\n", MAX_OBSERVERS);
+	fprintf(stderr, "  -w workers  Threads running heavy commands (default: one per CPU).\n");
+	fprintf(stderr, "  -k seconds  Ping clients and links silent for SECONDS, and hang up on\n"
+	                "              them after as long again (default %d; 0 never pings).\n", HEARTBEAT);
+	fprintf(stderr, "  -i seconds  Drop clients that don't say anything for SECONDS\n"
+	                "              (default: never).\n");
+	fprintf(stderr, "  -c cpus     Low latency: pin threads to the CPUs in the list, e.g. 2,4-7,\n"
+	                "              and have the kernel process each connection on its CPU.\n");
+	fprintf(stderr, "  -y usec     Busy poll the device for up to USEC waiting on a socket.\n");
+	fprintf(stderr, "  -s usec     Keep polling for up to USEC before a thread goes to sleep.\n");
+	fprintf(stderr, "  -r n        Trace one message in N through its stages. SIGUSR1 writes\n"
+	                "              the spans to " TRACE_FILE_NAME ", for Perfetto.\n");
+	fprintf(stderr, "  -o path     Capture every line clients send to PATH, for build/replay.\n");
+	fprintf(stderr, "  -a path     Keep sessions and recent messages in PATH across restarts.\n");
+	fprintf(stderr, "  -g mb       Rotate the log into " LOG_ARCHIVE_DIR "/ once it takes MB megabytes.\n");
+	fprintf(stderr, "  -e seconds  Rotate the log once it has been written to for SECONDS.\n");
+	fprintf(stderr, "  -m mb       Megabytes connections may hold, replies waiting included\n"
+	                "              (default %d; 0 no limit).\n", MEM_BUDGET);
 }
 
 /*
  * @brief Prepares the server to listen for client connections by
  * creating the socket, binding, etc.
  *
+ * The socket is non-blocking: connections get accepted in batches once
+ * poll(2) says there is something waiting. The kernel caps the backlog to
+ * net.core.somaxconn, so raise that as well if you need a bigger queue.
+ *
  * @param[in out] sa6 Server address IPv6.
  * @param[in] sa6_size sizeof(sa6)
+ * @param[in] port
  * @param[in out] fd Server's file descriptor.
  *
  * @return 0 ok; -1 otherwise.
  */
 static int
-prepare_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *fd)
+prepare_server(struct sockaddr_in6 *sa6, size_t sa6_size, const int port, int *fd)
 {
-	if ((*fd = socket(AF_INET6, SOCK_STREAM, 0)) == -1)
+	if ((*fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
 		return -1;
 
 	memset(sa6, 0, sa6_size);
 	sa6->sin6_family = AF_INET6;
-	sa6->sin6_port = htons(PORTNO);
+	sa6->sin6_port = htons(port);
 	sa6->sin6_addr = in6addr_any;
 
+	/* Clients reconnect as soon as we are back: don't wait for TIME_WAIT. */
+	int on = 1;
+
+	if (setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+		return -1;
+
 	if ((bind(*fd, (struct sockaddr*) sa6, sa6_size)) == -1)
 		return -1;
 
-	if ((listen(*fd, MAX_CLIENTS)) == -1)
+	if (g_config.defer_accept > 0)
+		if (setsockopt(*fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g_config.defer_accept,
+			       sizeof(g_config.defer_accept)) == -1)
+			return -1;
+
+	if ((listen(*fd, g_config.backlog)) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * @brief Same as prepare_server(), but for a unix domain socket at PATH.
+ * Local bots and bridges use it to skip the TCP stack altogether.
+ *
+ * A socket left behind by a previous run is removed first; anything else
+ * found at PATH is left alone and makes us fail.
+ *
+ * @param[in] path Where to create the socket.
+ * @param[in out] fd Server's file descriptor.
+ *
+ * @return 0 ok; -1 otherwise.
+ */
+static int
+prepare_unix_server(const char *path, int *fd)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+
+	if ((*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((bind(*fd, (struct sockaddr*) &sun, sizeof(sun))) == -1)
+		return -1;
+
+	if ((listen(*fd, g_config.backlog)) == -1)
 		return -1;
 
 	return 0;
@@ -535,7 +4316,8 @@ prepare_server(struct sockaddr_in6 *sa6, size_t sa6_size, int *fd)
  * @brief Check if the server is full. If it is, send an ERR_STATUS to the
  * client and close its fd.
  *
- * If it's not, send OK_STATUS to the client.
+ * If it's not, reserve a place for the client and send OK_STATUS to it.
+ * The place has to be given back if the handshake fails afterwards.
  *
  * @param[in] fd Client's file descriptor.
  *
@@ -547,8 +4329,9 @@ process_new_connection(const int cfd)
 	char buff[BUFF_SIZE];
 	New_connection_status_codes_wrapper ncscw;
 
-	if ((g_clients_connected + 1) > MAX_CLIENTS) {
-		strcpy(buff, ERR_STATUS);
+	if (++g_clients_connected > MAX_CLIENTS) {
+		--g_clients_connected;
+		strcpy(buff, ERR_STATUS "\n");
 
 		if ((send(cfd, buff, strlen(buff), 0)) == -1) {
 			ncscw.nconn_err = NEW_CONN_SYSTEM_ERR;
@@ -561,9 +4344,28 @@ process_new_connection(const int cfd)
 		}
 	}
 
-	strcpy(buff, OK_STATUS);
+	/* Whoever is in already comes first: they'd be the ones running short. */
+	if (mem_pressure() == MEM_FULL) {
+		--g_clients_connected;
+		snprintf(buff, sizeof(buff), ERR_STATUS " " RETRY_STATUS " %d\n", RETRY_AFTER);
+
+		if ((send(cfd, buff, strlen(buff), 0)) == -1) {
+			ncscw.nconn_err = NEW_CONN_SYSTEM_ERR;
+			ncscw.system_err = errno;
+		} else {
+			ncscw.nconn_err = NEW_CONN_SV_BUSY_ERR;
+			ncscw.system_err = 0;
+		}
+
+		return ncscw;
+	}
+
+	g_mem += CONN_MEM;
+	strcpy(buff, OK_STATUS "\n");
 
 	if ((send(cfd, buff, strlen(buff), 0)) == -1) {
+		--g_clients_connected;
+		g_mem -= CONN_MEM;
 		ncscw.nconn_err = NEW_CONN_SYSTEM_ERR;
 		ncscw.system_err = errno;
 		return ncscw;
@@ -576,33 +4378,89 @@ process_new_connection(const int cfd)
 }
 
 /*
- * @brief Get client's name. If it exists already in the server, then send a
- * message to the client saying that the server is full.
- * If it doesn't exist, send an OK status to the client.
+ * @brief Get client's name. If it exists already in the server, then send an
+ * ERR_STATUS to the client.
+ * If it doesn't exist, add the client to the chatroom and send an OK status
+ * to the client.
+ *
+ * The name may be followed by the options the client wants. A client
+ * connected through the unix socket may ask for SHM_OPT: it then gets the
+ * shared memory of its link right after the OK status. A client resuming
+ * its session sends RESUME_CMD and its token instead of the name.
  *
  * @param[in] cfd Client's file descriptor.
  * @param[in out] name Name of the client to be fetched.
  * @param[in] size sizeof(name).
+ * @param[in out] c Client created, if any. Whoever calls us owns it.
  *
  * @return A struct containing the corresponding status.
  */
 static Client_name_status_codes_wrapper
-process_client_name(const int cfd, char *name, const size_t size)
+process_client_name(const int cfd, char *name, const size_t size, Client_t **c)
 {
 	Client_name_status_codes_wrapper cnscw;
+	Client_options_t opts;
+	char buff[BUFF_SIZE];
+	int link_fds[SHM_LINK_FDS];
+
+	*c = NULL;
 
-	memset(name, '\0', size);
+	ssize_t res = recv_line(cfd, buff, sizeof(buff));
 
-	if (recv(cfd, name, size, 0) == -1) {
+	if (res <= 0) {
 		cnscw.cname_err = CL_NAME_SYSTEM_ERR;
-		cnscw.system_err = errno;
+		cnscw.system_err = res == 0 ? ECONNRESET : errno;
 		return cnscw;
 	}
 
+	capture(CAPTURE_LINE, buff, res);
+
+	Client_t *client = NULL;
+
+	/* Names end up on everybody's terminal. */
+	sanitize(buff, res);
+
+	if (parse_hello(buff, name, size, &opts) == 0 && (!opts.resume || session_name(opts.token, name) == 0)) {
+		if (!(client = create_client(name, g_client_id++, cfd))
+		    || (opts.shm && !(client->shm = create_shm_link(cfd, link_fds)))) {
+			cnscw.cname_err = CL_NAME_SYSTEM_ERR;
+			cnscw.system_err = errno;
+
+			if (client)
+				client_unref(client);
+
+			return cnscw;
+		}
+	}
+
+	if (client) {
+		client->seq = opts.seq;
+		client->binary = opts.binary;
+
+		/* Nothing to gain through shared memory. */
+		if (opts.deflate && !client->shm) {
+			if (!(client->z = deflater_new())) {
+				cnscw.cname_err = CL_NAME_SYSTEM_ERR;
+				cnscw.system_err = errno;
+				client_unref(client);
+				return cnscw;
+			}
+
+			client->deflate = 1;
+		}
+	}
+
 	/* If the client name exists, send an ERR_STATUS message to the client. */
-	char buff[BUFF_SIZE];
-	if (client_exists(name)) {
-		strcpy(buff, ERR_STATUS);
+	if (!client || add_client(client, &opts) == -1) {
+		if (client) {
+			if (client->shm)
+				for (int i = 0; i < SHM_LINK_FDS; ++i)
+					close(link_fds[i]);
+
+			client_unref(client);
+		}
+
+		strcpy(buff, ERR_STATUS "\n");
 
 		if ((send(cfd, buff, strlen(buff), 0)) == -1) {
 			cnscw.cname_err = CL_NAME_SYSTEM_ERR;
@@ -615,10 +4473,20 @@ process_client_name(const int cfd, char *name, const size_t size)
 		return cnscw;
 	}
 
-	/* Send OK status to client. */
-	strcpy(buff, OK_STATUS);
+	*c = client;
 
-	if ((send(cfd, buff, strlen(buff), 0)) == -1) {
+	/* Send OK status to client, and whether what follows is compressed. */
+	strcpy(buff, client->deflate ? OK_STATUS " " DEFLATE_OPT "\n" : OK_STATUS "\n");
+	res = send(cfd, buff, strlen(buff), 0);
+
+	if (res != -1 && client->shm) {
+		res = shm_send_fds(cfd, link_fds, SHM_LINK_FDS);
+
+		for (int i = 0; i < SHM_LINK_FDS; ++i)
+			close(link_fds[i]);
+	}
+
+	if (res == -1) {
 		cnscw.cname_err = CL_NAME_SYSTEM_ERR;
 		cnscw.system_err = errno;
 		return cnscw;
@@ -630,9 +4498,251 @@ process_client_name(const int cfd, char *name, const size_t size)
 	return cnscw;
 }
 
+/*
+ * @brief Splits the line a client sends when joining into its name and
+ * the options that follow it. A client resuming its session sends
+ * RESUME_CMD, its token and the last message it saw instead of its name;
+ * NAME is left empty then.
+ *
+ * @param[in out] line "name opt1 opt2 ..." or
+ * "RESUME_CMD token last_seq opt1 opt2 ...". Gets modified.
+ * @param[in out] name
+ * @param[in] size sizeof(name)
+ * @param[in out] opts Options found. Unknown ones are ignored.
+ *
+ * @return 0 ok; -1 if there is no name or it is too long, or the token
+ * is wrong.
+ */
+static int
+parse_hello(char *line, char *name, const size_t size, Client_options_t *opts)
+{
+	char *saveptr = NULL;
+	char *tok = strtok_r(line, " ", &saveptr);
+	long last_seq;
+
+	memset(opts, 0, sizeof(*opts));
+
+	if (!tok || strlen(tok) > size - 1)
+		return -1;
+
+	if (strcmp(tok, RESUME_CMD) == 0) {
+		char *token = strtok_r(NULL, " ", &saveptr);
+		char *seq = strtok_r(NULL, " ", &saveptr);
+
+		if (!token || strlen(token) != SESSION_TOKEN_SIZE - 1
+		    || !seq || parse_long(seq, 0, LONG_MAX, &last_seq) == -1)
+			return -1;
+
+		strcpy(opts->token, token);
+		opts->last_seq = last_seq;
+		opts->resume = 1;
+		opts->seq = 1;
+		name[0] = '\0';
+	} else {
+		strcpy(name, tok);
+	}
+
+	while ((tok = strtok_r(NULL, " ", &saveptr)))
+		if (strcmp(tok, SHM_OPT) == 0)
+			opts->shm = 1;
+		else if (strcmp(tok, RESUME_OPT) == 0)
+			opts->seq = 1;
+		else if (strcmp(tok, BINARY_OPT) == 0)
+			opts->binary = 1;
+		else if (strcmp(tok, DEFLATE_OPT) == 0)
+			opts->deflate = 1;
+
+	return 0;
+}
+
+/*
+ * @brief Finds out the name of the client that had the session TOKEN.
+ *
+ * @param[in] token
+ * @param[in out] name
+ *
+ * @return 0 ok; -1 if there is no such session, or it is in use.
+ */
+static int
+session_name(const char *token, char *name)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&client_mutex);
+
+	Session_t *session = find_session(token);
+
+	if (session && session->expires != 0) {
+		strcpy(name, session->name);
+		res = 0;
+	}
+
+	pthread_mutex_unlock(&client_mutex);
+
+	return res;
+}
+
+/*
+ * @brief Picks up where the last server left off, from the snapshot in
+ * G_CONFIG.SNAPSHOT_PATH. It is mapped and copied as it is, so starting
+ * takes as long as reading a few hundred kilobytes, however long the log
+ * is. Nothing is restored if there is no snapshot, or it is broken or
+ * from a build with another layout.
+ *
+ * @note Only called before any other thread starts.
+ */
+static void
+restore_snapshot(void)
+{
+	const Server_state_t *state = snapshot_map(g_config.snapshot_path, SNAPSHOT_VERSION,
+						   sizeof(Server_state_t));
+
+	if (!state) {
+		if (errno != ENOENT)
+			perror("Error reading the snapshot, starting afresh: ");
+
+		return;
+	}
+
+	time_t now = time(NULL);
+	int sessions = 0;
+
+	g_seq = state->seq;
+	g_presence_version = state->presence_version;
+	g_client_id = state->client_id;
+	memcpy(g_sessions, state->sessions, sizeof(g_sessions));
+	memcpy(g_history, state->history, sizeof(g_history));
+	memcpy(g_mentions, state->mentions, sizeof(g_mentions));
+	g_mentions_next = state->mentions_next;
+	memcpy(g_departed, state->departed, sizeof(g_departed));
+	g_departed_next = state->departed_next;
+	snapshot_unmap(state, sizeof(Server_state_t));
+
+	/* Their clients went away with the old server, and can come back. */
+	for (int i = 0; i < MAX_SESSIONS; ++i)
+		if (g_sessions[i].token[0] && (g_sessions[i].expires == 0 || g_sessions[i].expires >= now)) {
+			if (g_sessions[i].expires == 0)
+				g_sessions[i].expires = now + SESSION_TTL;
+
+			++sessions;
+		}
+
+	printf("Restored %d sessions and %lu messages from the snapshot.\n", sessions,
+	       g_seq < HISTORY_SIZE ? g_seq : HISTORY_SIZE);
+}
+
+/*
+ * @brief Writes the state to the snapshot in G_CONFIG.SNAPSHOT_PATH.
+ * CLIENT_MUTEX is only held to copy it; the write happens after.
+ */
+static void
+save_snapshot(void)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	pthread_mutex_lock(&client_mutex);
+
+	g_snapshot.seq = g_seq;
+	g_snapshot.presence_version = g_presence_version;
+	g_snapshot.client_id = g_client_id;
+	memcpy(g_snapshot.sessions, g_sessions, sizeof(g_sessions));
+	memcpy(g_snapshot.history, g_history, sizeof(g_history));
+	memcpy(g_snapshot.mentions, g_mentions, sizeof(g_mentions));
+	g_snapshot.mentions_next = g_mentions_next;
+	memcpy(g_snapshot.departed, g_departed, sizeof(g_departed));
+	g_snapshot.departed_next = g_departed_next;
+
+	pthread_mutex_unlock(&client_mutex);
+
+	if (snapshot_write(g_config.snapshot_path, SNAPSHOT_VERSION, &g_snapshot, sizeof(g_snapshot)) == -1)
+		perror("Error writing the snapshot: ");
+
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+ * @brief Writes a snapshot every SNAPSHOT_INTERVAL seconds, so not much
+ * is lost if the server dies without a chance to write one on its way
+ * out.
+ *
+ * @param[in] arg Unused.
+ */
+static void *
+run_snapshots(void *arg)
+{
+	(void) arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!g_quit) {
+		next.tv_sec += SNAPSHOT_INTERVAL;
+
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0 || g_quit)
+			continue;
+
+		save_snapshot();
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Creates the shared memory link for a client connected through
+ * the unix socket CFD. Clients connected over TCP can't have one.
+ *
+ * @param[in] cfd Client's file descriptor.
+ * @param[in out] fds What has to be sent to the client.
+ *
+ * @return The link; NULL on error.
+ */
+static Shm_link_t *
+create_shm_link(const int cfd, int *fds)
+{
+	int domain;
+	socklen_t len = sizeof(domain);
+
+	if (getsockopt(cfd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == -1)
+		return NULL;
+
+	if (domain != AF_UNIX) {
+		errno = EPROTONOSUPPORT;
+		return NULL;
+	}
+
+	Shm_link_t *link = malloc(sizeof(Shm_link_t));
+
+	if (!link)
+		return NULL;
+
+	if (shm_link_create(link, fds) == -1) {
+		free(link);
+		return NULL;
+	}
+
+	return link;
+}
+
 static void
-cleanup(int fd, FILE *file)
+cleanup(int fd, int ufd, int pfd, int ofd)
 {
+	pool_destroy(&g_pool);
 	close(fd);
-	fclose(file);
+
+	if (pfd != -1)
+		close(pfd);
+
+	if (ofd != -1) {
+		close(ofd);
+		observers_stop(&g_observers);
+	}
+
+	if (ufd != -1) {
+		close(ufd);
+		unlink(g_config.socket_path);
+	}
+
+	logfile_close(&g_log);
+
+	if (g_capture && capture_close(g_capture) == -1)
+		perror("Error writing the capture: ");
 }
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "shmring.h"
+
+static void ring_copy_in(Shm_ring_t *, uint32_t, const void *, const size_t);
+static void ring_copy_out(const Shm_ring_t *, uint32_t, void *, const size_t);
+static void close_link_fds(int[SHM_LINK_FDS]);
+
+/*
+ * @brief Creates the shared memory and the eventfds of a new link, and maps
+ * it as the server end. FDS gets what has to be handed to the peer.
+ *
+ * @param[in out] link
+ * @param[in out] fds memfd, eventfd the peer waits on, eventfd we wait on.
+ * Whoever calls us closes them once they have been sent.
+ *
+ * @return 0 ok; -1 error.
+ */
+int
+shm_link_create(Shm_link_t *link, int fds[SHM_LINK_FDS])
+{
+	fds[0] = memfd_create("chat-link", MFD_CLOEXEC);
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1
+	    || ftruncate(fds[0], sizeof(Shm_area_t)) == -1) {
+		close_link_fds(fds);
+		return -1;
+	}
+
+	void *p = mmap(NULL, sizeof(Shm_area_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+	if (p == MAP_FAILED) {
+		close_link_fds(fds);
+		return -1;
+	}
+
+	link->area = p;
+	link->out = &link->area->rings[0];
+	link->in = &link->area->rings[1];
+	link->efd_out = dup(fds[1]);
+	link->efd_in = dup(fds[2]);
+	pthread_mutex_init(&link->mutex, NULL);
+
+	return 0;
+}
+
+/*
+ * @brief Closes the FDS of a link that couldn't be created, keeping
+ * errno.
+ *
+ * @param[in out] fds
+ */
+static void
+close_link_fds(int fds[SHM_LINK_FDS])
+{
+	int e = errno;
+
+	for (int i = 0; i < SHM_LINK_FDS; ++i)
+		if (fds[i] != -1)
+			close(fds[i]);
+
+	errno = e;
+}
+
+/*
+ * @brief Maps the shared memory received from the server as the peer end.
+ * Takes ownership of FDS.
+ *
+ * @param[in out] link
+ * @param[in] fds As filled by shm_link_create().
+ *
+ * @return 0 ok; -1 error.
+ */
+int
+shm_link_attach(Shm_link_t *link, const int fds[SHM_LINK_FDS])
+{
+	void *p = mmap(NULL, sizeof(Shm_area_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+
+	close(fds[0]);
+
+	if (p == MAP_FAILED) {
+		close(fds[1]);
+		close(fds[2]);
+		return -1;
+	}
+
+	link->area = p;
+	link->in = &link->area->rings[0];
+	link->out = &link->area->rings[1];
+	link->efd_in = fds[1];
+	link->efd_out = fds[2];
+	pthread_mutex_init(&link->mutex, NULL);
+
+	return 0;
+}
+
+/*
+ * @brief Unmaps the shared memory and closes the eventfds.
+ *
+ * @param[in out] link
+ */
+void
+shm_link_destroy(Shm_link_t *link)
+{
+	munmap(link->area, sizeof(Shm_area_t));
+	close(link->efd_in);
+	close(link->efd_out);
+	pthread_mutex_destroy(&link->mutex);
+}
+
+/*
+ * @brief Appends a message to the outgoing ring. The other end only gets
+ * an eventfd write if it said it was going to sleep, so a busy peer is
+ * fed without a single system call.
+ *
+ * @param[in] link
+ * @param[in] data
+ * @param[in] len
+ *
+ * @return 0 ok; -1 with errno EAGAIN if the ring is full for now, or
+ * EMSGSIZE if the message will never fit. Nothing is written then.
+ */
+int
+shm_link_send(Shm_link_t *link, const void *data, const size_t len)
+{
+	Shm_ring_t *r = link->out;
+	uint32_t n = len;
+
+	if (len > SHM_RING_SIZE - sizeof(n)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&link->mutex);
+
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (SHM_RING_SIZE - (head - tail) < sizeof(n) + len) {
+		pthread_mutex_unlock(&link->mutex);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	ring_copy_in(r, head, &n, sizeof(n));
+	ring_copy_in(r, head + sizeof(n), data, len);
+	atomic_store_explicit(&r->head, head + sizeof(n) + len, memory_order_release);
+
+	pthread_mutex_unlock(&link->mutex);
+
+	/* Pairs with the fence in shm_link_prepare_wait(). */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&r->waiting, memory_order_relaxed))
+		if (eventfd_write(link->efd_out, 1) == -1)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * @brief Takes the next message out of the incoming ring, if any.
+ *
+ * @param[in] link
+ * @param[in out] buff
+ * @param[in] size sizeof(buff)
+ *
+ * @return Bytes copied to BUFF; 0 if the ring is empty; -1 with errno
+ * EPROTO if the ring holds garbage, or a message bigger than SIZE, which
+ * no peer of ours sends.
+ */
+ssize_t
+shm_link_recv(Shm_link_t *link, void *buff, const size_t size)
+{
+	Shm_ring_t *r = link->in;
+	uint32_t n;
+
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (head == tail)
+		return 0;
+
+	ring_copy_out(r, tail, &n, sizeof(n));
+
+	if (n > head - tail - sizeof(n) || n > size) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	ring_copy_out(r, tail + sizeof(n), buff, n);
+	atomic_store_explicit(&r->tail, tail + sizeof(n) + n, memory_order_release);
+
+	return n;
+}
+
+/*
+ * @brief Tells the other end we are about to wait on EFD_IN.
+ *
+ * @param[in] link
+ *
+ * @return 1 if it is safe to wait; 0 if messages arrived in the meantime,
+ * and they have to be read first.
+ */
+int
+shm_link_prepare_wait(Shm_link_t *link)
+{
+	Shm_ring_t *r = link->in;
+
+	atomic_store_explicit(&r->waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&r->head, memory_order_relaxed)
+	    != atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+		atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * @brief We are awake again: the other end can stop signalling us.
+ *
+ * @param[in] link
+ */
+void
+shm_link_finish_wait(Shm_link_t *link)
+{
+	eventfd_t n;
+
+	atomic_store_explicit(&link->in->waiting, 0, memory_order_relaxed);
+	(void) eventfd_read(link->efd_in, &n);
+}
+
+/*
+ * @brief Sends N file descriptors over the unix domain socket SFD, along
+ * with a single byte of data.
+ *
+ * @param[in] sfd
+ * @param[in] fds
+ * @param[in] n Number of descriptors; SHM_LINK_FDS at most.
+ *
+ * @return 0 ok; -1 error.
+ */
+int
+shm_send_fds(const int sfd, const int *fds, const size_t n)
+{
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buff[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buff,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * n)
+	};
+
+	memset(&u, 0, sizeof(u));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+	return sendmsg(sfd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/*
+ * @brief Receives N file descriptors sent with shm_send_fds().
+ *
+ * @param[in] sfd
+ * @param[in out] fds
+ * @param[in] n Number of descriptors expected; SHM_LINK_FDS at most.
+ *
+ * @return 0 ok; -1 error.
+ */
+int
+shm_recv_fds(const int sfd, int *fds, const size_t n)
+{
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		char buff[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buff,
+		.msg_controllen = sizeof(u.buff)
+	};
+
+	if (recvmsg(sfd, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+
+	return 0;
+}
+
+static void
+ring_copy_in(Shm_ring_t *r, uint32_t pos, const void *src, const size_t len)
+{
+	size_t off = pos & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+
+	memcpy(r->data + off, src, first);
+	memcpy(r->data, (const unsigned char *) src + first, len - first);
+}
+
+static void
+ring_copy_out(const Shm_ring_t *r, uint32_t pos, void *dst, const size_t len)
+{
+	size_t off = pos & (SHM_RING_SIZE - 1);
+	size_t first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+
+	memcpy(dst, r->data + off, first);
+	memcpy((unsigned char *) dst + first, r->data, len - first);
+}
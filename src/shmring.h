@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define SHM_RING_SIZE (1 << 16) /* Bytes per direction. Power of two. */
+#define SHM_LINK_FDS 3 /* memfd + one eventfd per direction. */
+
+/*
+ * Single producer, single consumer byte ring living in shared memory.
+ * Messages are stored as a 32 bit length followed by the bytes. HEAD and
+ * TAIL only ever grow; they are reduced modulo SHM_RING_SIZE on access.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint32_t head; /* Written by the producer. */
+	_Alignas(64) _Atomic uint32_t tail; /* Written by the consumer. */
+	_Alignas(64) _Atomic uint32_t waiting; /* Consumer is going to sleep. */
+	_Alignas(64) unsigned char data[SHM_RING_SIZE];
+} Shm_ring_t;
+
+/*
+ * What gets mapped by both sides: RINGS[0] carries server to peer
+ * messages, and RINGS[1] peer to server ones.
+ */
+typedef struct {
+	Shm_ring_t rings[2];
+} Shm_area_t;
+
+/*
+ * One end of a shared memory link.
+ */
+typedef struct {
+	Shm_area_t *area;
+	Shm_ring_t *in;
+	Shm_ring_t *out;
+	int efd_in; /* Signalled by the other end when IN gets data. */
+	int efd_out; /* We signal it when OUT gets data. */
+	pthread_mutex_t mutex; /* Several threads may write to OUT. */
+} Shm_link_t;
+
+int shm_link_create(Shm_link_t *, int[SHM_LINK_FDS]);
+int shm_link_attach(Shm_link_t *, const int[SHM_LINK_FDS]);
+void shm_link_destroy(Shm_link_t *);
+int shm_link_send(Shm_link_t *, const void *, const size_t);
+ssize_t shm_link_recv(Shm_link_t *, void *, const size_t);
+int shm_link_prepare_wait(Shm_link_t *);
+void shm_link_finish_wait(Shm_link_t *);
+int shm_send_fds(const int, const int *, const size_t);
+int shm_recv_fds(const int, int *, const size_t);
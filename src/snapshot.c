@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "snapshot.h"
+#include "utils.h"
+
+/*
+ * @brief Saves STATE to PATH. It goes to a temporary file first, which
+ * replaces PATH once it is on disk: PATH always holds a whole snapshot,
+ * the old one or the new one, even if we crash half way.
+ *
+ * @param[in] path
+ * @param[in] version Of the layout of STATE.
+ * @param[in] state
+ * @param[in] size sizeof(state)
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+snapshot_write(const char *path, const uint32_t version, const void *state, const size_t size)
+{
+	Snapshot_header_t header;
+	char tmp[4096];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+	header.version = version;
+	header.crc = crc32(crc32(0, Z_NULL, 0), state, size);
+	header.size = size;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+		return -1;
+
+	if (write_full(fd, &header, sizeof(header)) == -1 || write_full(fd, state, size) == -1
+	    || fsync(fd) == -1) {
+		int e = errno;
+		close(fd);
+		unlink(tmp);
+		errno = e;
+		return -1;
+	}
+
+	if (close(fd) == -1 || rename(tmp, path) == -1) {
+		int e = errno;
+		unlink(tmp);
+		errno = e;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Maps the snapshot in PATH, if it is one of a state of SIZE
+ * bytes laid out as VERSION, and it is whole.
+ *
+ * @param[in] path
+ * @param[in] version
+ * @param[in] size
+ *
+ * @return The state, read-only, until snapshot_unmap(); NULL on error,
+ * with errno set. ENOENT means there is no snapshot, and EINVAL that it
+ * can't be used.
+ */
+const void *
+snapshot_map(const char *path, const uint32_t version, const size_t size)
+{
+	const size_t len = sizeof(Snapshot_header_t) + size;
+	struct stat st;
+	char *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+
+	if ((size_t) st.st_size != len) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+	const Snapshot_header_t *header = (const Snapshot_header_t *) p;
+	const void *state = p + sizeof(Snapshot_header_t);
+
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0 || header->version != version
+	    || header->size != size || header->crc != crc32(crc32(0, Z_NULL, 0), state, size)) {
+		munmap(p, len);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return state;
+}
+
+/*
+ * @brief Unmaps a state mapped with snapshot_map().
+ *
+ * @param[in] state
+ * @param[in] size The one it was mapped with.
+ */
+void
+snapshot_unmap(const void *state, const size_t size)
+{
+	munmap((char *) state - sizeof(Snapshot_header_t), sizeof(Snapshot_header_t) + size);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A snapshot is a header followed by the state as it is laid out in
+ * memory, so it can be mapped and used without parsing anything. The
+ * header tells which layout it is, and has a CRC-32 of the state.
+ */
+#define SNAPSHOT_MAGIC "CHATSNAP"
+#define SNAPSHOT_MAGIC_SIZE 8
+
+typedef struct {
+	char magic[SNAPSHOT_MAGIC_SIZE];
+	uint32_t version; /* Of the layout of the state. */
+	uint32_t crc;
+	uint64_t size; /* Of the state. */
+} Snapshot_header_t;
+
+int snapshot_write(const char *, const uint32_t, const void *, const size_t);
+const void *snapshot_map(const char *, const uint32_t, const size_t);
+void snapshot_unmap(const void *, const size_t);
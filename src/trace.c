@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+/*
+ * Spans recorded by a thread. Rings outlive their threads, so a dump
+ * still shows what a connection that is gone went through; the next
+ * thread to start tracing takes the ring over.
+ */
+typedef struct Trace_ring {
+	struct Trace_ring *next;
+	pthread_mutex_t mutex; /* Only ever contended by a dump. */
+	int used; /* By a thread still running. Under TRACE_MUTEX. */
+	uint64_t count; /* Spans ever recorded. */
+	Trace_span_t spans[TRACE_RING_SIZE];
+} Trace_ring_t;
+
+static Trace_ring_t *get_ring(void);
+static void release_ring(void *);
+static void record(const Trace_stage, const uint64_t, const uint64_t);
+
+unsigned int g_trace_every = 0;
+_Thread_local uint64_t g_trace_id = 0;
+
+static _Thread_local Trace_ring_t *g_ring = NULL;
+static Trace_ring_t *g_rings = NULL; /* Under TRACE_MUTEX. */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key; /* Gives the ring back when its thread exits. */
+static _Atomic uint64_t g_messages = 0; /* Seen so far, to pick the ones traced. */
+static const char *g_stage_names[TRACE_STAGES] = { "recv", "parse", "lock", "send", "log" };
+
+/*
+ * @brief Turns tracing on, for one message in EVERY. Has to be called
+ * before any thread records anything.
+ *
+ * @param[in] every 0 leaves tracing off.
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+trace_init(const unsigned int every)
+{
+	if (every && (errno = pthread_key_create(&ring_key, release_ring)) != 0)
+		return -1;
+
+	g_trace_every = every;
+
+	return 0;
+}
+
+/*
+ * @return Nanoseconds from the monotonic clock.
+ */
+uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * @brief Counts a message and traces it if its turn has come: from now
+ * on, and until the next call, the stages of the calling thread belong
+ * to it. Use trace_message() instead.
+ *
+ * @param[in] start When the recv that brought it in started.
+ * @param[in] end When it was over.
+ */
+void
+trace_sample(const uint64_t start, const uint64_t end)
+{
+	uint64_t n = ++g_messages;
+
+	g_trace_id = n % g_trace_every == 0 ? n : 0;
+
+	if (g_trace_id && start)
+		record(TRACE_RECV, start, end);
+}
+
+/*
+ * @brief Records STAGE of the message being traced, from START to now.
+ * Use trace_leave() instead.
+ *
+ * @param[in] stage
+ * @param[in] start
+ */
+void
+trace_span(const Trace_stage stage, const uint64_t start)
+{
+	record(stage, start, trace_now());
+}
+
+/*
+ * @brief Writes every span still in the rings to PATH as Chrome
+ * trace-event JSON, which Perfetto and chrome://tracing load. Stages are
+ * complete events named after the stage, with the id of their message
+ * in the arguments.
+ *
+ * @param[in] path Gets overwritten.
+ *
+ * @return Spans written; -1 error, with errno set.
+ */
+int
+trace_dump(const char *path)
+{
+	Trace_span_t *spans = malloc(sizeof(Trace_span_t) * TRACE_RING_SIZE);
+	FILE *file = spans ? fopen(path, "w") : NULL;
+	int pid = getpid();
+	int total = 0;
+
+	if (!file) {
+		free(spans);
+		return -1;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	pthread_mutex_lock(&trace_mutex);
+
+	for (Trace_ring_t *r = g_rings; r; r = r->next) {
+		/* Copied, so the thread doesn't wait on the file. */
+		pthread_mutex_lock(&r->mutex);
+		uint64_t count = r->count;
+		size_t n = count < TRACE_RING_SIZE ? count : TRACE_RING_SIZE;
+
+		for (size_t i = 0; i < n; ++i)
+			spans[i] = r->spans[(count - n + i) % TRACE_RING_SIZE];
+
+		pthread_mutex_unlock(&r->mutex);
+
+		for (size_t i = 0; i < n; ++i, ++total)
+			fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"pid\":%d,"
+				"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"message\":%lu}}",
+				total ? ",\n" : "", g_stage_names[spans[i].stage], pid, spans[i].tid,
+				spans[i].start / 1000.0, (spans[i].end - spans[i].start) / 1000.0,
+				(unsigned long) spans[i].id);
+	}
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	fprintf(file, "\n]}\n");
+	free(spans);
+
+	if (ferror(file)) {
+		int e = errno;
+		fclose(file);
+		errno = e;
+		return -1;
+	}
+
+	return fclose(file) == 0 ? total : -1;
+}
+
+/*
+ * @brief Finds the ring of the calling thread, taking a free one over or
+ * making a new one the first time.
+ *
+ * @return The ring; NULL if there is no memory.
+ */
+static Trace_ring_t *
+get_ring(void)
+{
+	if (g_ring)
+		return g_ring;
+
+	pthread_mutex_lock(&trace_mutex);
+
+	Trace_ring_t *r = g_rings;
+
+	while (r && r->used)
+		r = r->next;
+
+	if (!r && (r = calloc(1, sizeof(Trace_ring_t)))) {
+		pthread_mutex_init(&r->mutex, NULL);
+		r->next = g_rings;
+		g_rings = r;
+	}
+
+	if (r)
+		r->used = 1;
+
+	pthread_mutex_unlock(&trace_mutex);
+
+	if (r)
+		pthread_setspecific(ring_key, r);
+
+	return g_ring = r;
+}
+
+/*
+ * @brief Gives the ring of a thread that is exiting back.
+ *
+ * @param[in] arg The ring.
+ */
+static void
+release_ring(void *arg)
+{
+	Trace_ring_t *r = (Trace_ring_t *) arg;
+
+	pthread_mutex_lock(&trace_mutex);
+	r->used = 0;
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void
+record(const Trace_stage stage, const uint64_t start, const uint64_t end)
+{
+	Trace_ring_t *r = get_ring();
+
+	if (!r)
+		return;
+
+	pthread_mutex_lock(&r->mutex);
+
+	Trace_span_t *s = &r->spans[r->count++ % TRACE_RING_SIZE];
+
+	s->id = g_trace_id;
+	s->start = start;
+	s->end = end;
+	s->tid = gettid();
+	s->stage = stage;
+
+	pthread_mutex_unlock(&r->mutex);
+}
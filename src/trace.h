@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 4096 /* Spans each thread keeps; older ones get overwritten. */
+
+/*
+ * Stages of a message, from the bytes coming in to everyone having it.
+ */
+typedef enum {
+	TRACE_RECV, /* Reading the bytes it came in. */
+	TRACE_PARSE, /* Sanitizing, filtering and telling commands apart. */
+	TRACE_LOCK, /* Waiting for CLIENT_MUTEX to fan it out. */
+	TRACE_SEND, /* Fanning it out to clients and links. */
+	TRACE_LOG, /* Writing it to the log. */
+	TRACE_STAGES
+} Trace_stage;
+
+typedef struct {
+	uint64_t id; /* Of the message. */
+	uint64_t start; /* Nanoseconds, CLOCK_MONOTONIC. */
+	uint64_t end;
+	int tid; /* Thread it ran on. */
+	Trace_stage stage;
+} Trace_span_t;
+
+/* One message in this many gets traced; 0 traces none. */
+extern unsigned int g_trace_every;
+/* Message the calling thread is handling, if it is being traced; 0 otherwise. */
+extern _Thread_local uint64_t g_trace_id;
+
+int trace_init(const unsigned int);
+uint64_t trace_now(void);
+void trace_sample(const uint64_t, const uint64_t);
+void trace_span(const Trace_stage, const uint64_t);
+int trace_dump(const char *);
+
+/*
+ * @brief Decides whether the message about to be handled gets traced,
+ * and if so records the recv that brought it in.
+ *
+ * @param[in] start When the recv started; see trace_clock().
+ * @param[in] end When it was over.
+ */
+static inline void
+trace_message(const uint64_t start, const uint64_t end)
+{
+	if (g_trace_every)
+		trace_sample(start, end);
+}
+
+/*
+ * @brief Reads the clock if tracing is on at all, for trace_message().
+ *
+ * @return Nanoseconds; 0 if tracing is off.
+ */
+static inline uint64_t
+trace_clock(void)
+{
+	return g_trace_every ? trace_now() : 0;
+}
+
+/*
+ * @brief Marks the start of a stage of the message being traced.
+ *
+ * @return What trace_leave() needs; 0 if the message is not traced.
+ */
+static inline uint64_t
+trace_enter(void)
+{
+	return g_trace_id ? trace_now() : 0;
+}
+
+/*
+ * @brief Records the stage that trace_enter() returned START for, if the
+ * message is traced.
+ *
+ * @param[in] stage
+ * @param[in] start
+ */
+static inline void
+trace_leave(const Trace_stage stage, const uint64_t start)
+{
+	if (start)
+		trace_span(stage, start);
+}
@@ -1,3 +1,8 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "utils.h"
 
 /*
@@ -75,3 +80,387 @@ flush_endl(void)
 	while (((ch = getchar()) != '\n') && (ch != EOF))
 		;
 }
+
+/*
+ * @brief Reads a single newline-terminated line from FD, one byte at a time,
+ * so nothing that follows the line is consumed. Used during the handshake,
+ * where the status lines may arrive glued to the first chat messages.
+ *
+ * Works with both blocking and non-blocking sockets: if FD has nothing to
+ * give yet, we wait for it with poll(2).
+ *
+ * @param[in] fd Socket to read from.
+ * @param[in out] buff Line read, without the newline and NUL-terminated.
+ * @param[in] size sizeof(buff).
+ *
+ * @return Length of the line; 0 if the peer closed the connection; -1 error.
+ */
+ssize_t
+recv_line(const int fd, char *buff, const size_t size)
+{
+	size_t len = 0;
+
+	while (len < size - 1) {
+		char ch;
+		ssize_t res = recv(fd, &ch, 1, 0);
+
+		if (res == 0)
+			return 0;
+
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return -1;
+
+			continue;
+		}
+
+		if (ch == '\n')
+			break;
+
+		buff[len++] = ch;
+	}
+
+	buff[len] = '\0';
+
+	return len;
+}
+
+/*
+ * @brief Reads whatever FD has for us into LB. FD is either non-blocking
+ * or known to be readable, so this doesn't block.
+ *
+ * @param[in out] lb
+ * @param[in] fd Socket, pipe or terminal to read from.
+ *
+ * @return Same as read(2).
+ */
+ssize_t
+line_buffer_fill(Line_buffer_t *lb, const int fd)
+{
+	if (lb->start > 0) {
+		memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+		lb->end -= lb->start;
+		lb->start = 0;
+	}
+
+	/* Keep one byte for the NUL of a line that fills the whole buffer. */
+	ssize_t res = read(fd, lb->data + lb->end, sizeof(lb->data) - lb->end - 1);
+
+	if (res > 0)
+		lb->end += res;
+
+	return res;
+}
+
+/*
+ * @brief Same as line_buffer_fill(), but the bytes of FD are a raw deflate
+ * stream, inflated into LB as they come. Compressed bytes that don't fit
+ * in LB yet are kept in Z until the next call.
+ *
+ * @param[in out] lb
+ * @param[in out] z Set up with inflateInit2(-MAX_WBITS), and AVAIL_IN at 0.
+ * @param[in] fd
+ *
+ * @return Same as read(2), but counting the bytes that went into LB. -1
+ * with EPROTO if the stream is corrupted.
+ */
+ssize_t
+line_buffer_inflate(Line_buffer_t *lb, Inflater_t *z, const int fd)
+{
+	if (lb->start > 0) {
+		memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+		lb->end -= lb->start;
+		lb->start = 0;
+	}
+
+	size_t room = sizeof(lb->data) - lb->end - 1;
+
+	while (room > 0) {
+		/* Whatever is still inside the stream goes out before we read again. */
+		z->strm.next_out = (Bytef *) lb->data + lb->end;
+		z->strm.avail_out = room;
+
+		int res = inflate(&z->strm, Z_SYNC_FLUSH);
+
+		if (res != Z_OK && res != Z_BUF_ERROR) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		size_t n = room - z->strm.avail_out;
+
+		if (n > 0) {
+			lb->end += n;
+			return n;
+		}
+
+		if (z->strm.avail_in > 0)
+			continue;
+
+		ssize_t len = read(fd, z->in, sizeof(z->in));
+
+		if (len <= 0)
+			return len;
+
+		z->strm.next_in = (Bytef *) z->in;
+		z->strm.avail_in = len;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief Hands out the next complete line in LB. A line that doesn't fit
+ * in the buffer is cut and handed out as it is.
+ *
+ * @param[in out] lb
+ *
+ * @return The line, NUL-terminated and without the newline. It stays valid
+ * until the next call to line_buffer_fill(). NULL if there is no complete
+ * line yet.
+ */
+char *
+line_buffer_next(Line_buffer_t *lb)
+{
+	char *line = lb->data + lb->start;
+	char *nl = memchr(line, '\n', lb->end - lb->start);
+
+	if (nl) {
+		*nl = '\0';
+		lb->start = nl - lb->data + 1;
+		return line;
+	}
+
+	if (lb->start == 0 && lb->end == sizeof(lb->data) - 1) {
+		lb->data[lb->end] = '\0';
+		lb->start = lb->end;
+		return line;
+	}
+
+	return NULL;
+}
+
+/*
+ * @brief Hands out the next complete frame in LB. Frames have to fit in
+ * the buffer, header included.
+ *
+ * @param[in out] lb
+ * @param[in out] type Type of the frame.
+ * @param[in out] len Length of its payload.
+ *
+ * @return The payload. It stays valid until the next call to
+ * line_buffer_fill(). NULL if there is no complete frame yet.
+ */
+char *
+line_buffer_frame(Line_buffer_t *lb, char *type, size_t *len)
+{
+	char *frame = lb->data + lb->start;
+
+	if (lb->end - lb->start < FRAME_HEADER_SIZE)
+		return NULL;
+
+	size_t n = get_be(frame + 1, 2);
+
+	if (lb->end - lb->start < FRAME_HEADER_SIZE + n)
+		return NULL;
+
+	*type = frame[0];
+	*len = n;
+	lb->start += FRAME_HEADER_SIZE + n;
+
+	return frame + FRAME_HEADER_SIZE;
+}
+
+/*
+ * @brief Hands out up to MAX bytes in LB as they are, for data that
+ * comes unframed.
+ *
+ * @param[in out] lb
+ * @param[in] max
+ * @param[in out] len How many there are.
+ *
+ * @return The bytes. They stay valid until the next call to
+ * line_buffer_fill(). NULL if there are none.
+ */
+char *
+line_buffer_take(Line_buffer_t *lb, const size_t max, size_t *len)
+{
+	char *data = lb->data + lb->start;
+
+	if (lb->end == lb->start)
+		return NULL;
+
+	*len = lb->end - lb->start < max ? lb->end - lb->start : max;
+	lb->start += *len;
+
+	return data;
+}
+
+/*
+ * @brief Writes the header of a frame.
+ *
+ * @param[in out] buff FRAME_HEADER_SIZE bytes at least.
+ * @param[in] type
+ * @param[in] len Length of the payload.
+ */
+void
+frame_header(char *buff, const char type, const size_t len)
+{
+	buff[0] = type;
+	put_be(buff + 1, len, 2);
+}
+
+/*
+ * @brief Writes the BYTES lowest bytes of N to BUFF, most significant
+ * first.
+ *
+ * @param[in out] buff
+ * @param[in] n
+ * @param[in] bytes
+ */
+void
+put_be(char *buff, uint64_t n, const size_t bytes)
+{
+	for (size_t i = bytes; i > 0; --i) {
+		buff[i - 1] = n & 0xff;
+		n >>= 8;
+	}
+}
+
+/*
+ * @brief Reads a number written by put_be().
+ *
+ * @param[in] buff
+ * @param[in] bytes
+ *
+ * @return The number.
+ */
+uint64_t
+get_be(const char *buff, const size_t bytes)
+{
+	uint64_t n = 0;
+
+	for (size_t i = 0; i < bytes; ++i)
+		n = n << 8 | (unsigned char) buff[i];
+
+	return n;
+}
+
+/*
+ * @brief Parses STR as a base 10 number within [MIN, MAX].
+ *
+ * @param[in] str
+ * @param[in] min
+ * @param[in] max
+ * @param[in out] out Parsed number. Untouched on error.
+ *
+ * @return 0 ok; -1 if STR is not a number or it is out of range.
+ */
+int
+parse_long(const char *str, const long min, const long max, long *out)
+{
+	char *end = NULL;
+
+	errno = 0;
+	long n = strtol(str, &end, 10);
+
+	if (errno != 0 || end == str || *end != '\0' || n < min || n > max)
+		return -1;
+
+	*out = n;
+
+	return 0;
+}
+
+/*
+ * @brief Pins the calling thread to CPU.
+ *
+ * @param[in] cpu
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+pin_thread(const int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	return errno ? -1 : 0;
+}
+
+/*
+ * @brief Same as poll(2), but if nothing is ready it keeps looking
+ * without going to sleep for up to SPIN microseconds before it blocks.
+ * Saves the wake-up when the next event is about to come anyway, at the
+ * price of a busy CPU.
+ *
+ * @param[in out] pfds
+ * @param[in] n Length of PFDS.
+ * @param[in] timeout Milliseconds, counted once the spinning is over.
+ * @param[in] spin Microseconds; 0 doesn't spin.
+ *
+ * @return Same as poll(2).
+ */
+int
+poll_spin(struct pollfd *pfds, const nfds_t n, const int timeout, const long spin)
+{
+	if (spin > 0 && timeout != 0) {
+		struct timespec start;
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		do {
+			int res = poll(pfds, n, 0);
+
+			if (res != 0)
+				return res;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 < spin);
+	}
+
+	return poll(pfds, n, timeout);
+}
+
+/*
+ * @brief Writes LEN bytes of BUFF to FD, however many calls it takes.
+ *
+ * @param[in] fd
+ * @param[in] buff
+ * @param[in] len
+ *
+ * @return 0 ok; -1 error, with errno set.
+ */
+int
+write_full(const int fd, const void *buff, size_t len)
+{
+	const char *p = buff;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
@@ -2,9 +2,51 @@
 
 #include <stdio.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "common.h"
+
+#define LINE_BUFF_SIZE 4096
+
+/*
+ * Accumulates bytes read from a socket and splits them into
+ * newline-terminated lines.
+ */
+typedef struct {
+	char data[LINE_BUFF_SIZE];
+	size_t start; /* First byte not handed out yet. */
+	size_t end; /* One past the last byte read. */
+} Line_buffer_t;
+
+/*
+ * Decompresses a raw deflate stream read from a socket.
+ */
+typedef struct {
+	z_stream strm;
+	char in[LINE_BUFF_SIZE]; /* Compressed bytes read but not inflated yet. */
+} Inflater_t;
 
 char *ltrim(char *);
 char *rtrim(char *);
 char *trim(char *);
 void flush_endl(void);
+ssize_t recv_line(const int, char *, const size_t);
+ssize_t line_buffer_fill(Line_buffer_t *, const int);
+ssize_t line_buffer_inflate(Line_buffer_t *, Inflater_t *, const int);
+char *line_buffer_next(Line_buffer_t *);
+char *line_buffer_frame(Line_buffer_t *, char *, size_t *);
+char *line_buffer_take(Line_buffer_t *, const size_t, size_t *);
+void frame_header(char *, const char, const size_t);
+void put_be(char *, uint64_t, const size_t);
+uint64_t get_be(const char *, const size_t);
+int parse_long(const char *, const long, const long, long *);
+int pin_thread(const int);
+int poll_spin(struct pollfd *, const nfds_t, const int, const long);
+int write_full(const int, const void *, size_t);
@@ -0,0 +1,175 @@
+#include <string.h>
+#include "wheel.h"
+
+static void add_timer(Wheel_t *, Timer_t *);
+static void cascade(Wheel_t *, const int);
+
+/*
+ * @brief Starts W empty, at the tick NOW.
+ *
+ * @param[in out] w
+ * @param[in] now
+ */
+void
+wheel_init(Wheel_t *w, const uint64_t now)
+{
+	memset(w->slots, 0, sizeof(w->slots));
+	w->now = now;
+}
+
+/*
+ * @brief Sets T up, not armed, to call FN when it fires.
+ *
+ * @param[in out] t
+ * @param[in] fn Called with T, which is not armed anymore by then. It
+ * may arm it again.
+ * @param[in] arg Left in T for FN.
+ */
+void
+timer_init(Timer_t *t, Timer_fn fn, void *arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/*
+ * @brief Arms T to fire at the tick EXPIRES, or on the next one if that
+ * is past already. If T was armed, it is moved.
+ *
+ * @param[in out] w
+ * @param[in out] t
+ * @param[in] expires
+ */
+void
+timer_arm(Wheel_t *w, Timer_t *t, const uint64_t expires)
+{
+	timer_cancel(t);
+	t->expires = expires;
+	add_timer(w, t);
+}
+
+/*
+ * @brief Disarms T. Nothing happens if it is not armed.
+ *
+ * @param[in out] t
+ */
+void
+timer_cancel(Timer_t *t)
+{
+	if (!t->pprev)
+		return;
+
+	*t->pprev = t->next;
+
+	if (t->next)
+		t->next->pprev = t->pprev;
+
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * @brief Runs every tick up to NOW, firing the timers due.
+ *
+ * @param[in out] w
+ * @param[in] now
+ */
+void
+wheel_advance(Wheel_t *w, const uint64_t now)
+{
+	while (w->now <= now) {
+		size_t slot = w->now & (WHEEL_SLOTS - 1);
+
+		/* Level 0 went round: bring down what is due on the next round. */
+		if (slot == 0)
+			cascade(w, 1);
+
+		/*
+		 * Taken out of the wheel first: a timer armed again by its
+		 * callback may well belong to this very slot, one round later.
+		 */
+		Timer_t *due = w->slots[0][slot];
+
+		w->slots[0][slot] = NULL;
+
+		if (due)
+			due->pprev = &due;
+
+		++w->now;
+
+		while (due) {
+			Timer_t *t = due;
+
+			timer_cancel(t);
+			t->fn(t);
+		}
+	}
+}
+
+/*
+ * @brief Puts T in the slot of the lowest level that reaches its tick.
+ * The slot of a level is picked by the bits of the tick for that level,
+ * so timers never need to be moved while their level goes round.
+ *
+ * @param[in out] w
+ * @param[in out] t
+ */
+static void
+add_timer(Wheel_t *w, Timer_t *t)
+{
+	uint64_t expires = t->expires < w->now ? w->now : t->expires;
+	uint64_t delta = expires - w->now;
+	int level = 0;
+
+	while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1)))
+		++level;
+
+	/* Too far away: it waits at the farthest slot and comes back here. */
+	if (delta >= (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS))
+		expires = w->now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	Timer_t **slot = &w->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+	t->next = *slot;
+	t->pprev = slot;
+
+	if (t->next)
+		t->next->pprev = &t->next;
+
+	*slot = t;
+}
+
+/*
+ * @brief Moves the timers of the current slot of LEVEL down to the levels
+ * below. If LEVEL went round too, the one above is cascaded first.
+ *
+ * @param[in out] w
+ * @param[in] level
+ */
+static void
+cascade(Wheel_t *w, const int level)
+{
+	if (level >= WHEEL_LEVELS)
+		return;
+
+	size_t slot = (w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+
+	if (slot == 0)
+		cascade(w, level + 1);
+
+	Timer_t *t = w->slots[level][slot];
+
+	w->slots[level][slot] = NULL;
+
+	while (t) {
+		Timer_t *next = t->next;
+
+		t->next = NULL;
+		t->pprev = NULL;
+		add_timer(w, t);
+		t = next;
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* Timers up to 2^24 ticks away. */
+
+typedef struct Timer Timer_t;
+
+typedef void (*Timer_fn)(Timer_t *);
+
+/*
+ * Meant to be embedded in whatever it times. A timer is in a single slot
+ * of the wheel at a time, linked to the other timers there.
+ */
+struct Timer {
+	Timer_t *next;
+	Timer_t **pprev; /* NULL while it is not armed. */
+	uint64_t expires; /* Tick. */
+	Timer_fn fn;
+	void *arg;
+};
+
+/*
+ * Hierarchical timing wheel: level N has 64 slots of 64^N ticks each.
+ * Timers go down a level each time the level below goes round, so each
+ * one is touched at most once per level before it fires. Whoever uses
+ * it serializes the access.
+ */
+typedef struct {
+	uint64_t now; /* Next tick to run. */
+	Timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} Wheel_t;
+
+void wheel_init(Wheel_t *, const uint64_t);
+void timer_init(Timer_t *, Timer_fn, void *);
+void timer_arm(Wheel_t *, Timer_t *, const uint64_t);
+void timer_cancel(Timer_t *);
+void wheel_advance(Wheel_t *, const uint64_t);
@@ -0,0 +1,129 @@
+#!/usr/bin/env bash
+#
+# Starts the server at $1 on port $2 in a directory of its own, rotating
+# its log every second, and plays scripted users against it, as plain
+# text clients talking through bash's /dev/tcp. Exits with 1 if anything
+# they expected didn't happen.
+
+set -u
+export LC_ALL=C # Lengths in bytes.
+
+server=$(realpath "$1")
+port=$2
+dir=$(mktemp -d)
+failed=0
+
+cd "$dir" || exit 1
+"$server" -p "$port" -e 1 > server.log 2>&1 &
+pid=$!
+trap 'kill -INT $pid; wait $pid; cd /; rm -rf "$dir"' EXIT
+
+fail() {
+	echo "$0: $*" >&2
+	failed=$((failed + 1))
+}
+
+# join VAR LINE: connects, keeping the descriptor in VAR, and sends LINE
+# as the handshake.
+join() {
+	local -n fd=$1
+
+	exec {fd}<>"/dev/tcp/localhost/$port" && printf '%s\n' "$2" >&"$fd"
+}
+
+# say VAR LINE
+say() {
+	printf '%s\n' "$2" >&"${!1}"
+}
+
+# leave VAR
+leave() {
+	local -n fd=$1
+
+	exec {fd}>&-
+}
+
+# expect VAR REGEX: reads lines until one matches, leaving its groups in
+# BASH_REMATCH. Gives up once nothing arrives for three seconds.
+expect() {
+	local line
+
+	while IFS= read -r -t 3 line <&"${!1}"; do
+		[[ $line =~ $2 ]] && return 0
+	done
+
+	fail "$1 never got '$2'"
+	return 1
+}
+
+for i in $(seq 50); do
+	(exec 3<>"/dev/tcp/localhost/$port") 2> /dev/null && break
+	sleep 0.1
+done
+
+# Resume: alice loses the connection, comes back with the session and
+# gets what was said meanwhile.
+join alice "alice resume"
+expect alice '^!session ([0-9a-f]+) ' && token=${BASH_REMATCH[1]}
+join bob "bob"
+expect alice 'bob has'
+say bob "one"
+expect alice '^#([0-9]+) .*bob.*: one$' && seq=${BASH_REMATCH[1]}
+leave alice
+expect bob 'alice has'
+say bob "two"
+say bob "three"
+join alice "!resume ${token:-none} ${seq:-0}"
+expect alice '^#[0-9]+ .*bob.*: two$'
+expect alice '^#[0-9]+ .*bob.*: three$'
+
+# Export: once the log with "one" was rotated and compressed, bob asks for
+# all of it and gets every line, with exactly as many bytes as announced.
+sleep 1.5
+say bob "four"
+
+for i in $(seq 50); do
+	compgen -G 'archive/*.gz' > /dev/null && break
+	sleep 0.1
+done
+
+compgen -G 'archive/*.gz' > /dev/null || fail "the log was never compressed"
+say bob "!history 2000-01-01 2100-01-01"
+
+if expect bob '^!history ([0-9]+)$'; then
+	size=${BASH_REMATCH[1]}
+	got=0
+	log=""
+
+	while ((got < size)) && IFS= read -r -t 3 line <&"$bob"; do
+		got=$((got + ${#line} + 1))
+		log+="$line"$'\n'
+	done
+
+	((got == size)) || fail "the export announced $size bytes and sent $got"
+	[[ $log == *"bob: one"*"bob: four"* ]] || fail "the export misses lines: $log"
+fi
+
+# Mentions: carol, with a plain client and no session, misses one while
+# away, and gets it on joining again. The one for dan, who never came,
+# mentions nobody.
+join carol "carol"
+expect bob 'carol has'
+# Both statuses read, so the connection ends with a FIN rather than a reset.
+expect carol '^OK$'
+expect carol '^OK$'
+leave carol
+expect bob 'carol has'
+say bob "hey @carol and @dan"
+join carol "carol"
+expect carol '^!mention [0-9]+ bob .*hey @carol and @dan$'
+say bob "@carol again"
+expect carol '^!mention [0-9]+ bob$'
+join dan "dan"
+expect dan '^OK$'
+expect dan '^OK$'
+say bob "welcome dan"
+IFS= read -r -t 3 line <&"$dan"
+[[ $line == *"welcome dan" ]] || fail "dan got '$line' first"
+
+exit $((failed > 0))
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * Checks for the tests in this directory. Every test is a program of its
+ * own that runs its checks, reports the ones that fail and exits with 1
+ * if any did.
+ */
+static int g_failed = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			++g_failed; \
+		} \
+	} while (0)
+
+#define TEST_EXIT() (g_failed ? (fprintf(stderr, "%d checks failed.\n", g_failed), 1) : 0)
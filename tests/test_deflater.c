@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "test.h"
+#include "../src/deflater.h"
+
+#define RUNS 2000
+#define MAX_LEN 1000
+
+static void inflater_init(z_stream *);
+static int decodes(z_stream *, const char *, const size_t, const char *, const size_t);
+static size_t random_message(char *);
+static void check_stream(void);
+static void check_shared(void);
+static void check_full_flush(void);
+static void check_small(void);
+
+/*
+ * Whatever a stream sends is decoded with a raw inflater on the other
+ * side, as the client does, right after each message: every one has to
+ * come out whole, without waiting for the next.
+ */
+int
+main(void)
+{
+	srand(1);
+
+	check_stream();
+	check_shared();
+	check_full_flush();
+	check_small();
+
+	return TEST_EXIT();
+}
+
+static void
+inflater_init(z_stream *z)
+{
+	memset(z, 0, sizeof(*z));
+	CHECK(inflateInit2(z, -MAX_WBITS) == Z_OK);
+}
+
+/*
+ * @brief Feeds the LEN bytes of IN to Z.
+ *
+ * @return 1 if exactly the EXPECTED_LEN bytes of EXPECTED come out; 0
+ * otherwise.
+ */
+static int
+decodes(z_stream *z, const char *in, const size_t len, const char *expected, const size_t expected_len)
+{
+	char out[MAX_LEN + 1];
+
+	z->next_in = (Bytef *) in;
+	z->avail_in = len;
+	z->next_out = (Bytef *) out;
+	z->avail_out = sizeof(out);
+
+	int res = inflate(z, Z_SYNC_FLUSH);
+
+	return (res == Z_OK || res == Z_BUF_ERROR) && z->avail_in == 0
+	       && sizeof(out) - z->avail_out == expected_len && memcmp(out, expected, expected_len) == 0;
+}
+
+/*
+ * @brief Chat lines most of the time; now and then random bytes, which
+ * don't compress at all.
+ *
+ * @return Length of MSG.
+ */
+static size_t
+random_message(char *msg)
+{
+	size_t len;
+
+	if (rand() % 10) {
+		len = snprintf(msg, MAX_LEN, "\x1B[32muser%d\x1B[0m: message number %d\n", rand() % 7, rand());
+	} else {
+		len = 1 + rand() % MAX_LEN;
+
+		for (size_t i = 0; i < len; ++i)
+			msg[i] = rand();
+	}
+
+	return len;
+}
+
+/*
+ * @brief Every message of a long stream decodes right away, and repeated
+ * lines shrink to a few bytes once the dictionary has them.
+ */
+static void
+check_stream(void)
+{
+	Deflater_t *d = deflater_new();
+	char msg[MAX_LEN];
+	char out[DEFLATER_BOUND(MAX_LEN)];
+	z_stream z;
+
+	CHECK(d && d->refs == 1);
+	inflater_init(&z);
+
+	for (int i = 0; i < RUNS; ++i) {
+		size_t len = random_message(msg);
+		ssize_t n = deflater_run(d, msg, len, out, DEFLATER_BOUND(len), Z_PARTIAL_FLUSH);
+
+		CHECK(n > 0 && decodes(&z, out, n, msg, len));
+	}
+
+	const char *line = "alice: the same line of chat, over and over again\n";
+	ssize_t n = deflater_run(d, line, strlen(line), out, sizeof(out), Z_PARTIAL_FLUSH);
+
+	CHECK(n > 0 && decodes(&z, out, n, line, strlen(line)));
+
+	n = deflater_run(d, line, strlen(line), out, sizeof(out), Z_PARTIAL_FLUSH);
+
+	CHECK(n > 0 && n < (ssize_t) strlen(line) / 4 && decodes(&z, out, n, line, strlen(line)));
+
+	inflateEnd(&z);
+	deflater_unref(d);
+	deflater_unref(NULL);
+}
+
+/*
+ * @brief Clients sharing a stream get the same bytes. Once one of them
+ * gets a copy of its own, both streams go on from the same dictionary.
+ */
+static void
+check_shared(void)
+{
+	Deflater_t *a = deflater_new();
+	Deflater_t *b = deflater_ref(a);
+	char msg[MAX_LEN];
+	char out[DEFLATER_BOUND(MAX_LEN)];
+	z_stream za;
+	z_stream zb;
+
+	CHECK(a == b && a->refs == 2);
+	inflater_init(&za);
+	inflater_init(&zb);
+
+	for (int i = 0; i < RUNS / 10; ++i) {
+		size_t len = random_message(msg);
+		ssize_t n = deflater_run(a, msg, len, out, sizeof(out), Z_PARTIAL_FLUSH);
+
+		CHECK(n > 0 && decodes(&za, out, n, msg, len) && decodes(&zb, out, n, msg, len));
+	}
+
+	CHECK(deflater_unshare(&b) == 0);
+	CHECK(a != b && a->refs == 1 && b->refs == 1);
+	CHECK(deflater_unshare(&a) == 0 && a->refs == 1);
+
+	for (int i = 0; i < RUNS / 10; ++i) {
+		size_t len = random_message(msg);
+		ssize_t n = deflater_run(i % 2 ? a : b, msg, len, out, sizeof(out), Z_PARTIAL_FLUSH);
+
+		CHECK(n > 0 && decodes(i % 2 ? &za : &zb, out, n, msg, len));
+	}
+
+	inflateEnd(&za);
+	inflateEnd(&zb);
+	deflater_unref(a);
+	deflater_unref(b);
+}
+
+/*
+ * @brief After a full flush, what a stream sends next decodes on the
+ * inflater of another stream, so a client can move to a shared one.
+ */
+static void
+check_full_flush(void)
+{
+	Deflater_t *a = deflater_new();
+	Deflater_t *b = deflater_new();
+	char msg[MAX_LEN];
+	char out[DEFLATER_BOUND(MAX_LEN)];
+	char other[DEFLATER_BOUND(MAX_LEN)];
+	z_stream z;
+	ssize_t n;
+
+	inflater_init(&z);
+
+	for (int i = 0; i < RUNS / 10; ++i) {
+		size_t len = random_message(msg);
+
+		CHECK((n = deflater_run(a, msg, len, out, sizeof(out), Z_PARTIAL_FLUSH)) > 0);
+		CHECK(deflater_run(b, msg + len / 2, len - len / 2, other, sizeof(other), Z_PARTIAL_FLUSH) > 0);
+		CHECK(decodes(&z, out, n, msg, len));
+	}
+
+	size_t len = random_message(msg);
+
+	CHECK((n = deflater_run(a, msg, len, out, sizeof(out), Z_FULL_FLUSH)) > 0);
+	CHECK(decodes(&z, out, n, msg, len));
+	CHECK(deflater_run(b, "", 0, other, sizeof(other), Z_FULL_FLUSH) > 0);
+
+	for (int i = 0; i < RUNS / 10; ++i) {
+		len = random_message(msg);
+
+		CHECK((n = deflater_run(b, msg, len, out, sizeof(out), Z_PARTIAL_FLUSH)) > 0);
+		CHECK(decodes(&z, out, n, msg, len));
+	}
+
+	inflateEnd(&z);
+	deflater_unref(a);
+	deflater_unref(b);
+}
+
+/*
+ * @brief Too little room for a message is an error, not a message cut
+ * short.
+ */
+static void
+check_small(void)
+{
+	Deflater_t *d = deflater_new();
+	char msg[MAX_LEN];
+	char out[16];
+
+	for (size_t i = 0; i < sizeof(msg); ++i)
+		msg[i] = rand();
+
+	errno = 0;
+	CHECK(deflater_run(d, msg, sizeof(msg), out, sizeof(out), Z_PARTIAL_FLUSH) == -1 && errno == EPROTO);
+
+	deflater_unref(d);
+}
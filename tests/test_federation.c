@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "../src/federation.h"
+
+#define RUNS 200000
+#define ORIGINS 5
+#define SPAN 4096 /* Sequence numbers each origin goes through. */
+
+static void check_round_trip(const Fed_frame_t *);
+static void check_frames(void);
+static void check_bad_frames(void);
+static void check_seen(void);
+static void check_origins(void);
+
+int
+main(void)
+{
+	srand(1);
+
+	check_frames();
+	check_bad_frames();
+	check_seen();
+	check_origins();
+
+	return TEST_EXIT();
+}
+
+/*
+ * @brief FRAME is formatted as one line and parses back the same.
+ */
+static void
+check_round_trip(const Fed_frame_t *frame)
+{
+	char line[BUFF_SIZE + 64];
+	Fed_frame_t parsed;
+	int len = fed_format(line, sizeof(line), frame);
+
+	CHECK(len > 0 && line[len - 1] == '\n' && strchr(line, '\n') == line + len - 1);
+
+	if (len <= 0)
+		return;
+
+	line[len - 1] = '\0';
+
+	CHECK(fed_parse(line, &parsed) == 0);
+	CHECK(parsed.type == frame->type && parsed.origin == frame->origin && parsed.seq == frame->seq);
+	CHECK(strcmp(parsed.name, frame->name) == 0);
+	CHECK(strcmp(parsed.target, frame->target) == 0);
+	CHECK(strcmp(parsed.text, frame->text) == 0);
+}
+
+static void
+check_frames(void)
+{
+	Fed_frame_t message = { .type = FED_MESSAGE, .origin = 3, .seq = 1UL << 50, .name = "alice",
+				.target = "", .text = "hello  there, with  spaces " };
+	Fed_frame_t notice = { .type = FED_NOTICE, .origin = 1, .seq = 7, .name = "bob",
+			       .target = "", .text = "bob has connected." };
+	Fed_frame_t join = { .type = FED_JOIN, .origin = 64, .seq = 8, .name = "carol", .target = "", .text = "" };
+	Fed_frame_t leave = { .type = FED_LEAVE, .origin = 2, .seq = 9, .name = "carol", .target = "", .text = "" };
+	Fed_frame_t whisper = { .type = FED_WHISPER, .origin = 2, .seq = 10, .name = "dave",
+				.target = "erin", .text = "just between us" };
+	Fed_frame_t ping = { .type = FED_PING, .origin = 4, .seq = 0, .name = "-", .target = "", .text = "" };
+	Fed_frame_t pong = { .type = FED_PONG, .origin = 4, .seq = 0, .name = "-", .target = "", .text = "" };
+
+	check_round_trip(&message);
+	check_round_trip(&notice);
+	check_round_trip(&join);
+	check_round_trip(&leave);
+	check_round_trip(&whisper);
+	check_round_trip(&ping);
+	check_round_trip(&pong);
+
+	/* Text as long as a frame can carry. */
+	memset(message.text, 'x', sizeof(message.text) - 1);
+	message.text[sizeof(message.text) - 1] = '\0';
+	check_round_trip(&message);
+
+	char small[16];
+
+	CHECK(fed_format(small, sizeof(small), &message) == -1);
+}
+
+static void
+check_bad_frames(void)
+{
+	static const char *lines[] = {
+		"",
+		"M",
+		"M 1",
+		"M 1 2",
+		"MM 1 2 alice hi",
+		"X 1 2 alice hi",
+		"M 0 2 alice hi",
+		"M one 2 alice hi",
+		"M 1 2x alice hi",
+		"M 1 2 aliceistoolongforaname hi",
+		"W 1 2 alice",
+		"W 1 2 alice erinistoolongforaname hi"
+	};
+	char line[BUFF_SIZE + 64];
+	Fed_frame_t frame;
+
+	for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+		strcpy(line, lines[i]);
+		CHECK(fed_parse(line, &frame) == -1);
+	}
+
+	/* Text one byte longer than a frame can carry. */
+	strcpy(line, "M 1 2 alice ");
+	memset(line + strlen(line), 'x', BUFF_SIZE);
+	line[strlen("M 1 2 alice ") + BUFF_SIZE] = '\0';
+	CHECK(fed_parse(line, &frame) == -1);
+}
+
+/*
+ * @brief Frames arriving late, twice or out of order, from several
+ * origins, are compared with a record of every one seen. Only frames
+ * FED_WINDOW or more behind the newest of their origin may be taken for
+ * seen without having been.
+ */
+static void
+check_seen(void)
+{
+	static unsigned char got[ORIGINS][SPAN];
+	unsigned long top[ORIGINS];
+	int known[ORIGINS] = { 0 };
+	unsigned long base = fed_first_seq();
+	Fed_seen_t seen;
+
+	memset(&seen, 0, sizeof(seen));
+
+	for (int run = 0; run < RUNS; ++run) {
+		unsigned int o = rand() % ORIGINS;
+		/* Mostly around the newest, now and then anywhere. */
+		long at = known[o] ? (long) top[o] + rand() % (FED_WINDOW + 8) - FED_WINDOW : 0;
+		int expected;
+
+		if (rand() % 50 == 0)
+			at = rand() % SPAN;
+
+		if (at < 0 || at >= SPAN)
+			continue;
+
+		if (!known[o] || (unsigned long) at > top[o])
+			expected = 0;
+		else if (top[o] - at >= FED_WINDOW)
+			expected = 1;
+		else
+			expected = got[o][at];
+
+		CHECK(fed_seen(&seen, 100 + o, base + at) == expected);
+
+		got[o][at] = 1;
+
+		if (!known[o] || (unsigned long) at > top[o])
+			top[o] = at;
+
+		known[o] = 1;
+	}
+}
+
+/*
+ * @brief Past FED_MAX_ORIGINS, new origins are refused, and the ones
+ * known go on as before.
+ */
+static void
+check_origins(void)
+{
+	Fed_seen_t seen;
+
+	memset(&seen, 0, sizeof(seen));
+
+	for (unsigned int o = 1; o <= FED_MAX_ORIGINS; ++o)
+		CHECK(fed_seen(&seen, o, 10) == 0);
+
+	CHECK(fed_seen(&seen, FED_MAX_ORIGINS + 1, 10) == -1);
+	CHECK(fed_seen(&seen, 1, 10) == 1);
+	CHECK(fed_seen(&seen, 1, 11) == 0);
+	CHECK(fed_seen(&seen, FED_MAX_ORIGINS, 9) == 0);
+	CHECK(fed_seen(&seen, FED_MAX_ORIGINS, 9) == 1);
+}
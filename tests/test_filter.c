@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "test.h"
+#include "../src/filter.h"
+
+#define FILTERS 300
+#define RUNS 100 /* Messages per filter. */
+#define MAX_TERMS 8
+#define MAX_LEN 300
+
+typedef struct {
+	char text[8];
+	uint8_t action;
+} Term_t;
+
+static Filter_t *load(const char *);
+static int reference(const Term_t *, const size_t, const char *, char *);
+static void check_known(void);
+static void check_errors(void);
+static void check_random(void);
+
+static const char g_actions[][5] = { "", "flag", "mask", "", "drop" };
+
+/*
+ * The automaton and the vector skips are compared with a naive search
+ * of every term at every position, on known cases and on random terms
+ * and messages over a small alphabet, so that terms overlap, share
+ * suffixes and show up everywhere in the messages.
+ */
+int
+main(void)
+{
+	srand(1);
+
+	check_known();
+	check_errors();
+	check_random();
+
+	return TEST_EXIT();
+}
+
+/*
+ * @brief Writes TERMS to a file and loads it.
+ *
+ * @return The filter; NULL on error, with errno set.
+ */
+static Filter_t *
+load(const char *terms)
+{
+	char path[] = "/tmp/test_filter.XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd == -1)
+		return NULL;
+
+	ssize_t res = write(fd, terms, strlen(terms));
+
+	close(fd);
+
+	Filter_t *f = res == (ssize_t) strlen(terms) ? filter_load(path) : NULL;
+	int e = errno;
+
+	unlink(path);
+	errno = e;
+
+	return f;
+}
+
+/*
+ * @brief What filter_apply() does, one position and one term at a time.
+ *
+ * @param[in] terms
+ * @param[in] n
+ * @param[in] msg
+ * @param[in out] out MSG with the terms to be masked masked.
+ *
+ * @return The actions of every term found, or'ed.
+ */
+static int
+reference(const Term_t *terms, const size_t n, const char *msg, char *out)
+{
+	size_t len = strlen(msg);
+	int res = FILTER_PASS;
+
+	strcpy(out, msg);
+
+	for (size_t i = 0; i < len; ++i) {
+		for (size_t t = 0; t < n; ++t) {
+			size_t tlen = strlen(terms[t].text);
+
+			if (tlen > len - i || strncasecmp(msg + i, terms[t].text, tlen) != 0)
+				continue;
+
+			res |= terms[t].action;
+
+			if (terms[t].action == FILTER_MASK)
+				memset(out + i, '*', tlen);
+		}
+	}
+
+	return res;
+}
+
+static void
+check_known(void)
+{
+	Filter_t *f = load("# Comment\n\nmask darn\n  drop   http://  \nflag buy now\nmask he\nmask she\n");
+	char msg[MAX_LEN];
+
+	CHECK(f != NULL);
+
+	if (!f)
+		return;
+
+	CHECK(f->terms == 5);
+
+	strcpy(msg, "all clear");
+	CHECK(filter_apply(f, msg, strlen(msg)) == FILTER_PASS);
+	CHECK(strcmp(msg, "all clear") == 0);
+
+	strcpy(msg, "DaRn it, darn");
+	CHECK(filter_apply(f, msg, strlen(msg)) == FILTER_MASK);
+	CHECK(strcmp(msg, "**** it, ****") == 0);
+
+	/* Overlapping terms, one a suffix of the other. */
+	strcpy(msg, "ushers");
+	CHECK(filter_apply(f, msg, strlen(msg)) == FILTER_MASK);
+	CHECK(strcmp(msg, "u***rs") == 0);
+
+	strcpy(msg, "see HTTP://x and buy now");
+	CHECK(filter_apply(f, msg, strlen(msg)) == (FILTER_DROP | FILTER_FLAG));
+
+	/* Past a NUL too: the length is what counts. */
+	memcpy(msg, "a\0darn", 7);
+	CHECK(filter_apply(f, msg, 6) == FILTER_MASK);
+	CHECK(memcmp(msg, "a\0****", 7) == 0);
+
+	filter_free(f);
+}
+
+static void
+check_errors(void)
+{
+	CHECK(!load("mask ok\nban this\n") && errno == EINVAL);
+	CHECK(!load("mask\n") && errno == EINVAL);
+	CHECK(!load("drop    \n") && errno == EINVAL);
+	CHECK(!filter_load("/nonexistent/terms") && errno == ENOENT);
+	filter_free(NULL);
+}
+
+static void
+check_random(void)
+{
+	static const char alphabet[] = "abcABCx\xe9 ";
+	Term_t terms[MAX_TERMS];
+	char file[MAX_TERMS * 16];
+	char msg[MAX_LEN + 1];
+	char got[MAX_LEN + 1];
+	char expected[MAX_LEN + 1];
+
+	for (int i = 0; i < FILTERS; ++i) {
+		size_t n = 1 + rand() % MAX_TERMS;
+
+		file[0] = '\0';
+
+		for (size_t t = 0; t < n; ++t) {
+			size_t len = 1 + rand() % 4;
+
+			for (size_t j = 0; j < len; ++j)
+				/* No spaces: they would be trimmed off the ends. */
+				terms[t].text[j] = alphabet[rand() % (sizeof(alphabet) - 2)];
+
+			terms[t].text[len] = '\0';
+			terms[t].action = 1 << (rand() % 3);
+			sprintf(file + strlen(file), "%s %s\n", g_actions[terms[t].action], terms[t].text);
+		}
+
+		Filter_t *f = load(file);
+
+		CHECK(f != NULL);
+
+		if (!f)
+			continue;
+
+		for (int run = 0; run < RUNS; ++run) {
+			size_t len = rand() % (MAX_LEN + 1);
+
+			for (size_t j = 0; j < len; ++j)
+				/* Mostly bytes that can't start a term, so the skips get long runs. */
+				msg[j] = rand() % 8 ? 'z' : alphabet[rand() % (sizeof(alphabet) - 1)];
+
+			msg[len] = '\0';
+			strcpy(got, msg);
+
+			int res = filter_apply(f, got, len);
+
+			CHECK(res == reference(terms, n, msg, expected));
+			CHECK(strcmp(got, expected) == 0);
+		}
+
+		filter_free(f);
+	}
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "../src/sanitize.h"
+
+#define RUNS 30000
+#define MAX_LEN 300
+
+static size_t reference(const unsigned char *, const size_t, unsigned char *);
+static size_t decode(const unsigned char *, const size_t);
+static size_t random_input(unsigned char *);
+static void check(const char *, const char *);
+
+/*
+ * sanitize() finds printable runs a vector at a time. Here its output is
+ * compared with that of a byte at a time version of the same rules, on
+ * known cases and on random inputs mixing every kind of byte, with runs
+ * long enough to go through the vectors and end anywhere in them.
+ */
+int
+main(void)
+{
+	unsigned char in[MAX_LEN + 1];
+	unsigned char expected[MAX_LEN + 1];
+
+	check("  hello  ", "hello");
+	check("\t\ta\tb\t", "a b");
+	check("a\x1b[31mred", "a[31mred");
+	check("del\x7f", "del");
+	check("caf\xc3\xa9", "caf\xc3\xa9");
+	check("c1\xc2\x85", "c1");
+	check("bad\xc0\xaf", "bad??");
+	check("surrogate\xed\xa0\x80", "surrogate???");
+	check("cut\xe2\x82", "cut??");
+	check("max\xf4\x8f\xbf\xbf", "max\xf4\x8f\xbf\xbf");
+	check("past\xf4\x90\x80\x80", "past????");
+	check("", "");
+	check("   ", "");
+
+	srand(1);
+
+	for (int run = 0; run < RUNS; ++run) {
+		size_t len = random_input(in);
+		size_t expected_len = reference(in, len, expected);
+
+		in[len] = '\0';
+
+		size_t got = sanitize((char *) in, len);
+
+		CHECK(got == expected_len && memcmp(in, expected, got + 1) == 0);
+	}
+
+	return TEST_EXIT();
+}
+
+/*
+ * @brief Same rules as sanitize(), one character at a time.
+ *
+ * @return The length of OUT, which gets a NUL after it.
+ */
+static size_t
+reference(const unsigned char *in, const size_t len, unsigned char *out)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < len;) {
+		unsigned char c = in[i];
+
+		if (c >= 0x80) {
+			size_t size = decode(in + i, len - i);
+
+			if (size == 0) {
+				out[n++] = '?';
+				++i;
+			} else {
+				/* C1 controls go like the others. */
+				if (!(size == 2 && c == 0xc2 && in[i + 1] < 0xa0))
+					for (size_t j = 0; j < size; ++j)
+						out[n++] = in[i + j];
+
+				i += size;
+			}
+
+			continue;
+		}
+
+		++i;
+
+		if (c == '\t')
+			c = ' ';
+		else if (c < 0x20 || c == 0x7f)
+			continue;
+
+		if (c != ' ' || n > 0)
+			out[n++] = c;
+	}
+
+	while (n > 0 && out[n - 1] == ' ')
+		--n;
+
+	out[n] = '\0';
+
+	return n;
+}
+
+/*
+ * @brief Decodes the UTF-8 character at the start of S.
+ *
+ * @return Its length; 0 if it is not a valid character.
+ */
+static size_t
+decode(const unsigned char *s, const size_t len)
+{
+	size_t size;
+	unsigned long cp;
+	static const unsigned long min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+	if ((s[0] & 0xe0) == 0xc0) {
+		size = 2;
+		cp = s[0] & 0x1f;
+	} else if ((s[0] & 0xf0) == 0xe0) {
+		size = 3;
+		cp = s[0] & 0x0f;
+	} else if ((s[0] & 0xf8) == 0xf0) {
+		size = 4;
+		cp = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (len < size)
+		return 0;
+
+	for (size_t i = 1; i < size; ++i) {
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+		cp = cp << 6 | (s[i] & 0x3f);
+	}
+
+	if (cp < min[size] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+		return 0;
+
+	return size;
+}
+
+/*
+ * @brief Fills IN with up to MAX_LEN bytes: mostly printable runs, of any
+ * length, and now and then spaces, tabs, control characters, valid
+ * characters of any length, and broken ones.
+ *
+ * @return How many.
+ */
+static size_t
+random_input(unsigned char *in)
+{
+	static const char *pieces[] = {
+		" ", "\t", "\x1b", "\x7f", "\r\n", "\xc2\x80", "\xc2\x9f", "\xc2\xa0", "\xc3\xa9",
+		"\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xed\xa0\x80", "\xe0\x80\x80",
+		"\xc0\x80", "\xf4\x90\x80\x80", "\xf8", "\xff", "\x80", "\xe2\x82", "\xf0\x9f",
+	};
+	size_t max = rand() % (MAX_LEN + 1);
+	size_t len = 0;
+
+	while (len < max) {
+		if (rand() % 3) {
+			size_t run = rand() % 70;
+
+			for (size_t i = 0; i < run && len < max; ++i)
+				in[len++] = 0x20 + rand() % 0x5f;
+		} else {
+			const char *p = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+			size_t n = strlen(p);
+
+			if (len + n > max)
+				break;
+
+			memcpy(in + len, p, n);
+			len += n;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * @brief Checks that IN comes out of sanitize() as EXPECTED.
+ */
+static void
+check(const char *in, const char *expected)
+{
+	char buff[MAX_LEN + 1];
+	size_t len = strlen(in);
+
+	memcpy(buff, in, len + 1);
+
+	size_t got = sanitize(buff, len);
+
+	if (got != strlen(expected) || strcmp(buff, expected) != 0) {
+		fprintf(stderr, "sanitize(\"%s\") gave \"%s\"\n", in, buff);
+		++g_failed;
+	}
+}
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "test.h"
+#include "../src/shmring.h"
+
+static void check_framing(Shm_link_t *, Shm_link_t *);
+static void check_full(Shm_link_t *, Shm_link_t *);
+static void check_bad(Shm_link_t *, Shm_link_t *);
+static void check_wakeup(Shm_link_t *, Shm_link_t *);
+static void check_fds(void);
+
+/*
+ * Both ends of a link live in this process: the server end from
+ * shm_link_create(), the peer end from shm_link_attach() on the same
+ * descriptors.
+ */
+int
+main(void)
+{
+	Shm_link_t server;
+	Shm_link_t peer;
+	int fds[SHM_LINK_FDS];
+
+	CHECK(shm_link_create(&server, fds) == 0);
+	CHECK(shm_link_attach(&peer, fds) == 0);
+
+	check_framing(&server, &peer);
+	check_full(&server, &peer);
+	check_bad(&server, &peer);
+	check_wakeup(&server, &peer);
+	check_fds();
+
+	shm_link_destroy(&peer);
+	shm_link_destroy(&server);
+
+	return TEST_EXIT();
+}
+
+/*
+ * @brief Messages come out whole and in order, in both directions, also
+ * when they wrap around the end of the ring.
+ */
+static void
+check_framing(Shm_link_t *server, Shm_link_t *peer)
+{
+	char out[1000];
+	char in[1000];
+
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 0);
+
+	/* 1000 rounds of up to 1000 bytes go around the ring many times. */
+	for (int i = 0; i < 1000; ++i) {
+		size_t len = 1 + (i * 7919) % sizeof(out);
+
+		memset(out, 'a' + i % 26, len);
+		CHECK(shm_link_send(server, out, len) == 0);
+		CHECK(shm_link_send(peer, out, len) == 0);
+		CHECK(shm_link_recv(peer, in, sizeof(in)) == (ssize_t) len && memcmp(in, out, len) == 0);
+		CHECK(shm_link_recv(server, in, sizeof(in)) == (ssize_t) len && memcmp(in, out, len) == 0);
+	}
+
+	CHECK(shm_link_send(server, "one", 3) == 0);
+	CHECK(shm_link_send(server, "two", 3) == 0);
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 3 && memcmp(in, "one", 3) == 0);
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 3 && memcmp(in, "two", 3) == 0);
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 0);
+}
+
+/*
+ * @brief A full ring takes nothing, not even part of a message, until the
+ * other end makes room. A message that can never fit is told apart.
+ */
+static void
+check_full(Shm_link_t *server, Shm_link_t *peer)
+{
+	static char big[SHM_RING_SIZE];
+	char in[SHM_RING_SIZE / 4];
+	int sent = 0;
+
+	memset(big, 'x', sizeof(big));
+
+	while (shm_link_send(server, big, sizeof(in) - 4) == 0)
+		++sent;
+
+	CHECK(errno == EAGAIN);
+	CHECK(sent == 4);
+
+	errno = 0;
+	CHECK(shm_link_send(server, big, sizeof(big)) == -1 && errno == EMSGSIZE);
+
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == (ssize_t) sizeof(in) - 4);
+	CHECK(shm_link_send(server, big, sizeof(in) - 4) == 0);
+
+	for (int i = 0; i < 4; ++i)
+		CHECK(shm_link_recv(peer, in, sizeof(in)) == (ssize_t) sizeof(in) - 4);
+
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 0);
+}
+
+/*
+ * @brief Messages bigger than the reader's buffer, and lengths past what
+ * the ring holds, are errors: nothing is cut, and nothing is taken.
+ */
+static void
+check_bad(Shm_link_t *server, Shm_link_t *peer)
+{
+	char in[16];
+	uint32_t head;
+	uint32_t len = 100;
+
+	CHECK(shm_link_send(server, "0123456789abcdefg", 17) == 0);
+	errno = 0;
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == -1 && errno == EPROTO);
+	errno = 0;
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == -1 && errno == EPROTO);
+
+	char all[32];
+
+	CHECK(shm_link_recv(peer, all, sizeof(all)) == 17 && memcmp(all, "0123456789abcdefg", 17) == 0);
+
+	/* A length saying more than was written. */
+	head = atomic_load(&server->out->head);
+	memcpy(server->out->data + head % SHM_RING_SIZE, &len, sizeof(len));
+	atomic_store(&server->out->head, head + sizeof(len) + 10);
+	errno = 0;
+	CHECK(shm_link_recv(peer, all, sizeof(all)) == -1 && errno == EPROTO);
+	atomic_store(&server->out->head, head);
+}
+
+/*
+ * @brief The other end gets an eventfd write only after saying it is
+ * about to wait, and can't wait while messages are there.
+ */
+static void
+check_wakeup(Shm_link_t *server, Shm_link_t *peer)
+{
+	eventfd_t n;
+	char in[8];
+
+	CHECK(shm_link_send(server, "a", 1) == 0);
+	CHECK(eventfd_read(peer->efd_in, &n) == -1 && errno == EAGAIN);
+	CHECK(shm_link_prepare_wait(peer) == 0);
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 1);
+
+	CHECK(shm_link_prepare_wait(peer) == 1);
+	CHECK(shm_link_send(server, "b", 1) == 0);
+	CHECK(eventfd_read(peer->efd_in, &n) == 0 && n == 1);
+	shm_link_finish_wait(peer);
+	CHECK(shm_link_recv(peer, in, sizeof(in)) == 1 && in[0] == 'b');
+}
+
+/*
+ * @brief Descriptors go through a unix domain socket and come out as
+ * working ones.
+ */
+static void
+check_fds(void)
+{
+	int sv[2];
+	int fds[SHM_LINK_FDS];
+	int got[SHM_LINK_FDS];
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	for (int i = 0; i < SHM_LINK_FDS; ++i)
+		fds[i] = eventfd(0, EFD_NONBLOCK);
+
+	CHECK(shm_send_fds(sv[0], fds, SHM_LINK_FDS) == 0);
+	CHECK(shm_recv_fds(sv[1], got, SHM_LINK_FDS) == 0);
+
+	for (int i = 0; i < SHM_LINK_FDS; ++i) {
+		eventfd_t n;
+
+		CHECK(eventfd_write(fds[i], i + 1) == 0);
+		CHECK(eventfd_read(got[i], &n) == 0 && n == (eventfd_t) i + 1);
+		close(fds[i]);
+		close(got[i]);
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+}
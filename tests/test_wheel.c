@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include "test.h"
+#include "../src/wheel.h"
+
+#define TIMERS 4000
+
+typedef struct {
+	Timer_t timer;
+	uint64_t fired; /* Tick it fired at. */
+	int times; /* How many times it fired. */
+	int period; /* Armed again this many ticks later; 0 if it isn't. */
+} Probe_t;
+
+static Wheel_t g_wheel;
+
+static void fire(Timer_t *);
+static void check_random(void);
+static void check_cancel(void);
+static void check_rearm(void);
+static void check_far(void);
+
+int
+main(void)
+{
+	srand(1);
+
+	check_random();
+	check_cancel();
+	check_rearm();
+	check_far();
+
+	return TEST_EXIT();
+}
+
+/*
+ * @brief Callback of every probe. The wheel moved past the tick being run
+ * already.
+ */
+static void
+fire(Timer_t *t)
+{
+	Probe_t *p = t->arg;
+
+	p->fired = g_wheel.now - 1;
+	++p->times;
+
+	if (p->period)
+		timer_arm(&g_wheel, t, p->fired + p->period);
+}
+
+/*
+ * @brief Timers at every distance, across all the levels, fire once and
+ * at their very tick, however the wheel is advanced.
+ */
+static void
+check_random(void)
+{
+	static Probe_t probes[TIMERS];
+
+	wheel_init(&g_wheel, 1000);
+
+	for (int i = 0; i < TIMERS; ++i) {
+		probes[i] = (Probe_t) { .fired = 0, .times = 0, .period = 0 };
+		timer_init(&probes[i].timer, fire, &probes[i]);
+		/* Spread over 1 to 2^20 ticks away, so every level gets some. */
+		timer_arm(&g_wheel, &probes[i].timer, 1000 + ((uint64_t) 1 << (rand() % 20)) + rand() % 64);
+	}
+
+	while (g_wheel.now < 1000 + (2 << 20))
+		wheel_advance(&g_wheel, g_wheel.now + rand() % 5000);
+
+	for (int i = 0; i < TIMERS; ++i) {
+		CHECK(probes[i].times == 1);
+		CHECK(probes[i].fired == probes[i].timer.expires);
+		CHECK(!probes[i].timer.pprev);
+	}
+}
+
+/*
+ * @brief Cancelled timers never fire, moved ones fire at their new tick
+ * only, and ones armed in the past fire on the next tick run.
+ */
+static void
+check_cancel(void)
+{
+	Probe_t a = { .times = 0, .period = 0 };
+	Probe_t b = { .times = 0, .period = 0 };
+	Probe_t c = { .times = 0, .period = 0 };
+
+	wheel_init(&g_wheel, 0);
+	timer_init(&a.timer, fire, &a);
+	timer_init(&b.timer, fire, &b);
+	timer_init(&c.timer, fire, &c);
+
+	timer_arm(&g_wheel, &a.timer, 100);
+	timer_arm(&g_wheel, &b.timer, 100);
+	timer_cancel(&a.timer);
+	timer_cancel(&a.timer);
+	timer_arm(&g_wheel, &b.timer, 5000);
+	wheel_advance(&g_wheel, 200);
+
+	CHECK(a.times == 0);
+	CHECK(b.times == 0);
+
+	timer_arm(&g_wheel, &c.timer, 10);
+	wheel_advance(&g_wheel, 201);
+	CHECK(c.times == 1 && c.fired == 201);
+
+	wheel_advance(&g_wheel, 6000);
+	CHECK(a.times == 0);
+	CHECK(b.times == 1 && b.fired == 5000);
+}
+
+/*
+ * @brief A callback arming its own timer again, in the very slot being
+ * run or in a later one, fires again at the right tick and no earlier.
+ */
+static void
+check_rearm(void)
+{
+	Probe_t every = { .times = 0, .period = 1 };
+	Probe_t round = { .times = 0, .period = WHEEL_SLOTS };
+
+	wheel_init(&g_wheel, 0);
+	timer_init(&every.timer, fire, &every);
+	timer_init(&round.timer, fire, &round);
+	timer_arm(&g_wheel, &every.timer, 1);
+	timer_arm(&g_wheel, &round.timer, 1);
+
+	wheel_advance(&g_wheel, 10 * WHEEL_SLOTS);
+
+	CHECK(every.times == 10 * WHEEL_SLOTS);
+	CHECK(every.fired == 10 * WHEEL_SLOTS);
+	CHECK(round.times == 10);
+	CHECK(round.fired == 9 * WHEEL_SLOTS + 1);
+}
+
+/*
+ * @brief Timers farther away than the wheel reaches still fire at their
+ * tick.
+ */
+static void
+check_far(void)
+{
+	uint64_t reach = (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS);
+	Probe_t far = { .times = 0, .period = 0 };
+
+	wheel_init(&g_wheel, 7);
+	timer_init(&far.timer, fire, &far);
+	timer_arm(&g_wheel, &far.timer, 7 + reach + reach / 3);
+
+	wheel_advance(&g_wheel, 7 + reach);
+	CHECK(far.times == 0);
+
+	wheel_advance(&g_wheel, 7 + 2 * reach);
+	CHECK(far.times == 1);
+	CHECK(far.fired == 7 + reach + reach / 3);
+}